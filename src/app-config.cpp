@@ -0,0 +1,267 @@
+#include "app-config.h"
+
+#include <gst/gst.h>
+
+#include <cstdio>
+
+#include "decoder-select.h"
+
+#define DEFAULT_CONFIG_FILE "virtualdev.ini"
+
+// Reads group/key into value if the file has it, a value of the wrong type
+// is an error rather than silently keeping the default.
+static bool read_string(GKeyFile* file, const gchar* group, const gchar* key,
+                        std::string* value, GError** error) {
+  GError* local_error = nullptr;
+  gchar* str = g_key_file_get_string(file, group, key, &local_error);
+  if (local_error != nullptr) {
+    // a missing key or group keeps the default
+    bool missing =
+        g_error_matches(local_error, G_KEY_FILE_ERROR,
+                        G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+        g_error_matches(local_error, G_KEY_FILE_ERROR,
+                        G_KEY_FILE_ERROR_GROUP_NOT_FOUND);
+    if (missing) {
+      g_error_free(local_error);
+      return true;
+    }
+    g_propagate_error(error, local_error);
+    return false;
+  }
+  *value = g_strstrip(str);
+  g_free(str);
+  return true;
+}
+
+static bool read_int(GKeyFile* file, const gchar* group, const gchar* key,
+                     gint* value, GError** error) {
+  if (!g_key_file_has_key(file, group, key, nullptr)) {
+    return true;
+  }
+
+  GError* local_error = nullptr;
+  gint result = g_key_file_get_integer(file, group, key, &local_error);
+  if (local_error != nullptr) {
+    g_propagate_error(error, local_error);
+    return false;
+  }
+  *value = result;
+  return true;
+}
+
+static bool read_uint(GKeyFile* file, const gchar* group, const gchar* key,
+                      guint* value, GError** error) {
+  gint result = (gint)*value;
+  if (!read_int(file, group, key, &result, error)) {
+    return false;
+  }
+  if (result < 0) {
+    g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                "[%s] %s must not be negative", group, key);
+    return false;
+  }
+  *value = (guint)result;
+  return true;
+}
+
+static bool read_bool(GKeyFile* file, const gchar* group, const gchar* key,
+                      bool* value, GError** error) {
+  if (!g_key_file_has_key(file, group, key, nullptr)) {
+    return true;
+  }
+
+  GError* local_error = nullptr;
+  gboolean result = g_key_file_get_boolean(file, group, key, &local_error);
+  if (local_error != nullptr) {
+    g_propagate_error(error, local_error);
+    return false;
+  }
+  *value = result;
+  return true;
+}
+
+static bool parse_renditions(const gchar* value,
+                             std::vector<RenditionConfig>* renditions,
+                             GError** error) {
+  std::vector<RenditionConfig> result;
+  gchar** items = g_strsplit(value, ",", -1);
+  bool ok = true;
+
+  for (gchar** item = items; *item != nullptr && ok; item++) {
+    gchar* spec = g_strstrip(*item);
+    if (*spec == '\0') {
+      continue;
+    }
+
+    RenditionConfig rendition;
+    gchar format[16] = "NV12";
+    // end is where parsing stopped, anything after it is junk
+    int end = 0;
+    if (sscanf(spec, "%ux%u%n:%15s%n", &rendition.width, &rendition.height,
+               &end, format, &end) < 2 ||
+        spec[end] != '\0' || rendition.width == 0 ||
+        rendition.height == 0) {
+      g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+                  "rendition \"%s\" is not WxH or WxH:FORMAT", spec);
+      ok = false;
+      break;
+    }
+    rendition.format = format;
+    result.push_back(rendition);
+  }
+
+  g_strfreev(items);
+  if (ok) {
+    *renditions = result;
+  }
+  return ok;
+}
+
+static bool read_renditions(GKeyFile* file, const gchar* group,
+                            const gchar* key,
+                            std::vector<RenditionConfig>* renditions,
+                            GError** error) {
+  std::string value;
+  if (!g_key_file_has_key(file, group, key, nullptr)) {
+    return true;
+  }
+  return read_string(file, group, key, &value, error) &&
+         parse_renditions(value.c_str(), renditions, error);
+}
+
+static bool load_file(AppConfig* config, const gchar* path, GError** error) {
+  GKeyFile* file = g_key_file_new();
+  bool ok = g_key_file_load_from_file(file, path, G_KEY_FILE_NONE, error) &&
+            read_string(file, "pipeline", "description", &config->pipeline,
+                        error) &&
+            read_string(file, "source", "uri", &config->uri, error) &&
+            read_int(file, "source", "latency", &config->latency, error) &&
+            read_int(file, "source", "protocols", &config->protocols,
+                     error) &&
+            read_string(file, "video", "decoder", &config->decoder, error) &&
+            read_uint(file, "video", "threads", &config->threads, error) &&
+            read_bool(file, "video", "decode-stats", &config->decode_stats,
+                      error) &&
+            read_string(file, "video", "caps", &config->caps, error) &&
+            read_string(file, "audio", "source", &config->audio, error) &&
+            read_uint(file, "camera", "instance", &config->instance, error) &&
+            read_uint(file, "camera", "slots", &config->slots, error) &&
+            read_renditions(file, "camera", "renditions",
+                            &config->renditions, error);
+  g_key_file_unref(file);
+  return ok;
+}
+
+bool app_config_load(AppConfig* config, int* argc, char*** argv,
+                     GError** error) {
+  // the command line wins over the file, so it is parsed first into values
+  // that tell "not given" apart
+  gchar* config_file = nullptr;
+  gchar* pipeline = nullptr;
+  gchar* uri = nullptr;
+  gint latency = -1;
+  gchar* decoder = nullptr;
+  gint threads = -1;
+  gboolean decode_stats = FALSE;
+  gchar* caps = nullptr;
+  gchar* audio = nullptr;
+  gboolean no_audio = FALSE;
+  gint instance = -1;
+  gint slots = -1;
+  gchar* renditions = nullptr;
+
+  GOptionEntry entries[] = {
+      {"config", 'c', 0, G_OPTION_ARG_FILENAME, &config_file,
+       "Config file, default " DEFAULT_CONFIG_FILE " if it exists", "FILE"},
+      {"pipeline", 'p', 0, G_OPTION_ARG_STRING, &pipeline,
+       "Whole pipeline, needs an appsink named videosink", "DESC"},
+      {"uri", 'u', 0, G_OPTION_ARG_STRING, &uri, "RTSP source", "URI"},
+      {"latency", 'l', 0, G_OPTION_ARG_INT, &latency,
+       "rtspsrc jitter buffer in ms", "MS"},
+      {"decoder", 'd', 0, G_OPTION_ARG_STRING, &decoder,
+       "H.264 decoder, auto picks one", "ELEMENT"},
+      {"decoder-threads", 't', 0, G_OPTION_ARG_INT, &threads,
+       "Software decoder threads, 0 for one per core", "N"},
+      {"decode-stats", 0, 0, G_OPTION_ARG_NONE, &decode_stats,
+       "Log decode times against the frame interval", nullptr},
+      {"caps", 0, 0, G_OPTION_ARG_STRING, &caps, "Decoder output caps",
+       "CAPS"},
+      {"audio", 'a', 0, G_OPTION_ARG_STRING, &audio, "Audio source",
+       "DESC"},
+      {"no-audio", 0, 0, G_OPTION_ARG_NONE, &no_audio,
+       "Don't feed the virtual microphone", nullptr},
+      {"instance", 'i', 0, G_OPTION_ARG_INT, &instance,
+       "Virtual camera to publish to, 0 is the first", "N"},
+      {"slots", 's', 0, G_OPTION_ARG_INT, &slots, "Frame slots in the queue",
+       "N"},
+      {"renditions", 'r', 0, G_OPTION_ARG_STRING, &renditions,
+       "Also publish frames scaled to these, e.g. 1280x720:YUY2,640x360:I420",
+       "LIST"},
+      {nullptr}};
+
+  GOptionContext* context =
+      g_option_context_new("- bridge a GStreamer source to a virtual camera");
+  g_option_context_add_main_entries(context, entries, nullptr);
+  g_option_context_add_group(context, gst_init_get_option_group());
+  bool ok = g_option_context_parse(context, argc, argv, error);
+  g_option_context_free(context);
+
+  if (ok) {
+    if (config_file != nullptr) {
+      ok = load_file(config, config_file, error);
+    } else if (g_file_test(DEFAULT_CONFIG_FILE, G_FILE_TEST_IS_REGULAR)) {
+      ok = load_file(config, DEFAULT_CONFIG_FILE, error);
+    }
+  }
+
+  if (ok) {
+    if (pipeline != nullptr) config->pipeline = pipeline;
+    if (uri != nullptr) config->uri = uri;
+    if (latency >= 0) config->latency = latency;
+    if (decoder != nullptr) config->decoder = decoder;
+    if (threads >= 0) config->threads = (guint)threads;
+    if (decode_stats) config->decode_stats = true;
+    if (caps != nullptr) config->caps = caps;
+    if (audio != nullptr) config->audio = audio;
+    if (no_audio) config->audio.clear();
+    if (instance >= 0) config->instance = (guint)instance;
+    if (slots >= 0) config->slots = (guint)slots;
+    if (renditions != nullptr) {
+      ok = parse_renditions(renditions, &config->renditions, error);
+    }
+  }
+
+  g_free(config_file);
+  g_free(pipeline);
+  g_free(uri);
+  g_free(decoder);
+  g_free(caps);
+  g_free(audio);
+  g_free(renditions);
+  return ok;
+}
+
+std::string app_config_pipeline(const AppConfig& config) {
+  if (!config.pipeline.empty()) {
+    return config.pipeline;
+  }
+
+  gchar* video = g_strdup_printf(
+      "rtspsrc location=%s latency=%d protocols=%d ! queue name=rtp ! "
+      "rtph264depay ! h264parse ! queue ! %s name=decoder%s ! queue ! %s ! "
+      "queue ! appsink name=videosink",
+      config.uri.c_str(), config.latency, config.protocols,
+      config.decoder.c_str(),
+      // software decoders mostly put out I420
+      decoder_is_hardware(config.decoder) ? "" : " ! videoconvert",
+      config.caps.c_str());
+  std::string desc = video;
+  g_free(video);
+
+  if (!config.audio.empty()) {
+    desc += " " + config.audio +
+            " ! audioconvert ! audio/x-raw,format=S16LE,layout=interleaved ! "
+            "queue ! appsink name=audiosink";
+  }
+  return desc;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <glib.h>
+
+#include <string>
+#include <vector>
+
+// A size and format the writer scales every frame to itself, next to the
+// camera's own queue.
+struct RenditionConfig {
+  guint width = 0;
+  guint height = 0;
+  // GStreamer format name, NV12, I420 or YUY2
+  std::string format = "NV12";
+};
+
+// Everything about the stream that used to be compiled in. Values come from
+// the defaults below, then the config file, then the command line.
+struct AppConfig {
+  // Full gst-launch style description. When set it is used as is and the
+  // source/decoder/caps/audio settings are ignored, it needs an appsink named
+  // "videosink" and may have one named "audiosink".
+  std::string pipeline;
+
+  // [source]
+  std::string uri = "rtsp://172.16.30.55/1";
+  gint latency = 50;
+  // GstRTSPLowerTrans flags, 4 is TCP
+  gint protocols = 4;
+
+  // [video] "auto" picks a hardware decoder if one works and a software one
+  // otherwise, see decoder_select
+  std::string decoder = "auto";
+  // software decoder threads, 0 for one per core up to a limit
+  guint threads = 0;
+  // logs decode times against the frame interval
+  bool decode_stats = false;
+  // Constrains what the decoder outputs, the virtual camera takes its size
+  // and frame rate from whatever gets negotiated.
+  std::string caps = "video/x-raw,format=NV12";
+
+  // [audio] source part of the audio branch, empty for no microphone
+  std::string audio = "audiotestsrc is-live=true wave=sine";
+
+  // [camera]
+  guint instance = 0;
+  // 0 keeps the queue's default
+  guint slots = 0;
+  // "WxH" or "WxH:FORMAT" separated by commas, e.g. 1280x720:YUY2,640x360:I420
+  std::vector<RenditionConfig> renditions;
+};
+
+// Fills config from the file given with --config (or virtualdev.ini in the
+// working directory if it exists) and the command line. Also adds and
+// handles GStreamer's own options, so gst_init is done when this returns
+// true.
+bool app_config_load(AppConfig* config, int* argc, char*** argv,
+                     GError** error);
+
+// config.decoder must not be "auto" anymore
+std::string app_config_pipeline(const AppConfig& config);
@@ -0,0 +1,254 @@
+/* writes a frame with an odd height through a queue in every format and reads
+ * it back in every target format, at the same size and scaled.  each row of
+ * the source has its own luma and each chroma row its own chroma, so a last
+ * row that picks up the wrong chroma shows, and the bytes after each output
+ * are compared too, so a conversion writing past it fails as well. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shared-memory-queue.h"
+#include "tiny-nv12-scale.h"
+
+#define CX 16
+#define CY 5
+#define GUARD 64
+#define GUARD_BYTE 0xA5
+
+/* the last instance, the least likely to be in use by a real camera */
+#define INDEX (MAX_QUEUE_INSTANCES - 1)
+
+static const char *queue_names[] = {"nv12", "i420", "yuy2", "p010", "rgba"};
+static const char *target_names[] = {"nv12", "i420", "yuy2"};
+
+static int failures;
+
+static void fail(enum queue_format format, enum target_format target, int cx,
+		 int cy, const char *what)
+{
+	fprintf(stderr, "%s to %s %dx%d: %s\n", queue_names[format],
+		target_names[target], cx, cy, what);
+	failures++;
+}
+
+static uint8_t luma(int y)
+{
+	return (uint8_t)(16 + y * 40);
+}
+
+/* chroma row y2 covers rows y2 * 2 and y2 * 2 + 1 */
+static uint8_t chroma_u(int y2)
+{
+	return (uint8_t)(64 + y2 * 40);
+}
+
+static uint8_t chroma_v(int y2)
+{
+	return (uint8_t)(192 - y2 * 40);
+}
+
+/* the frame in the queue's own layout, rgba is plain gray */
+static void fill_frame(enum queue_format format, uint8_t *frame)
+{
+	struct queue_plane planes[QUEUE_MAX_PLANES];
+	queue_format_planes(format, CX, CY, planes);
+
+	switch (format) {
+	case QUEUE_FORMAT_NV12:
+	case QUEUE_FORMAT_P010: {
+		const int bytes = format == QUEUE_FORMAT_P010 ? 2 : 1;
+		uint8_t *uv = frame + planes[1].offset;
+
+		for (uint32_t y = 0; y < planes[0].rows; y++) {
+			uint8_t *row = frame + planes[0].offset +
+				       y * planes[0].width;
+			for (int x = 0; x < CX; x++)
+				row[x * bytes + bytes - 1] = luma(y);
+		}
+		for (uint32_t y = 0; y < planes[1].rows; y++) {
+			uint8_t *row = uv + y * planes[1].width;
+			for (int x = 0; x < CX; x += 2) {
+				row[x * bytes + bytes - 1] = chroma_u(y);
+				row[(x + 1) * bytes + bytes - 1] = chroma_v(y);
+			}
+		}
+		break;
+	}
+	case QUEUE_FORMAT_I420:
+		for (uint32_t y = 0; y < planes[0].rows; y++)
+			memset(frame + planes[0].offset + y * planes[0].width,
+			       luma(y), planes[0].width);
+		for (uint32_t y = 0; y < planes[1].rows; y++) {
+			memset(frame + planes[1].offset + y * planes[1].width,
+			       chroma_u(y), planes[1].width);
+			memset(frame + planes[2].offset + y * planes[2].width,
+			       chroma_v(y), planes[2].width);
+		}
+		break;
+	case QUEUE_FORMAT_YUY2:
+		for (int y = 0; y < CY; y++) {
+			uint8_t *row = frame + y * planes[0].width;
+			for (int x = 0; x < CX; x += 2) {
+				row[x * 2] = luma(y);
+				row[x * 2 + 1] = chroma_u(y / 2);
+				row[x * 2 + 2] = luma(y);
+				row[x * 2 + 3] = chroma_v(y / 2);
+			}
+		}
+		break;
+	case QUEUE_FORMAT_RGBA:
+		memset(frame, 0x80, planes[0].width * planes[0].rows);
+		break;
+	default:
+		break;
+	}
+}
+
+/* the output layout doesn't round chroma up, an odd last row has none of its
+ * own in nv12 and i420 */
+static size_t target_size(enum target_format target, int cx, int cy)
+{
+	const size_t size = (size_t)cx * cy;
+	return target == TARGET_FORMAT_YUY2 ? size * 2 : size * 3 / 2;
+}
+
+static void check_same_size(enum queue_format format,
+			    enum target_format target, const uint8_t *out)
+{
+	const uint8_t *u = out + CX * CY;
+
+	for (int y = 0; y < CY; y++) {
+		for (int x = 0; x < CX; x++) {
+			uint8_t expect_y = luma(y);
+			uint8_t got_y = target == TARGET_FORMAT_YUY2
+						? out[(y * CX + x) * 2]
+						: out[y * CX + x];
+			if (got_y != expect_y) {
+				fail(format, target, CX, CY, "luma differs");
+				return;
+			}
+		}
+	}
+
+	for (int y = 0; y < CY; y++) {
+		const int y2 = y / 2;
+		uint8_t got_u, got_v;
+
+		if (target == TARGET_FORMAT_YUY2) {
+			got_u = out[y * CX * 2 + 1];
+			got_v = out[y * CX * 2 + 3];
+		} else if (y2 == CY / 2) {
+			continue;
+		} else if (target == TARGET_FORMAT_I420) {
+			got_u = u[y2 * (CX / 2)];
+			got_v = u[CX * CY / 4 + y2 * (CX / 2)];
+		} else {
+			got_u = u[y2 * CX];
+			got_v = u[y2 * CX + 1];
+		}
+
+		if (got_u != chroma_u(y2) || got_v != chroma_v(y2)) {
+			fail(format, target, CX, CY, "chroma differs");
+			return;
+		}
+	}
+}
+
+static void test_format(enum queue_format format)
+{
+	video_queue_t *writer =
+		video_queue_create_format(INDEX, CX, CY, 333333, 0, format);
+	if (!writer) {
+		fprintf(stderr, "%s: can't create queue %d\n",
+			queue_names[format], INDEX);
+		failures++;
+		return;
+	}
+
+	struct queue_plane planes[QUEUE_MAX_PLANES];
+	uint32_t count = queue_format_planes(format, CX, CY, planes);
+	uint8_t *frame = calloc(1, queue_frame_size(format, CX, CY));
+	uint8_t *data[QUEUE_MAX_PLANES];
+	uint32_t linesize[QUEUE_MAX_PLANES];
+	uint64_t timestamp = 0;
+
+	fill_frame(format, frame);
+	for (uint32_t i = 0; i < count; i++) {
+		data[i] = frame + planes[i].offset;
+		linesize[i] = planes[i].width;
+	}
+	video_queue_write(writer, data, linesize, timestamp);
+
+	video_queue_t *reader = video_queue_open(INDEX);
+	if (!reader || video_queue_state(reader) != SHARED_QUEUE_STATE_READY) {
+		fprintf(stderr, "%s: can't read queue %d\n",
+			queue_names[format], INDEX);
+		failures++;
+		video_queue_close(reader);
+		video_queue_close(writer);
+		free(frame);
+		return;
+	}
+
+	static const struct {
+		int cx;
+		int cy;
+	} sizes[] = {{CX, CY}, {CX / 2, 3}, {CX / 2, 1}, {CX * 2, 9}};
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (int target = 0; target <= TARGET_FORMAT_YUY2; target++) {
+			for (int filter = 0; filter <= SCALE_FILTER_AREA;
+			     filter++) {
+				const int cx = sizes[i].cx;
+				const int cy = sizes[i].cy;
+				const size_t size = target_size(target, cx, cy);
+				uint8_t *out = malloc(size + GUARD);
+				nv12_scale_t scale = {0};
+				uint64_t ts;
+
+				memset(out, GUARD_BYTE, size + GUARD);
+				nv12_scale_init(&scale, target, cx, cy, CX, CY);
+				scale.filter = filter;
+
+				/* a frame read too often counts as a stall */
+				timestamp += 33333333;
+				video_queue_write(writer, data, linesize,
+						  timestamp);
+
+				if (!video_queue_read(reader, &scale, out,
+						      &ts))
+					fail(format, target, cx, cy,
+					     "read failed");
+				else if (cx == CX && cy == CY &&
+					 format != QUEUE_FORMAT_RGBA)
+					check_same_size(format, target, out);
+
+				for (size_t j = size; j < size + GUARD; j++) {
+					if (out[j] != GUARD_BYTE) {
+						fail(format, target, cx, cy,
+						     "wrote past the output");
+						break;
+					}
+				}
+
+				nv12_scale_free(&scale);
+				free(out);
+			}
+		}
+	}
+
+	video_queue_close(reader);
+	video_queue_close(writer);
+	free(frame);
+}
+
+int main(void)
+{
+	for (int format = 0; format < QUEUE_FORMAT_COUNT; format++)
+		test_format((enum queue_format)format);
+
+	if (!failures)
+		printf("odd sizes checked\n");
+
+	return failures ? 1 : 0;
+}
@@ -1,11 +1,86 @@
+#ifdef _WIN32
 #include <windows.h>
+#else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* F_OFD_SETLK */
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "shared-memory-queue.h"
 #include "tiny-nv12-scale.h"
 
+#ifdef _WIN32
 #define VIDEO_NAME L"TestVirtualCamVideo"
+#define AUDIO_NAME L"TestVirtualCamAudio"
+typedef wchar_t queue_char_t;
+#else
+#define VIDEO_NAME "/TestVirtualCamVideo"
+#define AUDIO_NAME "/TestVirtualCamAudio"
+typedef char queue_char_t;
+#endif
+
+#define QUEUE_NAME_SIZE 64
 
 enum queue_type {
 	SHARED_QUEUE_TYPE_VIDEO,
+	SHARED_QUEUE_TYPE_AUDIO,
+};
+
+/* the writer's current queue_clock mapping, odd seq while it changes */
+struct clock_params {
+	uint64_t base_time;
+	uint64_t base_mono;
+	int64_t drift_ppb;
+};
+
+struct clock_mapping {
+	volatile uint32_t seq;
+	uint32_t reserved;
+	struct clock_params params;
+};
+
+/* one entry per attached reader, claimed by swapping in the reader's pid */
+struct queue_reader {
+	volatile uint32_t pid;
+
+	/* slot index + 1 while the reader is copying from it, 0 otherwise.
+	 * the writer won't start on a slot with pins, this is the slot's
+	 * reference count spread over the readers. */
+	volatile uint32_t pinned;
+
+	/* read_idx of the last frame this reader took */
+	volatile uint32_t cursor;
+
+	/* rendition_key of the shared rendition the reader has open, 0 for
+	 * none */
+	volatile uint32_t rendition;
+};
+
+/* running totals for monitoring, see struct queue_stats */
+struct shared_stats {
+	volatile uint64_t written;
+	volatile uint64_t pinned_drops;
+	volatile uint64_t copy_time;
+	volatile uint64_t read;
+	volatile uint64_t duplicates;
+	volatile uint64_t overwritten;
+	volatile uint64_t torn;
+	volatile uint64_t scale_time;
+	volatile uint64_t shared_hits;
 };
 
 struct queue_header {
@@ -13,7 +88,11 @@ struct queue_header {
 	volatile uint32_t read_idx;
 	volatile uint32_t state;
 
-	uint32_t offsets[3];
+	/* bumped once per published frame, readers block on it */
+	volatile uint32_t wake_seq;
+
+	uint32_t slots;
+	uint32_t offsets[MAX_QUEUE_SLOTS];
 
 	uint32_t type;
 
@@ -21,205 +100,2591 @@ struct queue_header {
 	uint32_t cy;
 	uint64_t interval;
 
-	uint32_t reserved[8];
+	struct clock_mapping clock;
+
+	struct shared_stats stats;
+
+	/* enum queue_format */
+	uint32_t format;
+
+	/* differs between writer runs, names the shared renditions */
+	uint32_t session;
+	uint32_t reserved[6];
+
+	/* queues next to this one with frames the writer scaled itself, see
+	 * video_queue_add_rendition.  count goes up after the entry is in. */
+	volatile uint32_t rendition_count;
+	struct queue_rendition renditions[QUEUE_MAX_RENDITIONS];
+
+	struct queue_reader readers[MAX_QUEUE_READERS];
+
+	/* filled in by the readers, see video_queue_record_trace */
+	struct latency_histogram latency[QUEUE_LATENCY_SPANS];
 };
 
-struct video_queue {
+/* at the start of every slot, FRAME_HEADER_SIZE bytes */
+struct frame_header {
+	uint64_t timestamp;
+
+	/* odd while the writer is filling the slot, bumped again once it is
+	 * done.  a reader that sees the same even value before and after
+	 * copying got a whole frame. */
+	volatile uint32_t seq;
+
+	/* counts the frames the writer published, gaps are frames a reader
+	 * never got to */
+	uint32_t number;
+
+	/* reference time the timestamp maps to, see queue_clock */
+	uint64_t mono;
+
+	/* queue_trace stages up to WRITTEN */
+	uint64_t trace[QUEUE_TRACE_WRITTEN + 1];
+};
+
+/* the mapping and wakeup state shared by the video and audio queues */
+struct shm_queue {
+	/* base name for the first instance, with 2, 3... appended after that */
+	queue_char_t name[QUEUE_NAME_SIZE];
+
+#ifdef _WIN32
 	HANDLE handle;
+	HANDLE wake[2];
+#else
+	int fd;
+	size_t size;
+
+	/* writers: the lock object held for as long as the writer lives */
+	int lock_fd;
+#endif
+	void *ptr;
+
+	/* the header word readers block on */
+	volatile uint32_t *wake_seq;
+
+	bool is_writer;
+
+	/* shared renditions: no single writer, every process that maps it
+	 * fills it and waits on it alike */
+	bool shared;
+
+	/* readers: false if the mapping could only be opened read only */
+	bool writable;
+};
+
+/* a reader's frames converted for one (format, size, filter), shared with the
+ * other readers that want the same.  the data follows the header. */
+struct rendition_header {
+	/* odd while a reader copies a frame in, like frame_header's */
+	volatile uint32_t seq;
+
+	/* frame_header number of the frame in the buffer, 0 for none */
+	volatile uint32_t number;
+
+	/* number of the frame a reader is converting for the buffer right
+	 * now, the others wait for it instead of converting it too */
+	volatile uint32_t claim;
+
+	/* bumped when a claim is filled or given up, the waiters block on it */
+	volatile uint32_t wake_seq;
+
+	uint32_t format;
+	uint32_t cx;
+	uint32_t cy;
+	uint32_t filter;
+
+	/* written last by the reader that created it, 0 until then */
+	volatile uint32_t size;
+};
+
+#define RENDITION_HEADER_SIZE 64
+
+/* how long a reader waits for another one that is converting the same frame
+ * before it converts it itself, 100ns units */
+#define RENDITION_WAIT 50000
+
+/* reads between attempts to open a rendition that could not be opened */
+#define RENDITION_RETRY 30
+
+struct rendition {
+	struct shm_queue shm;
+	struct rendition_header *header;
+	uint8_t *data;
+
+	/* what the mapping is for, size 0 while there is none */
+	enum target_format format;
+	int cx;
+	int cy;
+	enum scale_filter filter;
+	size_t size;
+
+	/* reads left until the next attempt after a failed one */
+	uint32_t retry;
+};
+
+struct video_queue {
+	struct shm_queue shm;
+
 	bool ready_to_read;
+	struct queue_reader *reader;
+	uint32_t last_wake;
 	struct queue_header *header;
-	uint64_t *ts[3];
-	uint8_t *frame[3];
-	long last_inc;
+	uint32_t slots;
+	enum queue_format format;
+	uint32_t plane_count;
+	struct queue_plane planes[QUEUE_MAX_PLANES];
+	size_t frame_size;
+	struct frame_header *fh[MAX_QUEUE_SLOTS];
+	uint8_t *frame[MAX_QUEUE_SLOTS];
+	uint32_t last_inc;
 	int dup_counter;
-	bool is_writer;
+
+	/* reader side torn frame statistics */
+	uint64_t torn_retried;
+	uint64_t torn_shown;
+
+	/* writer side, frames dropped because every free slot was pinned */
+	uint64_t pinned_drops;
+
+	/* writer: own_clock unless video_queue_set_clock gave another one */
+	struct queue_clock own_clock;
+	struct queue_clock *clock;
+
+	/* writer: stages before WRITTEN for the next frame */
+	uint64_t next_trace[QUEUE_TRACE_WRITTEN];
+	uint32_t number;
+
+	/* writer of a rendition: number of the frame it was last scaled from */
+	uint32_t scaled_from;
+
+	/* reader: trace of the frame read last, trace_new until it is taken */
+	struct queue_trace trace;
+	bool trace_new;
+	uint32_t last_number;
+
+	/* reader: see video_queue_share_renditions */
+	bool share_renditions;
+	struct rendition rendition;
+};
+
+/* positions count frames since the queue was created and wrap around, the
+ * ring offset of a position is pos & (capacity - 1).  the writer only moves
+ * write_pos and the reader only moves read_pos, like circlebuf's end_pos and
+ * start_pos, with write_pos - read_pos frames queued. */
+struct audio_header {
+	/* owned by the writer */
+	volatile uint32_t write_pos;
+	volatile uint32_t state;
+	volatile uint32_t wake_seq;
+
+	/* frames that didn't fit while a reader was attached */
+	volatile uint32_t dropped;
+
+	/* timestamp (ns) of the frame at ts_pos, odd ts_seq while changing */
+	volatile uint32_t ts_seq;
+	uint32_t ts_pos;
+	uint64_t ts;
+
+	struct clock_mapping clock;
+
+	uint32_t type;
+	uint32_t sample_rate;
+	uint32_t channels;
+	uint32_t format;
+	uint32_t frame_size;
+	uint32_t capacity;
+	uint32_t data_offset;
+	uint32_t reserved[9];
+
+	/* owned by the reader, kept off the writer's cache line */
+	volatile uint32_t read_pos;
+	volatile uint32_t reader_pid;
+	uint32_t reader_reserved[14];
+};
+
+struct audio_queue {
+	struct shm_queue shm;
+	struct audio_header *header;
+	uint8_t *data;
+
+	uint32_t capacity;
+	uint32_t frame_size;
+	uint32_t sample_rate;
+
+	/* writer: READY is set along with the first frames */
+	bool started;
+	struct queue_clock own_clock;
+	struct queue_clock *clock;
+
+	/* reader: owns the header's read_pos once attached */
+	bool attached;
+	uint32_t read_pos;
+	uint32_t dropped_base;
+	uint64_t skipped;
 };
 
 #define ALIGN_SIZE(size, align) size = (((size) + (align - 1)) & (~(align - 1)))
-#define FRAME_HEADER_SIZE 32
+#define FRAME_HEADER_SIZE 64
+
+/* how often a read is redone from the latest slot after it got torn */
+#define READ_RETRIES 2
 
-video_queue_t *video_queue_create(uint32_t cx, uint32_t cy, uint64_t interval)
+/* upper bound for the audio ring, in frames */
+#define AUDIO_MAX_CAPACITY (1u << 20)
+
+/* ------------------------------------------------------------------------- */
+/* atomics                                                                   */
+
+/* the header and frame sequence numbers are shared with other processes, so
+ * these work on the mapped memory directly rather than through os_atomic */
+#ifdef _WIN32
+static inline uint32_t load_relaxed(volatile uint32_t *ptr)
 {
-	struct video_queue vq = {0};
-	struct video_queue *pvq;
-	DWORD frame_size = cx * cy * 3 / 2;
-	uint32_t offset_frame[3];
-	DWORD size;
+	return (uint32_t)ReadNoFence((volatile LONG *)ptr);
+}
 
-	size = sizeof(struct queue_header);
+static inline uint32_t load_acquire(volatile uint32_t *ptr)
+{
+	return (uint32_t)ReadAcquire((volatile LONG *)ptr);
+}
 
-	ALIGN_SIZE(size, 32);
+static inline void store_relaxed(volatile uint32_t *ptr, uint32_t val)
+{
+	WriteNoFence((volatile LONG *)ptr, (LONG)val);
+}
 
-	offset_frame[0] = size;
-	size += frame_size + FRAME_HEADER_SIZE;
-	ALIGN_SIZE(size, 32);
+static inline void store_release(volatile uint32_t *ptr, uint32_t val)
+{
+	WriteRelease((volatile LONG *)ptr, (LONG)val);
+}
 
-	offset_frame[1] = size;
-	size += frame_size + FRAME_HEADER_SIZE;
-	ALIGN_SIZE(size, 32);
+static inline bool compare_swap(volatile uint32_t *ptr, uint32_t old_val,
+				uint32_t new_val)
+{
+	return InterlockedCompareExchange((volatile LONG *)ptr, (LONG)new_val,
+					  (LONG)old_val) == (LONG)old_val;
+}
 
-	offset_frame[2] = size;
-	size += frame_size + FRAME_HEADER_SIZE;
-	ALIGN_SIZE(size, 32);
+static inline void fetch_add(volatile uint32_t *ptr, uint32_t val)
+{
+	InterlockedExchangeAdd((volatile LONG *)ptr, (LONG)val);
+}
 
-	struct queue_header header = {0};
+static inline void fetch_add64(volatile uint64_t *ptr, uint64_t val)
+{
+	InterlockedExchangeAdd64((volatile LONG64 *)ptr, (LONG64)val);
+}
 
-	header.state = SHARED_QUEUE_STATE_STARTING;
-	header.cx = cx;
-	header.cy = cy;
-	header.interval = interval;
-	vq.is_writer = true;
+static inline uint64_t load_relaxed64(volatile uint64_t *ptr)
+{
+	return (uint64_t)ReadNoFence64((volatile LONG64 *)ptr);
+}
 
-	for (size_t i = 0; i < 3; i++) {
-		uint32_t off = offset_frame[i];
-		header.offsets[i] = off;
-	}
+#define fence_acquire() MemoryBarrier()
+#define fence_release() MemoryBarrier()
+#define fence_full() MemoryBarrier()
+#else
+static inline uint32_t load_relaxed(volatile uint32_t *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+}
 
-	/* fail if already in use */
-	vq.handle = OpenFileMappingW(FILE_MAP_READ, false, VIDEO_NAME);
-	if (vq.handle) {
-		CloseHandle(vq.handle);
-		return NULL;
-	}
+static inline uint32_t load_acquire(volatile uint32_t *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
 
-	vq.handle = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL,
-				       PAGE_READWRITE, 0, size, VIDEO_NAME);
-	if (!vq.handle) {
-		return NULL;
-	}
+static inline void store_relaxed(volatile uint32_t *ptr, uint32_t val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_RELAXED);
+}
 
-	vq.header = (struct queue_header *)MapViewOfFile(
-		vq.handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
-	if (!vq.header) {
-		CloseHandle(vq.handle);
-		return NULL;
-	}
-	memcpy(vq.header, &header, sizeof(header));
+static inline void store_release(volatile uint32_t *ptr, uint32_t val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
 
-	for (size_t i = 0; i < 3; i++) {
-		uint32_t off = offset_frame[i];
-		vq.ts[i] = (uint64_t *)(((uint8_t *)vq.header) + off);
-		vq.frame[i] = ((uint8_t *)vq.header) + off + FRAME_HEADER_SIZE;
-	}
-	pvq = malloc(sizeof(vq));
-	if (!pvq) {
-		CloseHandle(vq.handle);
-		return NULL;
-	}
-	memcpy(pvq, &vq, sizeof(vq));
-	return pvq;
+static inline bool compare_swap(volatile uint32_t *ptr, uint32_t old_val,
+				uint32_t new_val)
+{
+	return __atomic_compare_exchange_n(ptr, &old_val, new_val, false,
+					   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
 }
 
-video_queue_t *video_queue_open()
+static inline void fetch_add(volatile uint32_t *ptr, uint32_t val)
 {
-	struct video_queue vq = {0};
+	__atomic_fetch_add(ptr, val, __ATOMIC_RELAXED);
+}
 
-	vq.handle = OpenFileMappingW(FILE_MAP_READ, false, VIDEO_NAME);
-	if (!vq.handle) {
-		return NULL;
+static inline void fetch_add64(volatile uint64_t *ptr, uint64_t val)
+{
+	__atomic_fetch_add(ptr, val, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t load_relaxed64(volatile uint64_t *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+}
+
+#define fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define fence_full() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+static void queue_set_name(struct shm_queue *shm, const queue_char_t *base,
+			   uint32_t index)
+{
+#ifdef _WIN32
+	if (index)
+		swprintf(shm->name, QUEUE_NAME_SIZE, L"%ls%u", base, index + 1);
+	else
+		swprintf(shm->name, QUEUE_NAME_SIZE, L"%ls", base);
+#else
+	if (index)
+		snprintf(shm->name, QUEUE_NAME_SIZE, "%s%u", base, index + 1);
+	else
+		snprintf(shm->name, QUEUE_NAME_SIZE, "%s", base);
+#endif
+}
+
+/* the writer's own renditions of queue 'name' */
+static void rendition_set_name(struct shm_queue *shm, const queue_char_t *name,
+			       uint32_t rendition)
+{
+#ifdef _WIN32
+	swprintf(shm->name, QUEUE_NAME_SIZE, L"%.40lsScaled%u", name,
+		 rendition);
+#else
+	snprintf(shm->name, QUEUE_NAME_SIZE, "%.40sScaled%u", name,
+		 rendition);
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+/* platform mapping                                                          */
+
+#ifdef _WIN32
+
+static bool shm_create(struct shm_queue *shm, size_t size)
+{
+	/* fail if already in use */
+	shm->handle = OpenFileMappingW(FILE_MAP_READ, false, shm->name);
+	if (shm->handle) {
+		CloseHandle(shm->handle);
+		return false;
 	}
 
-	vq.header = (struct queue_header *)MapViewOfFile(
-		vq.handle, FILE_MAP_READ, 0, 0, 0);
-	if (!vq.header) {
-		CloseHandle(vq.handle);
-		return NULL;
+	shm->handle = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL,
+					PAGE_READWRITE, 0, (DWORD)size,
+					shm->name);
+	if (!shm->handle) {
+		return false;
 	}
 
-	struct video_queue *pvq = malloc(sizeof(vq));
-	if (!pvq) {
-		CloseHandle(vq.handle);
-		return NULL;
+	shm->ptr = MapViewOfFile(shm->handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (!shm->ptr) {
+		CloseHandle(shm->handle);
+		return false;
 	}
-	memcpy(pvq, &vq, sizeof(vq));
-	return pvq;
+
+	return true;
 }
 
-void video_queue_close(video_queue_t *vq)
+static bool shm_open_existing(struct shm_queue *shm, size_t min_size,
+			      bool read_only)
 {
-	if (!vq) {
-		return;
+	(void)min_size;
+
+	/* write access is only needed to join the reader registry, a reader
+	 * that doesn't get it still works, it just can't pin slots */
+	DWORD access = FILE_MAP_READ | FILE_MAP_WRITE;
+
+	shm->handle = read_only ? NULL
+				: OpenFileMappingW(access, false, shm->name);
+	if (!shm->handle) {
+		access = FILE_MAP_READ;
+		shm->handle = OpenFileMappingW(access, false, shm->name);
 	}
-	if (vq->is_writer) {
-		vq->header->state = SHARED_QUEUE_STATE_STOPPING;
+	if (!shm->handle) {
+		return false;
 	}
 
-	UnmapViewOfFile(vq->header);
-	CloseHandle(vq->handle);
-	free(vq);
+	shm->ptr = MapViewOfFile(shm->handle, access, 0, 0, 0);
+	if (!shm->ptr) {
+		CloseHandle(shm->handle);
+		return false;
+	}
+
+	shm->writable = (access & FILE_MAP_WRITE) != 0;
+	return true;
 }
 
-void video_queue_get_info(video_queue_t *vq, uint32_t *cx, uint32_t *cy,
-			  uint64_t *interval)
+static uint32_t current_pid(void)
 {
-	struct queue_header *qh = vq->header;
-	*cx = qh->cx;
-	*cy = qh->cy;
-	*interval = qh->interval;
+	return (uint32_t)GetCurrentProcessId();
 }
 
-#define get_idx(inc) ((unsigned long)inc % 3)
+static bool process_alive(uint32_t pid)
+{
+	HANDLE process = OpenProcess(SYNCHRONIZE, false, (DWORD)pid);
+	if (!process)
+		return GetLastError() != ERROR_INVALID_PARAMETER;
 
-void video_queue_write(video_queue_t *vq, uint8_t **data, uint32_t *linesize,
-		       uint64_t timestamp)
+	bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+	return alive;
+}
+
+static void shm_close(struct shm_queue *shm)
 {
-	struct queue_header *qh = vq->header;
-	long inc = ++qh->write_idx;
+	UnmapViewOfFile(shm->ptr);
+	CloseHandle(shm->handle);
+}
 
-	unsigned long idx = get_idx(inc);
-	size_t size = linesize[0] * qh->cy;
+#else
 
-	*vq->ts[idx] = timestamp;
-	memcpy(vq->frame[idx], data[0], size);
-	memcpy(vq->frame[idx] + size, data[1], size / 2);
+/* the writer holds a write lock on a lock object next to the queue, the
+ * queue's name with "Lock" appended, for as long as it lives.  unlike a
+ * windows file mapping, a posix shared memory object outlives the process
+ * that created it, so this is how a stale object left behind by a crashed
+ * writer is told apart from one that is actually in use.  the lock is taken
+ * before the queue is created, a second writer can't find a live queue that
+ * isn't locked yet.  open file description locks are preferred so a second
+ * writer in the same process does not inherit the first one's lock. */
+#ifdef F_OFD_SETLK
+#define SHM_SETLK F_OFD_SETLK
+#else
+#define SHM_SETLK F_SETLK
+#endif
 
-	qh->read_idx = inc;
-	qh->state = SHARED_QUEUE_STATE_READY;
+static bool shm_lock_writer(int fd)
+{
+	struct flock lock = {0};
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	return fcntl(fd, SHM_SETLK, &lock) != -1;
 }
 
-enum queue_state video_queue_state(video_queue_t *vq)
+/* the lock object is never removed, a writer that opened it just before
+ * would otherwise end up locking an orphan while a third one locks the new
+ * object */
+static int shm_lock_name(const char *name)
 {
-	if (!vq) {
-		return SHARED_QUEUE_STATE_INVALID;
+	char lock_name[QUEUE_NAME_SIZE + 8];
+	snprintf(lock_name, sizeof(lock_name), "%sLock", name);
+
+	int fd = shm_open(lock_name, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		return -1;
 	}
 
-	enum queue_state state = (enum queue_state)vq->header->state;
-	if (!vq->ready_to_read && state == SHARED_QUEUE_STATE_READY) {
-		for (size_t i = 0; i < 3; i++) {
-			size_t off = vq->header->offsets[i];
-			vq->ts[i] = (uint64_t *)(((uint8_t *)vq->header) + off);
-			vq->frame[i] = ((uint8_t *)vq->header) + off +
-				       FRAME_HEADER_SIZE;
-		}
-		vq->ready_to_read = true;
+	if (!shm_lock_writer(fd)) {
+		close(fd);
+		return -1;
 	}
 
-	return state;
+	return fd;
 }
 
-bool video_queue_read(video_queue_t *vq, nv12_scale_t *scale, void *dst,
-		      uint64_t *ts)
+/* a shared object has no lock, it is only created when the name is free and
+ * removed by whichever process leaves it last */
+static bool shm_create(struct shm_queue *shm, size_t size)
 {
-	struct queue_header *qh = vq->header;
-	long inc = qh->read_idx;
+	shm->lock_fd = -1;
+
+	/* fail if already in use */
+	if (!shm->shared) {
+		shm->lock_fd = shm_lock_name(shm->name);
+		if (shm->lock_fd == -1) {
+			return false;
+		}
+
+		/* with the lock held, whatever is left under the name belongs
+		 * to a writer that is gone */
+		shm_unlink(shm->name);
+	}
 
-	if (qh->state == SHARED_QUEUE_STATE_STOPPING) {
+	shm->fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (shm->fd == -1) {
+		if (shm->lock_fd != -1) {
+			close(shm->lock_fd);
+		}
 		return false;
 	}
 
-	if (inc == vq->last_inc) {
-		if (++vq->dup_counter == 10) {
-			return false;
+	void *ptr = MAP_FAILED;
+	if (ftruncate(shm->fd, (off_t)size) != -1) {
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   shm->fd, 0);
+	}
+	if (ptr == MAP_FAILED) {
+		close(shm->fd);
+		shm_unlink(shm->name);
+		if (shm->lock_fd != -1) {
+			close(shm->lock_fd);
 		}
-	} else {
-		vq->dup_counter = 0;
-		vq->last_inc = inc;
+		return false;
+	}
+
+	shm->ptr = ptr;
+	shm->size = size;
+	return true;
+}
+
+static bool shm_open_existing(struct shm_queue *shm, size_t min_size,
+			      bool read_only)
+{
+	struct stat st;
+
+	/* write access is only needed to join the reader registry, a reader
+	 * that doesn't get it still works, it just can't pin slots */
+	shm->writable = !read_only;
+	shm->fd = read_only ? -1 : shm_open(shm->name, O_RDWR, 0);
+	if (shm->fd == -1 && (read_only || errno == EACCES)) {
+		shm->writable = false;
+		shm->fd = shm_open(shm->name, O_RDONLY, 0);
+	}
+	if (shm->fd == -1) {
+		return false;
 	}
 
-	unsigned long idx = get_idx(inc);
+	/* the writer may not have sized the object yet */
+	if (fstat(shm->fd, &st) == -1 ||
+	    (size_t)st.st_size < min_size) {
+		close(shm->fd);
+		return false;
+	}
 
-	*ts = *vq->ts[idx];
+	int prot = shm->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+	void *ptr = mmap(NULL, (size_t)st.st_size, prot, MAP_SHARED, shm->fd,
+			 0);
+	if (ptr == MAP_FAILED) {
+		close(shm->fd);
+		return false;
+	}
 
-	nv12_do_scale(scale, dst, vq->frame[idx]);
+	shm->ptr = ptr;
+	shm->size = (size_t)st.st_size;
 	return true;
 }
+
+static void shm_close(struct shm_queue *shm)
+{
+	munmap(shm->ptr, shm->size);
+	close(shm->fd);
+
+	/* unlinked before the lock goes, the next writer creates afresh */
+	if (shm->is_writer) {
+		shm_unlink(shm->name);
+		close(shm->lock_fd);
+	}
+}
+
+static uint32_t current_pid(void)
+{
+	return (uint32_t)getpid();
+}
+
+static bool process_alive(uint32_t pid)
+{
+	return kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+}
+
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* frame wakeup                                                              */
+
+#ifdef _WIN32
+
+/* two manual reset events used in turn: publishing frame n sets event n & 1
+ * and resets the other one, which is the event a reader that has seen frame
+ * n waits on.  a single event would need every reader to reset it. */
+static void wake_open(struct shm_queue *shm)
+{
+	for (int i = 0; i < 2; i++) {
+		wchar_t name[QUEUE_NAME_SIZE + 8];
+		swprintf(name, QUEUE_NAME_SIZE + 8, L"%lsWake%d", shm->name, i);
+
+		shm->wake[i] = shm->is_writer || shm->shared
+				      ? CreateEventW(NULL, true, false, name)
+				      : OpenEventW(SYNCHRONIZE, false, name);
+	}
+}
+
+static void wake_close(struct shm_queue *shm)
+{
+	for (size_t i = 0; i < 2; i++) {
+		if (shm->wake[i])
+			CloseHandle(shm->wake[i]);
+	}
+}
+
+static void wake_signal(struct shm_queue *shm, uint32_t seq)
+{
+	if (shm->wake[0] && shm->wake[1]) {
+		ResetEvent(shm->wake[(seq + 1) & 1]);
+		SetEvent(shm->wake[seq & 1]);
+	}
+}
+
+static void wake_wait(struct shm_queue *shm, uint32_t seq,
+		      uint32_t timeout_ms)
+{
+	HANDLE event = shm->wake[(seq + 1) & 1];
+	if (event)
+		WaitForSingleObject(event, timeout_ms);
+	else
+		Sleep(timeout_ms);
+}
+
+#else
+
+static void wake_open(struct shm_queue *shm)
+{
+	(void)shm;
+}
+
+static void wake_close(struct shm_queue *shm)
+{
+	(void)shm;
+}
+
+#ifdef __linux__
+
+/* the object is MAP_SHARED, so a plain (non-private) futex on the header
+ * word works across processes */
+static void wake_signal(struct shm_queue *shm, uint32_t seq)
+{
+	(void)seq;
+	syscall(SYS_futex, shm->wake_seq, FUTEX_WAKE, INT_MAX, NULL,
+		NULL, 0);
+}
+
+static void wake_wait(struct shm_queue *shm, uint32_t seq,
+		      uint32_t timeout_ms)
+{
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+
+	syscall(SYS_futex, shm->wake_seq, FUTEX_WAIT, seq, &timeout,
+		NULL, 0);
+}
+
+#else
+
+/* no cross process wait primitive that works on shared memory, poll */
+static void wake_signal(struct shm_queue *shm, uint32_t seq)
+{
+	(void)shm;
+	(void)seq;
+}
+
+static void wake_wait(struct shm_queue *shm, uint32_t seq,
+		      uint32_t timeout_ms)
+{
+	for (uint32_t ms = 0; ms < timeout_ms; ms++) {
+		if (load_acquire(shm->wake_seq) != seq)
+			return;
+		usleep(1000);
+	}
+}
+
+#endif
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* clock domain                                                              */
+
+/* the minimum offset over a window is the frame that got through fastest,
+ * comparing the minimums of consecutive windows gives the drift without the
+ * delivery jitter */
+#define CLOCK_WINDOW 40000000LL
+
+/* a mapping this far off means the timestamps jumped, start over */
+#define CLOCK_RESET 10000000LL
+
+/* more than this is a broken clock rather than drift */
+#define CLOCK_MAX_DRIFT 1000000LL
+
+uint64_t queue_clock_now(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+
+	uint64_t f = (uint64_t)freq.QuadPart;
+	uint64_t t = (uint64_t)now.QuadPart;
+	return t / f * 10000000ULL + t % f * 10000000ULL / f;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 10000000ULL + (uint64_t)ts.tv_nsec / 100;
+#endif
+}
+
+static inline uint64_t clock_params_map(const struct clock_params *p,
+					uint64_t time)
+{
+	int64_t delta = (int64_t)(time - p->base_time);
+	return p->base_mono + delta + delta * p->drift_ppb / 1000000000LL;
+}
+
+static inline void clock_lock(struct queue_clock *clock)
+{
+	while (!compare_swap(&clock->lock, 0, 1))
+		;
+}
+
+static inline void clock_unlock(struct queue_clock *clock)
+{
+	store_release(&clock->lock, 0);
+}
+
+static inline void clock_get_params(struct queue_clock *clock,
+				    struct clock_params *p)
+{
+	p->base_time = clock->base_time;
+	p->base_mono = clock->base_mono;
+	p->drift_ppb = clock->drift_ppb;
+}
+
+static void clock_reset(struct queue_clock *clock, uint64_t time, uint64_t mono)
+{
+	clock->valid = true;
+	clock->base_time = time;
+	clock->base_mono = mono;
+	clock->drift_ppb = 0;
+	clock->window_start = time;
+	clock->window_time = time;
+	clock->window_min = (int64_t)(mono - time);
+	clock->have_prev = false;
+}
+
+static void clock_update(struct queue_clock *clock, uint64_t time,
+			 uint64_t mono)
+{
+	struct clock_params p;
+
+	if (!clock->valid) {
+		clock_reset(clock, time, mono);
+		return;
+	}
+
+	clock_get_params(clock, &p);
+	int64_t error = (int64_t)(mono - clock_params_map(&p, time));
+	if (error > CLOCK_RESET || error < -CLOCK_RESET) {
+		clock_reset(clock, time, mono);
+		return;
+	}
+
+	/* the mapping follows the fastest frames, one that beat it moves it
+	 * down right away */
+	if (error < 0)
+		clock->base_mono += error;
+
+	int64_t offset = (int64_t)(mono - time);
+	if (offset < clock->window_min) {
+		clock->window_min = offset;
+		clock->window_time = time;
+	}
+
+	if ((int64_t)(time - clock->window_start) < CLOCK_WINDOW)
+		return;
+
+	if (clock->have_prev && clock->window_time != clock->prev_time) {
+		int64_t span = (int64_t)(clock->window_time - clock->prev_time);
+		int64_t drift = (clock->window_min - clock->prev_min) *
+				1000000000LL / span;
+
+		/* smoothed, a single window can still be off by its jitter */
+		clock->drift_ppb += (drift - clock->drift_ppb) / 8;
+		if (clock->drift_ppb > CLOCK_MAX_DRIFT)
+			clock->drift_ppb = CLOCK_MAX_DRIFT;
+		if (clock->drift_ppb < -CLOCK_MAX_DRIFT)
+			clock->drift_ppb = -CLOCK_MAX_DRIFT;
+	}
+
+	/* anchor the mapping on the fastest frame of the window */
+	clock->base_time = clock->window_time;
+	clock->base_mono = clock->window_time + clock->window_min;
+
+	clock->have_prev = true;
+	clock->prev_time = clock->window_time;
+	clock->prev_min = clock->window_min;
+
+	clock->window_start = time;
+	clock->window_time = time;
+	clock->window_min = offset;
+}
+
+void queue_clock_init(struct queue_clock *clock)
+{
+	memset(clock, 0, sizeof(*clock));
+}
+
+void queue_clock_update(struct queue_clock *clock, uint64_t time,
+			uint64_t mono)
+{
+	clock_lock(clock);
+	clock_update(clock, time, mono);
+	clock_unlock(clock);
+}
+
+uint64_t queue_clock_map(struct queue_clock *clock, uint64_t time)
+{
+	struct clock_params p;
+
+	clock_lock(clock);
+	clock_get_params(clock, &p);
+	bool valid = clock->valid;
+	clock_unlock(clock);
+
+	return valid ? clock_params_map(&p, time) : time;
+}
+
+int64_t queue_clock_drift(struct queue_clock *clock)
+{
+	clock_lock(clock);
+	int64_t drift = clock->drift_ppb;
+	clock_unlock(clock);
+	return drift;
+}
+
+/* writer: feeds a frame's arrival to the estimator, publishes the updated
+ * mapping in the header and returns the frame's reference time */
+static uint64_t clock_stamp(struct queue_clock *clock,
+			    struct clock_mapping *mapping, uint64_t timestamp)
+{
+	uint64_t now = queue_clock_now();
+	struct clock_params p;
+
+	if (timestamp == UINT64_MAX)
+		return now;
+
+	uint64_t time = timestamp / 100;
+
+	clock_lock(clock);
+	clock_update(clock, time, now);
+	clock_get_params(clock, &p);
+	clock_unlock(clock);
+
+	uint32_t seq = load_relaxed(&mapping->seq);
+	store_relaxed(&mapping->seq, seq + 1);
+	fence_release();
+	mapping->params = p;
+	store_release(&mapping->seq, seq + 2);
+
+	return clock_params_map(&p, time);
+}
+
+/* only ever called by the writer of both */
+static void clock_mapping_copy(struct clock_mapping *dst,
+			       const struct clock_mapping *src)
+{
+	uint32_t seq = load_relaxed(&dst->seq);
+	store_relaxed(&dst->seq, seq + 1);
+	fence_release();
+	dst->params = src->params;
+	store_release(&dst->seq, seq + 2);
+}
+
+/* reader: 0 until the writer has stamped a frame */
+static uint64_t clock_mapping_map(struct clock_mapping *mapping,
+				  uint64_t timestamp)
+{
+	struct clock_params p;
+	uint32_t seq;
+
+	do {
+		seq = load_acquire(&mapping->seq);
+		p = mapping->params;
+		fence_acquire();
+	} while ((seq & 1) || load_relaxed(&mapping->seq) != seq);
+
+	if (!seq || timestamp == UINT64_MAX)
+		return 0;
+	return clock_params_map(&p, timestamp / 100);
+}
+
+/* ------------------------------------------------------------------------- */
+/* reader registry                                                           */
+
+static void reader_attach(struct video_queue *vq)
+{
+	if (!vq->shm.writable)
+		return;
+
+	uint32_t pid = current_pid();
+	for (size_t i = 0; i < MAX_QUEUE_READERS; i++) {
+		struct queue_reader *reader = &vq->header->readers[i];
+
+		/* entries of readers that died without closing are reused */
+		uint32_t owner = load_relaxed(&reader->pid);
+		if (owner && (owner == UINT32_MAX || process_alive(owner)))
+			continue;
+
+		if (compare_swap(&reader->pid, owner, pid)) {
+			store_relaxed(&reader->pinned, 0);
+			store_relaxed(&reader->cursor, 0);
+			store_relaxed(&reader->rendition, 0);
+			vq->reader = reader;
+			return;
+		}
+	}
+
+	/* registry full, this reader just can't pin slots */
+}
+
+static void reader_detach(struct video_queue *vq)
+{
+	if (!vq->reader)
+		return;
+
+	store_release(&vq->reader->pinned, 0);
+	store_release(&vq->reader->pid, 0);
+	vq->reader = NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+/* shared renditions                                                         */
+
+static size_t target_frame_size(enum target_format format, int cx, int cy)
+{
+	const size_t size = (size_t)cx * cy;
+	return format == TARGET_FORMAT_YUY2 ? size * 2 : size * 3 / 2;
+}
+
+/* nothing to share when the reader's conversion is a plain copy */
+static bool rendition_worth_it(struct video_queue *vq,
+			       const nv12_scale_t *scale)
+{
+	if ((uint32_t)scale->dst_cx != vq->header->cx ||
+	    (uint32_t)scale->dst_cy != vq->header->cy)
+		return true;
+
+	switch (vq->format) {
+	case QUEUE_FORMAT_NV12:
+		return scale->format != TARGET_FORMAT_NV12;
+	case QUEUE_FORMAT_I420:
+		return scale->format != TARGET_FORMAT_I420;
+	case QUEUE_FORMAT_YUY2:
+		return scale->format != TARGET_FORMAT_YUY2;
+	default:
+		return true;
+	}
+}
+
+/* what a reader puts in its registry entry while it has the rendition open,
+ * never 0.  sizes are cut to 14 bits, renditions that only differ above that
+ * share a key and the object of one of them may be left behind. */
+static uint32_t rendition_key(const struct rendition *r)
+{
+	return (((uint32_t)r->format + 1) & 3) << 30 |
+	       ((uint32_t)r->filter & 3) << 28 |
+	       ((uint32_t)r->cx & 0x3FFF) << 14 | ((uint32_t)r->cy & 0x3FFF);
+}
+
+#ifndef _WIN32
+/* a posix object outlives the processes that map it, unlike a windows file
+ * mapping.  the key is taken off before the others are looked at and put on
+ * before the object is opened, so of readers leaving at once at least one
+ * sees the others gone, and none sees a reader that is joining gone. */
+static bool rendition_last_reader(struct video_queue *vq, uint32_t key)
+{
+	for (size_t i = 0; i < MAX_QUEUE_READERS; i++) {
+		struct queue_reader *reader = &vq->header->readers[i];
+		if (reader == vq->reader)
+			continue;
+
+		uint32_t pid = load_relaxed(&reader->pid);
+		if (pid && pid != UINT32_MAX &&
+		    load_relaxed(&reader->rendition) == key &&
+		    process_alive(pid))
+			return false;
+	}
+
+	return true;
+}
+#endif
+
+static void rendition_detach(struct video_queue *vq)
+{
+	struct rendition *r = &vq->rendition;
+
+	if (r->header) {
+		wake_close(&r->shm);
+		shm_close(&r->shm);
+	}
+
+	if (vq->reader && load_relaxed(&vq->reader->rendition)) {
+		uint32_t key = load_relaxed(&vq->reader->rendition);
+		store_relaxed(&vq->reader->rendition, 0);
+		fence_full();
+
+#ifndef _WIN32
+		if (rendition_last_reader(vq, key))
+			shm_unlink(r->shm.name);
+#endif
+	}
+
+	memset(r, 0, sizeof(*r));
+}
+
+static bool rendition_open(struct video_queue *vq, struct rendition *r)
+{
+#ifdef _WIN32
+	swprintf(r->shm.name, QUEUE_NAME_SIZE, L"%.24lsR%08x_%02x%02x_%ux%u",
+		 vq->shm.name, vq->header->session, (uint8_t)r->format,
+		 (uint8_t)r->filter, (uint16_t)r->cx, (uint16_t)r->cy);
+#else
+	snprintf(r->shm.name, QUEUE_NAME_SIZE, "%.24sR%08x_%02x%02x_%ux%u",
+		 vq->shm.name, vq->header->session, (uint8_t)r->format,
+		 (uint8_t)r->filter, (uint16_t)r->cx, (uint16_t)r->cy);
+#endif
+
+	/* the name only has to be unique enough, the header has the key */
+
+	const size_t total = RENDITION_HEADER_SIZE + r->size;
+	struct rendition_header *rh;
+
+	/* see rendition_last_reader, also kept while the open fails so the
+	 * name is only removed by rendition_detach */
+	store_relaxed(&vq->reader->rendition, rendition_key(r));
+	fence_full();
+
+	/* the first reader to want it creates it, fresh memory is zeroed */
+	r->shm.shared = true;
+	if (shm_create(&r->shm, total)) {
+		rh = (struct rendition_header *)r->shm.ptr;
+		rh->format = (uint32_t)r->format;
+		rh->cx = (uint32_t)r->cx;
+		rh->cy = (uint32_t)r->cy;
+		rh->filter = (uint32_t)r->filter;
+		store_release(&rh->size, (uint32_t)r->size);
+	} else {
+		if (!shm_open_existing(&r->shm, total, false))
+			return false;
+		if (!r->shm.writable) {
+			shm_close(&r->shm);
+			return false;
+		}
+		rh = (struct rendition_header *)r->shm.ptr;
+	}
+
+	/* a creator that hasn't finished yet is retried later */
+	if (load_acquire(&rh->size) != r->size ||
+	    rh->format != (uint32_t)r->format || rh->cx != (uint32_t)r->cx ||
+	    rh->cy != (uint32_t)r->cy || rh->filter != (uint32_t)r->filter) {
+		shm_close(&r->shm);
+		return false;
+	}
+
+	r->header = rh;
+	r->data = (uint8_t *)r->shm.ptr + RENDITION_HEADER_SIZE;
+	r->shm.wake_seq = &rh->wake_seq;
+	wake_open(&r->shm);
+	return true;
+}
+
+/* the rendition matching what 'scale' produces, NULL if there is none */
+static struct rendition *reader_rendition(struct video_queue *vq,
+					  const nv12_scale_t *scale)
+{
+	struct rendition *r = &vq->rendition;
+
+	/* the registry entry is what keeps the object from being removed */
+	if (!vq->share_renditions || !vq->reader ||
+	    !rendition_worth_it(vq, scale)) {
+		rendition_detach(vq);
+		return NULL;
+	}
+
+	if (r->size && r->format == scale->format && r->cx == scale->dst_cx &&
+	    r->cy == scale->dst_cy && r->filter == scale->filter) {
+		if (r->header)
+			return r;
+		if (r->retry && --r->retry)
+			return NULL;
+	} else {
+		rendition_detach(vq);
+		r->format = scale->format;
+		r->cx = scale->dst_cx;
+		r->cy = scale->dst_cy;
+		r->filter = scale->filter;
+		r->size = target_frame_size(r->format, r->cx, r->cy);
+	}
+
+	if (rendition_open(vq, r))
+		return r;
+
+	r->retry = RENDITION_RETRY;
+	return NULL;
+}
+
+static void rendition_wake(struct rendition *r)
+{
+	uint32_t seq = load_relaxed(&r->header->wake_seq) + 1;
+	store_release(&r->header->wake_seq, seq);
+	wake_signal(&r->shm, seq);
+}
+
+/* copies out frame 'number' if another reader converted it already, or waits
+ * a little for one that is converting it right now */
+static bool rendition_read(struct rendition *r, uint32_t number, void *dst)
+{
+	struct rendition_header *rh = r->header;
+	uint64_t deadline = 0;
+
+	for (;;) {
+		/* read before the checks, a wake after them isn't missed */
+		uint32_t wake = load_acquire(&rh->wake_seq);
+		uint32_t seq = load_acquire(&rh->seq);
+
+		if (!(seq & 1) && load_relaxed(&rh->number) == number) {
+			memcpy(dst, r->data, r->size);
+
+			/* refilled with a newer frame meanwhile */
+			fence_acquire();
+			return load_relaxed(&rh->seq) == seq;
+		}
+
+		if (load_relaxed(&rh->claim) != number)
+			return false;
+
+		uint64_t now = queue_clock_now();
+		if (!deadline)
+			deadline = now + RENDITION_WAIT;
+		else if (now >= deadline)
+			return false;
+
+		uint64_t left = deadline - now;
+		wake_wait(&r->shm, wake, (uint32_t)((left + 9999) / 10000));
+	}
+}
+
+/* returns true if this reader is to convert frame 'number' for the others */
+static bool rendition_claim(struct rendition *r, uint32_t number)
+{
+	uint32_t claim = load_relaxed(&r->header->claim);
+
+	/* a reader late for an older frame leaves the newer one alone */
+	return (int32_t)(number - claim) > 0 &&
+	       compare_swap(&r->header->claim, claim, number);
+}
+
+/* shares what the reader converted for its claim, or gives the claim up if
+ * the frame turned out torn */
+static void rendition_fill(struct rendition *r, uint32_t number,
+			   const void *src, bool clean)
+{
+	struct rendition_header *rh = r->header;
+	uint32_t seq = load_relaxed(&rh->seq);
+
+	/* a reader still copying in an older frame keeps the buffer */
+	if (clean && !(seq & 1) && compare_swap(&rh->seq, seq, seq + 1)) {
+		fence_release();
+		memcpy(r->data, src, r->size);
+		store_relaxed(&rh->number, number);
+		store_release(&rh->seq, seq + 2);
+		rendition_wake(r);
+		return;
+	}
+
+	if (compare_swap(&rh->claim, number, 0))
+		rendition_wake(r);
+}
+
+/* ------------------------------------------------------------------------- */
+
+uint32_t queue_format_planes(enum queue_format format, uint32_t cx,
+			     uint32_t cy, struct queue_plane *planes)
+{
+	uint32_t count = 0;
+
+	/* rows of each plane in bytes, chroma is subsampled 2x2 for all the
+	 * planar formats.  an odd last row gets a chroma row of its own, as
+	 * gstreamer lays them out; widths are even throughout. */
+	const uint32_t cy_d2 = (cy + 1) / 2;
+
+	switch (format) {
+	case QUEUE_FORMAT_NV12:
+		planes[count++] = (struct queue_plane){0, cx, cy};
+		planes[count++] = (struct queue_plane){0, cx, cy_d2};
+		break;
+	case QUEUE_FORMAT_I420:
+		planes[count++] = (struct queue_plane){0, cx, cy};
+		planes[count++] = (struct queue_plane){0, cx / 2, cy_d2};
+		planes[count++] = (struct queue_plane){0, cx / 2, cy_d2};
+		break;
+	case QUEUE_FORMAT_YUY2:
+		planes[count++] = (struct queue_plane){0, cx * 2, cy};
+		break;
+	case QUEUE_FORMAT_P010:
+		planes[count++] = (struct queue_plane){0, cx * 2, cy};
+		planes[count++] = (struct queue_plane){0, cx * 2, cy_d2};
+		break;
+	case QUEUE_FORMAT_RGBA:
+		planes[count++] = (struct queue_plane){0, cx * 4, cy};
+		break;
+	default:
+		return 0;
+	}
+
+	for (uint32_t i = 1; i < count; i++)
+		planes[i].offset = planes[i - 1].offset +
+				   planes[i - 1].width * planes[i - 1].rows;
+	return count;
+}
+
+size_t queue_frame_size(enum queue_format format, uint32_t cx, uint32_t cy)
+{
+	struct queue_plane planes[QUEUE_MAX_PLANES];
+	uint32_t count = queue_format_planes(format, cx, cy, planes);
+	if (!count)
+		return 0;
+
+	const struct queue_plane *last = &planes[count - 1];
+	return (size_t)last->offset + (size_t)last->width * last->rows;
+}
+
+static void video_queue_set_format(struct video_queue *vq,
+				   enum queue_format format, uint32_t cx,
+				   uint32_t cy)
+{
+	vq->format = format;
+	vq->plane_count = queue_format_planes(format, cx, cy, vq->planes);
+	vq->frame_size = queue_frame_size(format, cx, cy);
+}
+
+static enum source_format scale_source(enum queue_format format)
+{
+	switch (format) {
+	case QUEUE_FORMAT_I420:
+		return SOURCE_FORMAT_I420;
+	case QUEUE_FORMAT_YUY2:
+		return SOURCE_FORMAT_YUY2;
+	case QUEUE_FORMAT_P010:
+		return SOURCE_FORMAT_P010;
+	case QUEUE_FORMAT_RGBA:
+		return SOURCE_FORMAT_RGBA;
+	default:
+		return SOURCE_FORMAT_NV12;
+	}
+}
+
+video_queue_t *video_queue_create(uint32_t index, uint32_t cx, uint32_t cy,
+				  uint64_t interval, uint32_t slots)
+{
+	return video_queue_create_format(index, cx, cy, interval, slots,
+					 QUEUE_FORMAT_NV12);
+}
+
+static video_queue_t *video_queue_create_named(const queue_char_t *name,
+					       uint32_t cx, uint32_t cy,
+					       uint64_t interval, uint32_t slots,
+					       enum queue_format format)
+{
+	struct video_queue vq = {0};
+	struct video_queue *pvq;
+	size_t frame_size = queue_frame_size(format, cx, cy);
+	uint32_t offset_frame[MAX_QUEUE_SLOTS];
+	size_t size;
+
+	if (!slots)
+		slots = DEFAULT_QUEUE_SLOTS;
+	if (slots < MIN_QUEUE_SLOTS || slots > MAX_QUEUE_SLOTS)
+		return NULL;
+	if (!frame_size)
+		return NULL;
+
+	size = sizeof(struct queue_header);
+
+	ALIGN_SIZE(size, 32);
+
+	for (uint32_t i = 0; i < slots; i++) {
+		/* offsets are 32 bits in the header */
+		if (size + frame_size + FRAME_HEADER_SIZE > UINT32_MAX)
+			return NULL;
+
+		offset_frame[i] = (uint32_t)size;
+		size += frame_size + FRAME_HEADER_SIZE;
+		ALIGN_SIZE(size, 32);
+	}
+
+	struct queue_header header = {0};
+
+	header.state = SHARED_QUEUE_STATE_STARTING;
+	header.cx = cx;
+	header.cy = cy;
+	header.interval = interval;
+	header.slots = slots;
+	header.format = format;
+	header.session = (uint32_t)queue_clock_now() ^ (current_pid() << 16);
+	vq.shm.is_writer = true;
+	vq.slots = slots;
+	video_queue_set_format(&vq, format, cx, cy);
+	memcpy(vq.shm.name, name, sizeof(vq.shm.name));
+
+	for (size_t i = 0; i < slots; i++) {
+		uint32_t off = offset_frame[i];
+		header.offsets[i] = off;
+	}
+
+	if (!shm_create(&vq.shm, size)) {
+		return NULL;
+	}
+	vq.header = (struct queue_header *)vq.shm.ptr;
+	vq.shm.wake_seq = &vq.header->wake_seq;
+	memcpy(vq.header, &header, sizeof(header));
+	wake_open(&vq.shm);
+
+	for (size_t i = 0; i < slots; i++) {
+		uint32_t off = offset_frame[i];
+		vq.fh[i] = (struct frame_header *)(((uint8_t *)vq.header) +
+						   off);
+		vq.frame[i] = ((uint8_t *)vq.header) + off + FRAME_HEADER_SIZE;
+	}
+	pvq = malloc(sizeof(vq));
+	if (!pvq) {
+		wake_close(&vq.shm);
+		shm_close(&vq.shm);
+		return NULL;
+	}
+	memcpy(pvq, &vq, sizeof(vq));
+	return pvq;
+}
+
+video_queue_t *video_queue_create_format(uint32_t index, uint32_t cx,
+					 uint32_t cy, uint64_t interval,
+					 uint32_t slots,
+					 enum queue_format format)
+{
+	struct shm_queue shm;
+
+	if (index >= MAX_QUEUE_INSTANCES)
+		return NULL;
+
+	queue_set_name(&shm, VIDEO_NAME, index);
+	return video_queue_create_named(shm.name, cx, cy, interval, slots,
+					format);
+}
+
+static video_queue_t *video_queue_open_named(const queue_char_t *name,
+					     bool read_only)
+{
+	struct video_queue vq = {0};
+
+	memcpy(vq.shm.name, name, sizeof(vq.shm.name));
+
+	if (!shm_open_existing(&vq.shm, sizeof(struct queue_header),
+			       read_only)) {
+		return NULL;
+	}
+	vq.header = (struct queue_header *)vq.shm.ptr;
+	vq.shm.wake_seq = &vq.header->wake_seq;
+	wake_open(&vq.shm);
+
+	struct video_queue *pvq = malloc(sizeof(vq));
+	if (!pvq) {
+		wake_close(&vq.shm);
+		shm_close(&vq.shm);
+		return NULL;
+	}
+	memcpy(pvq, &vq, sizeof(vq));
+	return pvq;
+}
+
+static video_queue_t *video_queue_open_mode(uint32_t index, bool read_only)
+{
+	struct shm_queue shm;
+
+	if (index >= MAX_QUEUE_INSTANCES) {
+		return NULL;
+	}
+	queue_set_name(&shm, VIDEO_NAME, index);
+	return video_queue_open_named(shm.name, read_only);
+}
+
+video_queue_t *video_queue_open(uint32_t index)
+{
+	return video_queue_open_mode(index, false);
+}
+
+video_queue_t *video_queue_open_read_only(uint32_t index)
+{
+	return video_queue_open_mode(index, true);
+}
+
+video_queue_t *video_queue_open_rendition(uint32_t index, uint32_t rendition)
+{
+	struct shm_queue shm;
+	struct shm_queue sub;
+
+	if (index >= MAX_QUEUE_INSTANCES || rendition >= QUEUE_MAX_RENDITIONS)
+		return NULL;
+
+	queue_set_name(&shm, VIDEO_NAME, index);
+	rendition_set_name(&sub, shm.name, rendition);
+	return video_queue_open_named(sub.name, false);
+}
+
+void video_queue_close(video_queue_t *vq)
+{
+	if (!vq) {
+		return;
+	}
+	if (vq->shm.is_writer) {
+		store_release(&vq->header->state,
+			      SHARED_QUEUE_STATE_STOPPING);
+
+		/* let blocked readers see the state change right away */
+		uint32_t seq = load_relaxed(&vq->header->wake_seq) + 1;
+		store_release(&vq->header->wake_seq, seq);
+		wake_signal(&vq->shm, seq);
+	}
+
+	rendition_detach(vq);
+	reader_detach(vq);
+	wake_close(&vq->shm);
+
+	shm_close(&vq->shm);
+	free(vq);
+}
+
+void video_queue_get_info(video_queue_t *vq, uint32_t *cx, uint32_t *cy,
+			  uint64_t *interval)
+{
+	struct queue_header *qh = vq->header;
+	*cx = qh->cx;
+	*cy = qh->cy;
+	*interval = qh->interval;
+}
+
+enum queue_format video_queue_get_format(video_queue_t *vq)
+{
+	return vq->format;
+}
+
+#define get_idx(vq, inc) ((unsigned long)(inc) % (vq)->slots)
+
+/* copies 'rows' rows of 'width' bytes, in one go when the source is packed */
+static inline void copy_plane(uint8_t *dst, const uint8_t *src,
+			      uint32_t linesize, uint32_t width, uint32_t rows)
+{
+	if (linesize == width) {
+		memcpy(dst, src, (size_t)width * rows);
+		return;
+	}
+
+	for (uint32_t y = 0; y < rows; y++) {
+		memcpy(dst, src, width);
+		dst += width;
+		src += linesize;
+	}
+}
+
+/* marks the slot as being written, before any of its pixels change */
+static inline void slot_begin_write(struct frame_header *fh)
+{
+	uint32_t seq = load_relaxed(&fh->seq);
+	if (!(seq & 1)) {
+		store_relaxed(&fh->seq, seq + 1);
+		fence_release();
+	}
+}
+
+/* marks the slot as complete, slots written without slot_begin_write still
+ * get a new sequence number so a reader spanning the write notices */
+static inline void slot_end_write(struct frame_header *fh)
+{
+	uint32_t seq = load_relaxed(&fh->seq);
+	store_release(&fh->seq, (seq | 1) + 1);
+}
+
+static inline void slot_make_current(struct video_queue *vq, uint32_t inc)
+{
+	struct queue_header *qh = vq->header;
+	store_release(&qh->read_idx, inc);
+	store_release(&qh->state, SHARED_QUEUE_STATE_READY);
+
+	uint32_t seq = load_relaxed(&qh->wake_seq) + 1;
+	store_release(&qh->wake_seq, seq);
+	wake_signal(&vq->shm, seq);
+}
+
+static inline struct queue_clock *writer_clock(struct video_queue *vq)
+{
+	return vq->clock ? vq->clock : &vq->own_clock;
+}
+
+/* read only readers can't count */
+static inline void stats_add(struct video_queue *vq, volatile uint64_t *counter,
+			     uint64_t val)
+{
+	if (vq->shm.is_writer || vq->shm.writable)
+		fetch_add64(counter, val);
+}
+
+/* inside the slot's write, so readers get a number and trace that match
+ * the pixels.  'now' is when the frame was complete. */
+static inline void slot_stamp(struct video_queue *vq, struct frame_header *fh,
+			      uint64_t now)
+{
+	fh->number = ++vq->number;
+	memcpy(fh->trace, vq->next_trace, sizeof(vq->next_trace));
+	fh->trace[QUEUE_TRACE_WRITTEN] = now;
+	memset(vq->next_trace, 0, sizeof(vq->next_trace));
+}
+
+/* ------------------------------------------------------------------------- */
+/* slot pinning                                                              */
+
+/* the full fence pairs with the writer's in writer_claim_slot: either the
+ * reader sees the slot go odd or the writer sees the pin */
+static inline void reader_pin(struct video_queue *vq, unsigned long idx)
+{
+	if (vq->reader) {
+		store_relaxed(&vq->reader->pinned, (uint32_t)idx + 1);
+		fence_full();
+	}
+}
+
+static inline void reader_unpin(struct video_queue *vq)
+{
+	if (vq->reader)
+		store_release(&vq->reader->pinned, 0);
+}
+
+/* number of readers copying from slot idx right now.  entries left behind
+ * by readers that died are released on the way. */
+static uint32_t slot_pins(struct video_queue *vq, unsigned long idx)
+{
+	uint32_t pins = 0;
+
+	for (size_t i = 0; i < MAX_QUEUE_READERS; i++) {
+		struct queue_reader *reader = &vq->header->readers[i];
+		if (load_relaxed(&reader->pinned) != (uint32_t)idx + 1)
+			continue;
+
+		uint32_t pid = load_relaxed(&reader->pid);
+		if (pid && pid != UINT32_MAX && !process_alive(pid) &&
+		    compare_swap(&reader->pid, pid, UINT32_MAX)) {
+			store_relaxed(&reader->pinned, 0);
+			store_release(&reader->pid, 0);
+			continue;
+		}
+
+		pins++;
+	}
+
+	return pins;
+}
+
+/* picks the slot for the next frame: never the current one, and none that a
+ * reader is still copying from */
+static bool writer_claim_slot(struct video_queue *vq, uint32_t *out_inc)
+{
+	struct queue_header *qh = vq->header;
+	uint32_t base = load_relaxed(&qh->write_idx);
+	unsigned long current = get_idx(vq, load_relaxed(&qh->read_idx));
+
+	for (uint32_t i = 1; i <= vq->slots; i++) {
+		uint32_t inc = base + i;
+		unsigned long idx = get_idx(vq, inc);
+		if (idx == current)
+			continue;
+
+		/* a slot that is pinned already is passed over without
+		 * touching its seq, readers only ever see it go odd for a
+		 * slot that gets written */
+		if (slot_pins(vq, idx))
+			continue;
+
+		struct frame_header *fh = vq->fh[idx];
+		uint32_t seq = load_relaxed(&fh->seq);
+
+		slot_begin_write(fh);
+		fence_full();
+
+		/* a reader that pinned it in between, after the check above */
+		if (slot_pins(vq, idx)) {
+			/* nothing was written yet, put the old number back */
+			store_release(&fh->seq, seq);
+			continue;
+		}
+
+		store_relaxed(&qh->write_idx, inc);
+		*out_inc = inc;
+		return true;
+	}
+
+	return false;
+}
+
+void video_queue_write(video_queue_t *vq, uint8_t **data, uint32_t *linesize,
+		       uint64_t timestamp)
+{
+	struct queue_header *qh = vq->header;
+	uint32_t inc;
+
+	if (!writer_claim_slot(vq, &inc)) {
+		vq->pinned_drops++;
+		stats_add(vq, &qh->stats.pinned_drops, 1);
+		return;
+	}
+
+	unsigned long idx = get_idx(vq, inc);
+	struct frame_header *fh = vq->fh[idx];
+
+	/* the queue always holds packed planes, linesize may include the
+	 * decoder's row padding */
+	fh->timestamp = timestamp;
+	fh->mono = clock_stamp(writer_clock(vq), &qh->clock, timestamp);
+
+	uint64_t start = queue_clock_now();
+	for (uint32_t i = 0; i < vq->plane_count; i++) {
+		const struct queue_plane *plane = &vq->planes[i];
+		copy_plane(vq->frame[idx] + plane->offset, data[i], linesize[i],
+			   plane->width, plane->rows);
+	}
+	uint64_t now = queue_clock_now();
+	slot_stamp(vq, fh, now);
+
+	slot_end_write(fh);
+	slot_make_current(vq, inc);
+
+	stats_add(vq, &qh->stats.written, 1);
+	stats_add(vq, &qh->stats.copy_time, now - start);
+}
+
+size_t video_queue_slot_count(video_queue_t *vq)
+{
+	return vq->slots;
+}
+
+uint8_t *video_queue_get_slot(video_queue_t *vq, size_t idx, size_t *size)
+{
+	if (!vq->shm.is_writer || idx >= vq->slots)
+		return NULL;
+
+	if (size)
+		*size = vq->frame_size;
+	return vq->frame[idx];
+}
+
+void video_queue_begin_write(video_queue_t *vq, size_t idx)
+{
+	if (vq->shm.is_writer && idx < vq->slots)
+		slot_begin_write(vq->fh[idx]);
+}
+
+void video_queue_publish(video_queue_t *vq, size_t idx, uint64_t timestamp)
+{
+	struct queue_header *qh = vq->header;
+
+	/* the next counter value that lands on this slot, readers only ever
+	 * look at read_idx so skipping values is fine */
+	uint32_t inc = load_relaxed(&qh->write_idx) + 1;
+	inc += (uint32_t)((idx + vq->slots - get_idx(vq, inc)) % vq->slots);
+	store_relaxed(&qh->write_idx, inc);
+
+	vq->fh[idx]->timestamp = timestamp;
+	vq->fh[idx]->mono = clock_stamp(writer_clock(vq), &qh->clock, timestamp);
+	slot_stamp(vq, vq->fh[idx], queue_clock_now());
+
+	slot_end_write(vq->fh[idx]);
+	slot_make_current(vq, inc);
+
+	stats_add(vq, &qh->stats.written, 1);
+}
+
+/* ------------------------------------------------------------------------- */
+/* writer renditions                                                         */
+
+video_queue_t *video_queue_add_rendition(video_queue_t *vq,
+					 enum queue_format format, uint32_t cx,
+					 uint32_t cy)
+{
+	struct queue_header *qh = vq->header;
+	struct shm_queue sub;
+
+	/* what the readers' scaler puts out */
+	if (!vq->shm.is_writer || format > QUEUE_FORMAT_YUY2)
+		return NULL;
+
+	uint32_t count = load_relaxed(&qh->rendition_count);
+	if (count == QUEUE_MAX_RENDITIONS)
+		return NULL;
+
+	rendition_set_name(&sub, vq->shm.name, count);
+	video_queue_t *rq = video_queue_create_named(sub.name, cx, cy,
+						     qh->interval, vq->slots,
+						     format);
+	if (!rq)
+		return NULL;
+
+	qh->renditions[count].format = format;
+	qh->renditions[count].cx = cx;
+	qh->renditions[count].cy = cy;
+	store_release(&qh->rendition_count, count + 1);
+	return rq;
+}
+
+uint32_t video_queue_get_renditions(video_queue_t *vq,
+				    struct queue_rendition *renditions)
+{
+	uint32_t count = load_acquire(&vq->header->rendition_count);
+	if (count > QUEUE_MAX_RENDITIONS)
+		return 0;
+
+	memcpy(renditions, vq->header->renditions,
+	       sizeof(*renditions) * count);
+	return count;
+}
+
+int video_queue_find_rendition(video_queue_t *vq, const nv12_scale_t *scale)
+{
+	struct queue_rendition renditions[QUEUE_MAX_RENDITIONS];
+	uint32_t count = video_queue_get_renditions(vq, renditions);
+
+	/* the first three queue formats are the scaler's targets */
+	for (uint32_t i = 0; i < count; i++) {
+		if (renditions[i].format == (uint32_t)scale->format &&
+		    renditions[i].cx == (uint32_t)scale->dst_cx &&
+		    renditions[i].cy == (uint32_t)scale->dst_cy)
+			return (int)i;
+	}
+	return -1;
+}
+
+void video_queue_write_rendition(video_queue_t *vq, video_queue_t *rq,
+				 nv12_scale_t *scale)
+{
+	struct queue_header *qh = vq->header;
+	struct queue_header *rqh = rq->header;
+	uint32_t inc;
+
+	if (!vq->shm.is_writer || !rq->shm.is_writer ||
+	    load_relaxed(&qh->state) != SHARED_QUEUE_STATE_READY)
+		return;
+
+	/* the writer's latest frame stays put until its next write, which
+	 * may not have happened if every slot was pinned */
+	unsigned long src_idx = get_idx(vq, load_relaxed(&qh->read_idx));
+	const struct frame_header *src = vq->fh[src_idx];
+	if (src->number == rq->scaled_from)
+		return;
+
+	if (!writer_claim_slot(rq, &inc)) {
+		rq->pinned_drops++;
+		stats_add(rq, &rqh->stats.pinned_drops, 1);
+		return;
+	}
+
+	unsigned long idx = get_idx(rq, inc);
+	struct frame_header *fh = rq->fh[idx];
+
+	/* same mapping as the frame it was scaled from, the clock already
+	 * took this timestamp into account */
+	fh->timestamp = src->timestamp;
+	fh->mono = src->mono;
+	clock_mapping_copy(&rqh->clock, &qh->clock);
+	memcpy(rq->next_trace, src->trace, sizeof(rq->next_trace));
+
+	uint64_t start = queue_clock_now();
+	scale->src_format = scale_source(vq->format);
+	nv12_do_scale(scale, rq->frame[idx], vq->frame[src_idx]);
+	uint64_t now = queue_clock_now();
+	slot_stamp(rq, fh, now);
+	rq->scaled_from = src->number;
+
+	slot_end_write(fh);
+	slot_make_current(rq, inc);
+
+	stats_add(rq, &rqh->stats.written, 1);
+	stats_add(rq, &rqh->stats.copy_time, now - start);
+}
+
+enum queue_state video_queue_state(video_queue_t *vq)
+{
+	if (!vq) {
+		return SHARED_QUEUE_STATE_INVALID;
+	}
+
+	enum queue_state state =
+		(enum queue_state)load_acquire(&vq->header->state);
+	if (!vq->ready_to_read && state == SHARED_QUEUE_STATE_READY) {
+		uint32_t slots = vq->header->slots;
+		if (slots < MIN_QUEUE_SLOTS || slots > MAX_QUEUE_SLOTS ||
+		    vq->header->format >= QUEUE_FORMAT_COUNT) {
+			return SHARED_QUEUE_STATE_INVALID;
+		}
+
+		uint8_t *base = (uint8_t *)vq->header;
+
+		vq->slots = slots;
+		video_queue_set_format(vq,
+				       (enum queue_format)vq->header->format,
+				       vq->header->cx, vq->header->cy);
+		for (size_t i = 0; i < slots; i++) {
+			size_t off = vq->header->offsets[i];
+			vq->fh[i] = (struct frame_header *)(base + off);
+			vq->frame[i] = base + off + FRAME_HEADER_SIZE;
+		}
+		vq->ready_to_read = true;
+
+		/* only once the writer has initialized the header */
+		reader_attach(vq);
+	}
+
+	return state;
+}
+
+/* checks whether the writer is still there and returns the latest frame's
+ * counter.  a writer that stops publishing without closing the queue shows
+ * up as the same counter ten reads in a row. */
+static bool read_begin(struct video_queue *vq, uint32_t *out_inc)
+{
+	struct queue_header *qh = vq->header;
+	vq->last_wake = load_acquire(&qh->wake_seq);
+	uint32_t inc = load_acquire(&qh->read_idx);
+
+	if (load_acquire(&qh->state) == SHARED_QUEUE_STATE_STOPPING) {
+		return false;
+	}
+
+	if (inc == vq->last_inc) {
+		if (++vq->dup_counter == 10) {
+			return false;
+		}
+	} else {
+		vq->dup_counter = 0;
+		vq->last_inc = inc;
+	}
+
+	*out_inc = inc;
+	return true;
+}
+
+/* a frame read again counts as a duplicate and keeps the trace it had */
+static void reader_take_frame(struct video_queue *vq, uint32_t number,
+			      const uint64_t *stamps, uint64_t now)
+{
+	struct shared_stats *stats = &vq->header->stats;
+
+	if (number == vq->last_number) {
+		stats_add(vq, &stats->duplicates, 1);
+		return;
+	}
+
+	/* read_at may also go back to an older frame */
+	int32_t ahead = (int32_t)(number - vq->last_number);
+	if (vq->last_number && ahead > 1)
+		stats_add(vq, &stats->overwritten, (uint64_t)ahead - 1);
+	vq->last_number = number;
+
+	memset(&vq->trace, 0, sizeof(vq->trace));
+	memcpy(vq->trace.stamp, stamps,
+	       sizeof(uint64_t) * (QUEUE_TRACE_WRITTEN + 1));
+	vq->trace.stamp[QUEUE_TRACE_READ] = now;
+	vq->trace_new = true;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* copies slot idx, returns true if the writer didn't touch it meanwhile.
+ * 'copied' tells a torn copy apart from a slot that was skipped because the
+ * writer was already on it. */
+static bool read_slot(struct video_queue *vq, unsigned long idx,
+		      nv12_scale_t *scale, void *dst, uint64_t *ts,
+		      bool *copied)
+{
+	struct frame_header *fh = vq->fh[idx];
+	bool clean = false;
+
+	reader_pin(vq, idx);
+	scale->src_format = scale_source(vq->format);
+
+	uint32_t seq = load_acquire(&fh->seq);
+	*copied = !(seq & 1);
+
+	if (*copied) {
+		uint64_t trace[QUEUE_TRACE_WRITTEN + 1];
+
+		*ts = fh->timestamp;
+		uint32_t number = fh->number;
+		memcpy(trace, fh->trace, sizeof(trace));
+
+		struct rendition *r = reader_rendition(vq, scale);
+		bool shared = r && rendition_read(r, number, dst);
+		bool fill = r && !shared && rendition_claim(r, number);
+
+		uint64_t start = queue_clock_now();
+		if (!shared)
+			nv12_do_scale(scale, dst, vq->frame[idx]);
+		uint64_t now = queue_clock_now();
+
+		fence_acquire();
+		clean = load_relaxed(&fh->seq) == seq;
+
+		if (fill)
+			rendition_fill(r, number, dst, clean);
+
+		if (shared)
+			stats_add(vq, &vq->header->stats.shared_hits, 1);
+		else
+			stats_add(vq, &vq->header->stats.scale_time,
+				  now - start);
+		if (clean)
+			reader_take_frame(vq, number, trace, now);
+	}
+
+	reader_unpin(vq);
+	return clean;
+}
+
+/* reads the latest frame, starting over from the newest slot if the writer
+ * laps us */
+static void read_latest(struct video_queue *vq, uint32_t inc,
+			nv12_scale_t *scale, void *dst, uint64_t *ts)
+{
+	for (int attempt = 0;; attempt++) {
+		unsigned long idx = get_idx(vq, inc);
+		bool copied;
+
+		if (read_slot(vq, idx, scale, dst, ts, &copied))
+			break;
+
+		/* the writer lapped us, by now there is a newer frame */
+		if (attempt == READ_RETRIES) {
+			/* a slot still odd here was never copied at all */
+			if (!copied) {
+				*ts = vq->fh[idx]->timestamp;
+				nv12_do_scale(scale, dst, vq->frame[idx]);
+			}
+			vq->torn_shown++;
+			stats_add(vq, &vq->header->stats.torn, 1);
+			break;
+		}
+
+		vq->torn_retried++;
+		stats_add(vq, &vq->header->stats.torn, 1);
+		inc = load_acquire(&vq->header->read_idx);
+		vq->last_inc = inc;
+	}
+
+	if (vq->reader)
+		store_relaxed(&vq->reader->cursor, inc);
+}
+
+bool video_queue_read(video_queue_t *vq, nv12_scale_t *scale, void *dst,
+		      uint64_t *ts)
+{
+	uint32_t inc;
+
+	if (!read_begin(vq, &inc))
+		return false;
+
+	read_latest(vq, inc, scale, dst, ts);
+	stats_add(vq, &vq->header->stats.read, 1);
+	return true;
+}
+
+/* slot holding the frame to show at 'target', -1 if there is none yet */
+static long find_slot_at(struct video_queue *vq, uint64_t target)
+{
+	long best = -1, oldest = -1;
+	uint64_t best_mono = 0, oldest_mono = UINT64_MAX;
+
+	for (uint32_t i = 0; i < vq->slots; i++) {
+		struct frame_header *fh = vq->fh[i];
+
+		/* 0 was never written, odd is being written.  mono may
+		 * change under us, read_slot notices that. */
+		uint32_t seq = load_acquire(&fh->seq);
+		if (!seq || (seq & 1))
+			continue;
+
+		uint64_t mono = fh->mono;
+		if (mono <= target) {
+			if (best < 0 || mono > best_mono) {
+				best = (long)i;
+				best_mono = mono;
+			}
+		} else if (mono < oldest_mono) {
+			oldest = (long)i;
+			oldest_mono = mono;
+		}
+	}
+
+	return best >= 0 ? best : oldest;
+}
+
+bool video_queue_read_at(video_queue_t *vq, nv12_scale_t *scale, void *dst,
+			 uint64_t target, uint64_t *ts)
+{
+	uint32_t inc;
+	bool copied;
+
+	if (!read_begin(vq, &inc))
+		return false;
+
+	long idx = find_slot_at(vq, target);
+	if (idx >= 0 &&
+	    read_slot(vq, (unsigned long)idx, scale, dst, ts, &copied)) {
+		if (vq->reader)
+			store_relaxed(&vq->reader->cursor, inc);
+	} else {
+		/* overwritten before we got to it, the latest is the next
+		 * best */
+		read_latest(vq, inc, scale, dst, ts);
+	}
+
+	stats_add(vq, &vq->header->stats.read, 1);
+	return true;
+}
+
+uint64_t video_queue_map_time(video_queue_t *vq, uint64_t ts)
+{
+	return clock_mapping_map(&vq->header->clock, ts);
+}
+
+void video_queue_set_clock(video_queue_t *vq, struct queue_clock *clock)
+{
+	vq->clock = clock;
+}
+
+bool video_queue_wait(video_queue_t *vq, uint32_t timeout_ms)
+{
+	uint32_t seq = load_acquire(&vq->header->wake_seq);
+	if (seq == vq->last_wake && timeout_ms) {
+		wake_wait(&vq->shm, seq, timeout_ms);
+		seq = load_acquire(&vq->header->wake_seq);
+	}
+
+	return seq != vq->last_wake;
+}
+
+void video_queue_share_renditions(video_queue_t *vq, bool share)
+{
+	vq->share_renditions = share;
+	if (!share)
+		rendition_detach(vq);
+}
+
+uint64_t video_queue_get_pinned_drops(video_queue_t *vq)
+{
+	return vq->pinned_drops;
+}
+
+void video_queue_get_stats(video_queue_t *vq, struct queue_stats *stats)
+{
+	struct shared_stats *shared = &vq->header->stats;
+
+	stats->written = load_relaxed64(&shared->written);
+	stats->pinned_drops = load_relaxed64(&shared->pinned_drops);
+	stats->copy_time = load_relaxed64(&shared->copy_time);
+	stats->read = load_relaxed64(&shared->read);
+	stats->duplicates = load_relaxed64(&shared->duplicates);
+	stats->overwritten = load_relaxed64(&shared->overwritten);
+	stats->torn = load_relaxed64(&shared->torn);
+	stats->scale_time = load_relaxed64(&shared->scale_time);
+	stats->shared_hits = load_relaxed64(&shared->shared_hits);
+
+	stats->readers = 0;
+	for (size_t i = 0; i < MAX_QUEUE_READERS; i++) {
+		uint32_t pid = load_relaxed(&vq->header->readers[i].pid);
+		if (pid && pid != UINT32_MAX)
+			stats->readers++;
+	}
+}
+
+void video_queue_get_torn_frames(video_queue_t *vq, uint64_t *retried,
+				 uint64_t *shown)
+{
+	if (retried)
+		*retried = vq->torn_retried;
+	if (shown)
+		*shown = vq->torn_shown;
+}
+
+/* ------------------------------------------------------------------------- */
+/* latency tracing                                                           */
+
+#define LATENCY_SUB (1u << QUEUE_LATENCY_SUB_BITS)
+
+uint32_t latency_bucket(uint64_t value)
+{
+	if (value < LATENCY_SUB)
+		return (uint32_t)value;
+
+	uint32_t shift = 0;
+	while (value >> (shift + QUEUE_LATENCY_SUB_BITS + 1))
+		shift++;
+
+	/* value >> shift keeps the top SUB_BITS + 1 bits, 16..31 */
+	uint64_t bucket = (uint64_t)shift * LATENCY_SUB + (value >> shift);
+	return bucket < QUEUE_LATENCY_BUCKETS ? (uint32_t)bucket
+					      : QUEUE_LATENCY_BUCKETS - 1;
+}
+
+uint64_t latency_bucket_value(uint32_t bucket)
+{
+	if (bucket < LATENCY_SUB)
+		return bucket;
+
+	uint32_t shift = bucket / LATENCY_SUB - 1;
+	return (uint64_t)(bucket % LATENCY_SUB + LATENCY_SUB) << shift;
+}
+
+uint64_t latency_percentile(const struct latency_histogram *hist, double p)
+{
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < QUEUE_LATENCY_BUCKETS; i++)
+		total += hist->buckets[i];
+	if (!total)
+		return 0;
+
+	uint64_t rank = (uint64_t)(p * (double)total + 0.5);
+	if (!rank)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < QUEUE_LATENCY_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			uint64_t upper = latency_bucket_value(i + 1) - 1;
+			return upper < hist->max ? upper : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+/* several readers add to the same histograms, each field on its own is
+ * atomic but a snapshot taken meanwhile may be a frame off */
+static void histogram_add(struct latency_histogram *hist, uint64_t value)
+{
+	uint32_t value32 = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+	volatile uint32_t *max = (volatile uint32_t *)&hist->max;
+	uint32_t cur;
+
+	fetch_add((volatile uint32_t *)&hist->buckets[latency_bucket(value)],
+		  1);
+	fetch_add64((volatile uint64_t *)&hist->sum, value);
+	while ((cur = load_relaxed(max)) < value32 &&
+	       !compare_swap(max, cur, value32))
+		;
+	fetch_add((volatile uint32_t *)&hist->count, 1);
+}
+
+void video_queue_set_trace(video_queue_t *vq, const struct queue_trace *trace)
+{
+	memcpy(vq->next_trace, trace->stamp, sizeof(vq->next_trace));
+}
+
+bool video_queue_get_trace(video_queue_t *vq, struct queue_trace *trace)
+{
+	if (!vq->trace_new)
+		return false;
+
+	*trace = vq->trace;
+	vq->trace_new = false;
+	return true;
+}
+
+void video_queue_record_trace(video_queue_t *vq,
+			      const struct queue_trace *trace)
+{
+	if (!vq->shm.writable || !vq->ready_to_read)
+		return;
+
+	struct latency_histogram *spans = vq->header->latency;
+	const uint64_t *stamp = trace->stamp;
+	uint64_t first = 0;
+
+	for (int i = 0; i < QUEUE_TRACE_STAGES; i++) {
+		if (!stamp[i])
+			continue;
+		if (!first)
+			first = stamp[i];
+
+		/* a stage that wasn't stamped leaves a gap rather than
+		 * folding its time into the next span */
+		if (i + 1 < QUEUE_TRACE_STAGES && stamp[i + 1] >= stamp[i] &&
+		    stamp[i + 1])
+			histogram_add(&spans[i], stamp[i + 1] - stamp[i]);
+	}
+
+	uint64_t delivered = stamp[QUEUE_TRACE_DELIVERED];
+	if (first && delivered >= first)
+		histogram_add(&spans[QUEUE_LATENCY_TOTAL], delivered - first);
+}
+
+void video_queue_get_latency(video_queue_t *vq,
+			     struct latency_histogram *spans)
+{
+	memcpy(spans, vq->header->latency, sizeof(vq->header->latency));
+}
+
+/* ------------------------------------------------------------------------- */
+/* audio                                                                     */
+
+static uint32_t audio_sample_size(enum audio_queue_format format)
+{
+	switch (format) {
+	case AUDIO_QUEUE_FORMAT_S16:
+		return 2;
+	case AUDIO_QUEUE_FORMAT_F32:
+		return 4;
+	}
+
+	return 0;
+}
+
+audio_queue_t *audio_queue_create(uint32_t index, uint32_t sample_rate,
+				  uint32_t channels,
+				  enum audio_queue_format format,
+				  uint32_t capacity_ms)
+{
+	struct audio_queue aq = {0};
+	uint32_t sample_size = audio_sample_size(format);
+
+	if (index >= MAX_QUEUE_INSTANCES || !sample_rate || !channels ||
+	    !sample_size)
+		return NULL;
+	if (!capacity_ms)
+		capacity_ms = DEFAULT_AUDIO_QUEUE_MS;
+
+	uint64_t wanted = (uint64_t)sample_rate * capacity_ms / 1000;
+	uint32_t capacity = 1;
+	while (capacity < wanted && capacity < AUDIO_MAX_CAPACITY)
+		capacity <<= 1;
+
+	uint32_t data_offset = sizeof(struct audio_header);
+	ALIGN_SIZE(data_offset, 32);
+
+	struct audio_header header = {0};
+	header.state = SHARED_QUEUE_STATE_STARTING;
+	header.type = SHARED_QUEUE_TYPE_AUDIO;
+	header.sample_rate = sample_rate;
+	header.channels = channels;
+	header.format = format;
+	header.frame_size = channels * sample_size;
+	header.capacity = capacity;
+	header.data_offset = data_offset;
+
+	aq.shm.is_writer = true;
+	aq.capacity = capacity;
+	aq.frame_size = header.frame_size;
+	aq.sample_rate = sample_rate;
+	queue_set_name(&aq.shm, AUDIO_NAME, index);
+
+	size_t size = data_offset + (size_t)capacity * header.frame_size;
+	if (!shm_create(&aq.shm, size)) {
+		return NULL;
+	}
+	aq.header = (struct audio_header *)aq.shm.ptr;
+	aq.shm.wake_seq = &aq.header->wake_seq;
+	aq.data = (uint8_t *)aq.header + data_offset;
+	memcpy(aq.header, &header, sizeof(header));
+	wake_open(&aq.shm);
+
+	struct audio_queue *paq = malloc(sizeof(aq));
+	if (!paq) {
+		wake_close(&aq.shm);
+		shm_close(&aq.shm);
+		return NULL;
+	}
+	memcpy(paq, &aq, sizeof(aq));
+	return paq;
+}
+
+audio_queue_t *audio_queue_open(uint32_t index)
+{
+	struct audio_queue aq = {0};
+
+	if (index >= MAX_QUEUE_INSTANCES) {
+		return NULL;
+	}
+	queue_set_name(&aq.shm, AUDIO_NAME, index);
+
+	if (!shm_open_existing(&aq.shm, sizeof(struct audio_header), false)) {
+		return NULL;
+	}
+
+	/* consuming moves read_pos, so unlike video this needs write access */
+	if (!aq.shm.writable) {
+		shm_close(&aq.shm);
+		return NULL;
+	}
+	aq.header = (struct audio_header *)aq.shm.ptr;
+	aq.shm.wake_seq = &aq.header->wake_seq;
+	wake_open(&aq.shm);
+
+	struct audio_queue *paq = malloc(sizeof(aq));
+	if (!paq) {
+		wake_close(&aq.shm);
+		shm_close(&aq.shm);
+		return NULL;
+	}
+	memcpy(paq, &aq, sizeof(aq));
+	return paq;
+}
+
+void audio_queue_close(audio_queue_t *aq)
+{
+	if (!aq) {
+		return;
+	}
+
+	struct audio_header *ah = aq->header;
+	if (aq->shm.is_writer) {
+		store_release(&ah->state, SHARED_QUEUE_STATE_STOPPING);
+
+		uint32_t seq = load_relaxed(&ah->wake_seq) + 1;
+		store_release(&ah->wake_seq, seq);
+		wake_signal(&aq->shm, seq);
+	}
+
+	if (aq->attached)
+		store_release(&ah->reader_pid, 0);
+
+	wake_close(&aq->shm);
+	shm_close(&aq->shm);
+	free(aq);
+}
+
+/* the header can only be trusted once the writer has set READY */
+static bool audio_reader_attach(struct audio_queue *aq)
+{
+	struct audio_header *ah = aq->header;
+	uint32_t capacity = ah->capacity;
+
+	if (ah->type != SHARED_QUEUE_TYPE_AUDIO || !ah->frame_size ||
+	    !capacity || capacity > AUDIO_MAX_CAPACITY ||
+	    (capacity & (capacity - 1)) != 0)
+		return false;
+#ifndef _WIN32
+	if (ah->data_offset + (size_t)capacity * ah->frame_size > aq->shm.size)
+		return false;
+#endif
+
+	/* one reader at a time, an owner that died without closing is
+	 * replaced */
+	uint32_t owner = load_relaxed(&ah->reader_pid);
+	if (owner && process_alive(owner))
+		return false;
+	if (!compare_swap(&ah->reader_pid, owner, current_pid()))
+		return false;
+
+	aq->capacity = capacity;
+	aq->frame_size = ah->frame_size;
+	aq->sample_rate = ah->sample_rate;
+	aq->data = (uint8_t *)ah + ah->data_offset;
+	aq->dropped_base = load_relaxed(&ah->dropped);
+
+	/* start with the next frames written, not whatever piled up before */
+	aq->read_pos = load_acquire(&ah->write_pos);
+	store_release(&ah->read_pos, aq->read_pos);
+	aq->attached = true;
+	return true;
+}
+
+enum queue_state audio_queue_state(audio_queue_t *aq)
+{
+	if (!aq) {
+		return SHARED_QUEUE_STATE_INVALID;
+	}
+
+	enum queue_state state =
+		(enum queue_state)load_acquire(&aq->header->state);
+	if (!aq->shm.is_writer && !aq->attached &&
+	    state == SHARED_QUEUE_STATE_READY && !audio_reader_attach(aq)) {
+		return SHARED_QUEUE_STATE_INVALID;
+	}
+
+	return state;
+}
+
+void audio_queue_get_info(audio_queue_t *aq, uint32_t *sample_rate,
+			  uint32_t *channels, enum audio_queue_format *format)
+{
+	struct audio_header *ah = aq->header;
+	*sample_rate = ah->sample_rate;
+	*channels = ah->channels;
+	*format = (enum audio_queue_format)ah->format;
+}
+
+uint32_t audio_queue_frame_size(audio_queue_t *aq)
+{
+	return aq->header->frame_size;
+}
+
+/* the two part copies of circlebuf_push_back and circlebuf_pop_front, on a
+ * ring that never grows */
+static void audio_copy_in(struct audio_queue *aq, uint32_t pos,
+			  const uint8_t *src, uint32_t frames)
+{
+	uint32_t start = pos & (aq->capacity - 1);
+	uint32_t first = aq->capacity - start;
+	if (first > frames)
+		first = frames;
+
+	size_t fs = aq->frame_size;
+	memcpy(aq->data + start * fs, src, first * fs);
+	memcpy(aq->data, src + first * fs, (frames - first) * fs);
+}
+
+static void audio_copy_out(struct audio_queue *aq, uint32_t pos, uint8_t *dst,
+			   uint32_t frames)
+{
+	uint32_t start = pos & (aq->capacity - 1);
+	uint32_t first = aq->capacity - start;
+	if (first > frames)
+		first = frames;
+
+	size_t fs = aq->frame_size;
+	memcpy(dst, aq->data + start * fs, first * fs);
+	memcpy(dst + first * fs, aq->data, (frames - first) * fs);
+}
+
+uint32_t audio_queue_write(audio_queue_t *aq, const uint8_t *data,
+			   uint32_t frames, uint64_t timestamp)
+{
+	struct audio_header *ah = aq->header;
+	uint32_t write_pos = load_relaxed(&ah->write_pos);
+	uint32_t queued = write_pos - load_acquire(&ah->read_pos);
+	uint32_t space = queued < aq->capacity ? aq->capacity - queued : 0;
+	uint32_t count = frames < space ? frames : space;
+
+	struct queue_clock *clock = aq->clock ? aq->clock : &aq->own_clock;
+	clock_stamp(clock, &ah->clock, timestamp);
+
+	/* with nobody reading, a full ring is expected */
+	if (count < frames && load_relaxed(&ah->reader_pid))
+		store_relaxed(&ah->dropped,
+			      load_relaxed(&ah->dropped) + frames - count);
+
+	if (count) {
+		audio_copy_in(aq, write_pos, data, count);
+
+		uint32_t ts_seq = load_relaxed(&ah->ts_seq);
+		store_relaxed(&ah->ts_seq, ts_seq + 1);
+		fence_release();
+		ah->ts_pos = write_pos;
+		ah->ts = timestamp;
+		store_release(&ah->ts_seq, ts_seq + 2);
+
+		store_release(&ah->write_pos, write_pos + count);
+	}
+
+	if (!aq->started) {
+		store_release(&ah->state, SHARED_QUEUE_STATE_READY);
+		aq->started = true;
+	}
+
+	uint32_t seq = load_relaxed(&ah->wake_seq) + 1;
+	store_release(&ah->wake_seq, seq);
+	wake_signal(&aq->shm, seq);
+
+	return count;
+}
+
+/* derived from the latest write, exact as long as the frames in between
+ * arrived without gaps */
+static uint64_t audio_timestamp_at(struct audio_queue *aq, uint32_t pos)
+{
+	struct audio_header *ah = aq->header;
+	uint32_t seq, ts_pos;
+	uint64_t ts;
+
+	do {
+		seq = load_acquire(&ah->ts_seq);
+		ts_pos = ah->ts_pos;
+		ts = ah->ts;
+		fence_acquire();
+	} while ((seq & 1) || load_relaxed(&ah->ts_seq) != seq);
+
+	int64_t frames = (int32_t)(pos - ts_pos);
+	return ts + frames * 1000000000LL / (int64_t)aq->sample_rate;
+}
+
+uint64_t audio_queue_map_time(audio_queue_t *aq, uint64_t ts)
+{
+	return clock_mapping_map(&aq->header->clock, ts);
+}
+
+void audio_queue_set_clock(audio_queue_t *aq, struct queue_clock *clock)
+{
+	aq->clock = clock;
+}
+
+uint32_t audio_queue_available(audio_queue_t *aq)
+{
+	if (!aq->attached)
+		return 0;
+
+	uint32_t queued = load_acquire(&aq->header->write_pos) - aq->read_pos;
+	return queued <= aq->capacity ? queued : 0;
+}
+
+bool audio_queue_read(audio_queue_t *aq, uint8_t *dst, uint32_t frames,
+		      uint64_t *ts)
+{
+	struct audio_header *ah = aq->header;
+
+	if (!aq->attached || !frames || frames > aq->capacity)
+		return false;
+	if (load_acquire(&ah->state) == SHARED_QUEUE_STATE_STOPPING)
+		return false;
+
+	uint32_t queued = audio_queue_available(aq);
+	if (queued < frames)
+		return false;
+
+	if (queued / frames > AUDIO_QUEUE_MAX_BACKLOG) {
+		uint32_t skip = queued - frames;
+		aq->read_pos += skip;
+		aq->skipped += skip;
+	}
+
+	audio_copy_out(aq, aq->read_pos, dst, frames);
+	if (ts)
+		*ts = audio_timestamp_at(aq, aq->read_pos);
+
+	/* only now may the writer reuse the frames */
+	aq->read_pos += frames;
+	store_release(&ah->read_pos, aq->read_pos);
+	return true;
+}
+
+bool audio_queue_wait(audio_queue_t *aq, uint32_t frames, uint32_t timeout_ms)
+{
+	uint32_t seq = load_acquire(&aq->header->wake_seq);
+	if (audio_queue_available(aq) >= frames)
+		return true;
+	if (load_acquire(&aq->header->state) == SHARED_QUEUE_STATE_STOPPING)
+		return false;
+
+	if (timeout_ms)
+		wake_wait(&aq->shm, seq, timeout_ms);
+	return audio_queue_available(aq) >= frames;
+}
+
+void audio_queue_get_stats(audio_queue_t *aq, uint64_t *dropped,
+			   uint64_t *skipped)
+{
+	if (dropped)
+		*dropped = aq->attached ? load_relaxed(&aq->header->dropped) -
+						  aq->dropped_base
+					: 0;
+	if (skipped)
+		*skipped = aq->skipped;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -8,8 +9,10 @@ extern "C" {
 #endif
 
 struct video_queue;
+struct audio_queue;
 struct nv12_scale;
 typedef struct video_queue video_queue_t;
+typedef struct audio_queue audio_queue_t;
 typedef struct nv12_scale nv12_scale_t;
 
 enum queue_state {
@@ -19,19 +22,370 @@ enum queue_state {
 	SHARED_QUEUE_STATE_STOPPING,
 };
 
-extern video_queue_t *video_queue_create(uint32_t cx, uint32_t cy,
-					 uint64_t interval);
-extern video_queue_t *video_queue_open();
+/* number of frame slots in the ring, more slots give a slow reader longer
+ * before the writer comes back around to the frame it is copying */
+#define MIN_QUEUE_SLOTS 2
+#define DEFAULT_QUEUE_SLOTS 3
+#define MAX_QUEUE_SLOTS 16
+
+/* readers that can register with one queue at the same time, a reader past
+ * this still works but the writer can't see which slot it is copying */
+#define MAX_QUEUE_READERS 8
+
+/* independent queues that can exist side by side, one per virtual camera */
+#define MAX_QUEUE_INSTANCES 4
+
+/* ------------------------------------------------------------------------- */
+/* clock domain                                                              */
+
+/* every queue header carries a mapping from the writer's timestamps onto a
+ * monotonic reference clock (queue_clock_now) that is the same in every
+ * process on the machine.  the writer keeps it up to date from when frames
+ * actually arrive, so a timestamp maps to the earliest time its frame shows
+ * up, and follows the drift between the stream's clock and the reference.
+ *
+ * the estimator is also what a reader uses to follow its own presentation
+ * clock.  all times are in 100ns units. */
+
+struct queue_clock {
+	/* the video and audio writer of one camera may share an estimator
+	 * from their own threads */
+	volatile uint32_t lock;
+
+	bool valid;
+	uint64_t base_time;
+	uint64_t base_mono;
+
+	/* how much faster the reference runs, in parts per billion */
+	int64_t drift_ppb;
+
+	/* smallest mono - time offset seen in the current and the previous
+	 * window, and when it was seen */
+	uint64_t window_start;
+	uint64_t window_time;
+	int64_t window_min;
+	bool have_prev;
+	uint64_t prev_time;
+	int64_t prev_min;
+};
+
+extern uint64_t queue_clock_now(void);
+extern void queue_clock_init(struct queue_clock *clock);
+/* a frame with timestamp 'time' was seen at reference time 'mono' */
+extern void queue_clock_update(struct queue_clock *clock, uint64_t time,
+			       uint64_t mono);
+extern uint64_t queue_clock_map(struct queue_clock *clock, uint64_t time);
+extern int64_t queue_clock_drift(struct queue_clock *clock);
+
+/* ------------------------------------------------------------------------- */
+/* video                                                                     */
+
+/* what a queue's slots hold, readers convert to what they were asked for */
+enum queue_format {
+	QUEUE_FORMAT_NV12,
+	QUEUE_FORMAT_I420,
+	QUEUE_FORMAT_YUY2,
+	/* 10 bits in the high bits of 16, little endian, nv12 layout */
+	QUEUE_FORMAT_P010,
+	QUEUE_FORMAT_RGBA,
+	QUEUE_FORMAT_COUNT,
+};
+
+#define QUEUE_MAX_PLANES 3
+
+/* frames are stored packed: planes back to back, rows without padding */
+struct queue_plane {
+	uint32_t offset;
+	/* bytes per row */
+	uint32_t width;
+	uint32_t rows;
+};
+
+/* returns the number of planes, 0 for an unknown format */
+extern uint32_t queue_format_planes(enum queue_format format, uint32_t cx,
+				    uint32_t cy, struct queue_plane *planes);
+extern size_t queue_frame_size(enum queue_format format, uint32_t cx,
+			       uint32_t cy);
+
+/* index: which camera's queue, below MAX_QUEUE_INSTANCES
+ * slots: ring depth, 0 for DEFAULT_QUEUE_SLOTS */
+extern video_queue_t *video_queue_create(uint32_t index, uint32_t cx,
+					 uint32_t cy, uint64_t interval,
+					 uint32_t slots);
+extern video_queue_t *
+video_queue_create_format(uint32_t index, uint32_t cx, uint32_t cy,
+			  uint64_t interval, uint32_t slots,
+			  enum queue_format format);
+extern video_queue_t *video_queue_open(uint32_t index);
+/* for monitoring: never registers as a reader and never counts */
+extern video_queue_t *video_queue_open_read_only(uint32_t index);
 extern void video_queue_close(video_queue_t *vq);
 
 extern void video_queue_get_info(video_queue_t *vq, uint32_t *cx, uint32_t *cy,
 				 uint64_t *interval);
+/* readers: only once the state is READY */
+extern enum queue_format video_queue_get_format(video_queue_t *vq);
+/* by default each writer has its own estimator, a camera's video and audio
+ * queue should share one so they map the same timestamp to the same time.
+ * 'clock' must outlive the queue. */
+extern void video_queue_set_clock(video_queue_t *vq, struct queue_clock *clock);
+
+/* timestamps are in nanoseconds, UINT64_MAX if unknown.
+ * data[] are the planes of a frame in the queue's format and size, as many
+ * as queue_format_planes gives, linesize[] their row strides in bytes.
+ * readers convert from the queue's format to whatever they were asked for,
+ * see nv12_scale's src_format. */
 extern void video_queue_write(video_queue_t *vq, uint8_t **data,
 			      uint32_t *linesize, uint64_t timestamp);
+
+/* zero copy writing: the writer fills a slot in place (a packed frame in the
+ * queue's format and size) and then publishes it.  a slot must not be touched
+ * while it is the latest published one, readers may be copying it.  calling
+ * video_queue_begin_write before touching the slot lets readers that are
+ * still copying it notice. */
+extern size_t video_queue_slot_count(video_queue_t *vq);
+extern uint8_t *video_queue_get_slot(video_queue_t *vq, size_t idx,
+				     size_t *size);
+extern void video_queue_begin_write(video_queue_t *vq, size_t idx);
+extern void video_queue_publish(video_queue_t *vq, size_t idx,
+				uint64_t timestamp);
+
 extern enum queue_state video_queue_state(video_queue_t *vq);
 extern bool video_queue_read(video_queue_t *vq, nv12_scale_t *scale, void *dst,
 			     uint64_t *ts);
 
+/* like video_queue_read, but takes the frame that should be on screen at
+ * reference time 'target': the newest one mapped to 'target' or earlier, or
+ * the oldest one if they are all later.  the more slots the queue has, the
+ * further back this can reach. */
+extern bool video_queue_read_at(video_queue_t *vq, nv12_scale_t *scale,
+				void *dst, uint64_t target, uint64_t *ts);
+
+/* reference time a writer timestamp (ns) maps to */
+extern uint64_t video_queue_map_time(video_queue_t *vq, uint64_t ts);
+
+/* blocks until the writer publishes a frame newer than the last one read or
+ * stops, or until timeout_ms passes.  returns true if there is something new
+ * to read. */
+extern bool video_queue_wait(video_queue_t *vq, uint32_t timeout_ms);
+
+/* frames the writer overwrote while they were being read: 'retried' were
+ * read again from a newer slot, 'shown' were handed out torn after running
+ * out of retries */
+extern void video_queue_get_torn_frames(video_queue_t *vq, uint64_t *retried,
+					uint64_t *shown);
+
+/* ------------------------------------------------------------------------- */
+/* writer renditions                                                         */
+
+/* a queue next to the camera's own with its frames scaled by the writer, so
+ * readers that want exactly this format and size only have to copy */
+#define QUEUE_MAX_RENDITIONS 4
+
+struct queue_rendition {
+	/* enum queue_format, nv12, i420 or yuy2 */
+	uint32_t format;
+	uint32_t cx;
+	uint32_t cy;
+};
+
+/* writer: creates rendition number video_queue_get_renditions(vq) with the
+ * same slot count and interval as vq, NULL once there are
+ * QUEUE_MAX_RENDITIONS.  closed with video_queue_close like any queue. */
+extern video_queue_t *video_queue_add_rendition(video_queue_t *vq,
+						enum queue_format format,
+						uint32_t cx, uint32_t cy);
+
+/* writer: scales vq's latest frame into rendition rq and publishes it with
+ * the frame's timestamp and trace.  'scale' goes from vq's size to rq's. */
+extern void video_queue_write_rendition(video_queue_t *vq, video_queue_t *rq,
+					nv12_scale_t *scale);
+
+/* readers: the renditions the writer of vq publishes, returns the count */
+extern uint32_t video_queue_get_renditions(video_queue_t *vq,
+					   struct queue_rendition *renditions);
+
+/* readers: index of the rendition with exactly the format and size 'scale'
+ * puts out, -1 if the writer has none */
+extern int video_queue_find_rendition(video_queue_t *vq,
+				      const nv12_scale_t *scale);
+
+extern video_queue_t *video_queue_open_rendition(uint32_t index,
+						 uint32_t rendition);
+
+/* ------------------------------------------------------------------------- */
+
+/* readers that convert frames the same way (target format, size and filter)
+ * share the result: whichever of them gets to a frame first converts it into
+ * a buffer in shared memory, the others copy it from there.  a copy is what
+ * the conversion would cost anyway for same size nv12/i420/yuy2, those are
+ * never shared.  off by default. */
+extern void video_queue_share_renditions(video_queue_t *vq, bool share);
+
+/* writer: frames dropped by video_queue_write because every slot other than
+ * the current one was being read */
+extern uint64_t video_queue_get_pinned_drops(video_queue_t *vq);
+
+/* totals since the writer created the queue, kept in its header.  the
+ * reader side is summed over every reader, times are in 100ns units. */
+struct queue_stats {
+	/* writer */
+	uint64_t written;
+	uint64_t pinned_drops;
+	uint64_t copy_time;
+
+	/* readers */
+	uint64_t read;
+	/* reads that handed out the same frame as the reader's last one */
+	uint64_t duplicates;
+	/* frames a reader never saw because newer ones replaced them */
+	uint64_t overwritten;
+	/* copies the writer got in the way of, retried or shown */
+	uint64_t torn;
+	/* converting, reads served from a shared rendition aren't in it */
+	uint64_t scale_time;
+	/* reads that copied a frame another reader had converted */
+	uint64_t shared_hits;
+
+	/* registered right now */
+	uint32_t readers;
+};
+
+extern void video_queue_get_stats(video_queue_t *vq, struct queue_stats *stats);
+
+/* ------------------------------------------------------------------------- */
+/* latency tracing                                                           */
+
+/* a frame's trip from the network to the consumer, as reference times
+ * (queue_clock_now) it reached each stage, 0 for stages it wasn't seen at.
+ * the stages up to WRITTEN travel with the frame in its slot. */
+enum queue_trace_stage {
+	QUEUE_TRACE_RECEIVED,  /* left the network source */
+	QUEUE_TRACE_DECODED,   /* left the decoder */
+	QUEUE_TRACE_SINK,      /* reached the writer's sink */
+	QUEUE_TRACE_WRITTEN,   /* published, stamped by the queue */
+	QUEUE_TRACE_READ,      /* copied out, stamped by the queue */
+	QUEUE_TRACE_DELIVERED, /* handed downstream by the reader */
+	QUEUE_TRACE_STAGES,
+};
+
+struct queue_trace {
+	uint64_t stamp[QUEUE_TRACE_STAGES];
+};
+
+/* span i runs from stage i to stage i + 1, TOTAL from the first stage
+ * stamped to DELIVERED */
+enum queue_latency_span {
+	QUEUE_LATENCY_DECODE,
+	QUEUE_LATENCY_SINK,
+	QUEUE_LATENCY_WRITE,
+	QUEUE_LATENCY_QUEUED,
+	QUEUE_LATENCY_DELIVER,
+	QUEUE_LATENCY_TOTAL,
+	QUEUE_LATENCY_SPANS,
+};
+
+/* log-linear buckets like HdrHistogram's: exact below 3.2us, 16 buckets
+ * per power of two above that (6% wide), the last one takes everything
+ * from 13s up.  values are in 100ns units. */
+#define QUEUE_LATENCY_SUB_BITS 4
+#define QUEUE_LATENCY_BUCKETS 384
+
+struct latency_histogram {
+	uint32_t count;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t buckets[QUEUE_LATENCY_BUCKETS];
+};
+
+extern uint32_t latency_bucket(uint64_t value);
+/* smallest value that lands in the bucket */
+extern uint64_t latency_bucket_value(uint32_t bucket);
+/* upper bound of the fraction 'p' (0..1) of the values */
+extern uint64_t latency_percentile(const struct latency_histogram *hist,
+				   double p);
+
+/* writer: stages before WRITTEN for the next video_queue_write or
+ * video_queue_publish */
+extern void video_queue_set_trace(video_queue_t *vq,
+				  const struct queue_trace *trace);
+
+/* reader: the trace of the frame the last read returned, true only the
+ * first time for each frame so repeats aren't counted twice */
+extern bool video_queue_get_trace(video_queue_t *vq, struct queue_trace *trace);
+
+/* reader: adds a trace to the histograms in the queue's header, which every
+ * reader of the queue shares.  does nothing for read only readers. */
+extern void video_queue_record_trace(video_queue_t *vq,
+				     const struct queue_trace *trace);
+
+/* copies the shared histograms, any process can dump them at any time */
+extern void video_queue_get_latency(video_queue_t *vq,
+				    struct latency_histogram *spans);
+
+/* ------------------------------------------------------------------------- */
+/* audio                                                                     */
+
+/* a single producer, single consumer ring of interleaved pcm frames, one per
+ * instance next to the video queue.  the writer appends what fits and drops
+ * the rest, the reader takes fixed size periods off the front. */
+
+enum audio_queue_format {
+	AUDIO_QUEUE_FORMAT_S16,
+	AUDIO_QUEUE_FORMAT_F32,
+};
+
+/* ring length used for capacity_ms == 0 */
+#define DEFAULT_AUDIO_QUEUE_MS 200
+
+/* a reader more than this many periods behind skips ahead to the newest
+ * ones, so a stall doesn't turn into lasting latency */
+#define AUDIO_QUEUE_MAX_BACKLOG 3
+
+/* capacity is rounded up to a power of two frames */
+extern audio_queue_t *audio_queue_create(uint32_t index, uint32_t sample_rate,
+					 uint32_t channels,
+					 enum audio_queue_format format,
+					 uint32_t capacity_ms);
+extern audio_queue_t *audio_queue_open(uint32_t index);
+extern void audio_queue_close(audio_queue_t *aq);
+
+/* a reader takes the queue over once it reports READY, while another live
+ * reader has it the state is SHARED_QUEUE_STATE_INVALID */
+extern enum queue_state audio_queue_state(audio_queue_t *aq);
+extern void audio_queue_get_info(audio_queue_t *aq, uint32_t *sample_rate,
+				 uint32_t *channels,
+				 enum audio_queue_format *format);
+/* bytes per interleaved frame */
+extern uint32_t audio_queue_frame_size(audio_queue_t *aq);
+
+extern void audio_queue_set_clock(audio_queue_t *aq, struct queue_clock *clock);
+
+/* writer: timestamp (ns) is that of the first frame, returns the number of
+ * frames that fit */
+extern uint32_t audio_queue_write(audio_queue_t *aq, const uint8_t *data,
+				  uint32_t frames, uint64_t timestamp);
+
+/* reader: copies exactly 'frames' frames, returns false without consuming
+ * anything while fewer are queued or once the writer stops.  ts receives the
+ * timestamp of the first frame. */
+extern uint32_t audio_queue_available(audio_queue_t *aq);
+extern bool audio_queue_read(audio_queue_t *aq, uint8_t *dst, uint32_t frames,
+			     uint64_t *ts);
+
+/* reference time a timestamp returned by audio_queue_read maps to */
+extern uint64_t audio_queue_map_time(audio_queue_t *aq, uint64_t ts);
+
+/* blocks until at least 'frames' frames are queued, the writer stops or
+ * timeout_ms passes.  returns true if a read of 'frames' would succeed. */
+extern bool audio_queue_wait(audio_queue_t *aq, uint32_t frames,
+			     uint32_t timeout_ms);
+
+/* 'dropped': frames the writer had no room for since the reader attached,
+ * 'skipped': frames this reader threw away to catch up */
+extern void audio_queue_get_stats(audio_queue_t *aq, uint64_t *dropped,
+				  uint64_t *skipped);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,234 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include <stdlib.h>
+#include "tiny-nv12-scale-pool.h"
+
+#ifdef _WIN32
+typedef HANDLE pool_thread_t;
+typedef SRWLOCK pool_mutex_t;
+typedef CONDITION_VARIABLE pool_cond_t;
+
+#define pool_mutex_init(m) InitializeSRWLock(m)
+#define pool_mutex_destroy(m)
+#define pool_mutex_lock(m) AcquireSRWLockExclusive(m)
+#define pool_mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#define pool_cond_init(c) InitializeConditionVariable(c)
+#define pool_cond_destroy(c)
+#define pool_cond_wait(c, m) SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define pool_cond_broadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_t pool_thread_t;
+typedef pthread_mutex_t pool_mutex_t;
+typedef pthread_cond_t pool_cond_t;
+
+#define pool_mutex_init(m) pthread_mutex_init(m, NULL)
+#define pool_mutex_destroy(m) pthread_mutex_destroy(m)
+#define pool_mutex_lock(m) pthread_mutex_lock(m)
+#define pool_mutex_unlock(m) pthread_mutex_unlock(m)
+#define pool_cond_init(c) pthread_cond_init(c, NULL)
+#define pool_cond_destroy(c) pthread_cond_destroy(c)
+#define pool_cond_wait(c, m) pthread_cond_wait(c, m)
+#define pool_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+struct pool_worker {
+	struct nv12_scale_pool *pool;
+	pool_thread_t thread;
+	int band;
+};
+
+struct nv12_scale_pool {
+	int workers;
+	struct pool_worker *worker;
+
+	/* one scratch block per band, band 0 belongs to the calling thread */
+	uint8_t **scratch;
+	size_t scratch_size;
+
+	pool_mutex_t mutex;
+	pool_cond_t start;
+	pool_cond_t done;
+
+	/* bumped for every run, workers wait for it to change */
+	uint32_t generation;
+	int remaining;
+	bool exiting;
+
+	nv12_scale_band_func func;
+	void *param;
+};
+
+static void pool_worker_loop(struct pool_worker *w)
+{
+	struct nv12_scale_pool *pool = w->pool;
+	const int bands = pool->workers + 1;
+	uint32_t seen = 0;
+
+	for (;;) {
+		pool_mutex_lock(&pool->mutex);
+		while (!pool->exiting && pool->generation == seen)
+			pool_cond_wait(&pool->start, &pool->mutex);
+
+		if (pool->exiting) {
+			pool_mutex_unlock(&pool->mutex);
+			return;
+		}
+
+		seen = pool->generation;
+		nv12_scale_band_func func = pool->func;
+		void *param = pool->param;
+		pool_mutex_unlock(&pool->mutex);
+
+		func(param, w->band, bands, pool->scratch[w->band]);
+
+		pool_mutex_lock(&pool->mutex);
+		if (--pool->remaining == 0)
+			pool_cond_broadcast(&pool->done);
+		pool_mutex_unlock(&pool->mutex);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI pool_worker_thread(LPVOID param)
+{
+	pool_worker_loop(param);
+	return 0;
+}
+#else
+static void *pool_worker_thread(void *param)
+{
+	pool_worker_loop(param);
+	return NULL;
+}
+#endif
+
+static bool pool_thread_start(struct pool_worker *w)
+{
+#ifdef _WIN32
+	w->thread = CreateThread(NULL, 0, pool_worker_thread, w, 0, NULL);
+	return w->thread != NULL;
+#else
+	return pthread_create(&w->thread, NULL, pool_worker_thread, w) == 0;
+#endif
+}
+
+static void pool_thread_join(struct pool_worker *w)
+{
+#ifdef _WIN32
+	WaitForSingleObject(w->thread, INFINITE);
+	CloseHandle(w->thread);
+#else
+	pthread_join(w->thread, NULL);
+#endif
+}
+
+static void pool_stop_workers(struct nv12_scale_pool *pool, int started)
+{
+	pool_mutex_lock(&pool->mutex);
+	pool->exiting = true;
+	pool_cond_broadcast(&pool->start);
+	pool_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < started; i++)
+		pool_thread_join(&pool->worker[i]);
+}
+
+struct nv12_scale_pool *nv12_scale_pool_create(int workers)
+{
+	if (workers < 1)
+		return NULL;
+
+	struct nv12_scale_pool *pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->workers = workers;
+	pool->worker = calloc(workers, sizeof(*pool->worker));
+	pool->scratch = calloc(workers + 1, sizeof(*pool->scratch));
+	if (!pool->worker || !pool->scratch) {
+		free(pool->worker);
+		free(pool->scratch);
+		free(pool);
+		return NULL;
+	}
+
+	pool_mutex_init(&pool->mutex);
+	pool_cond_init(&pool->start);
+	pool_cond_init(&pool->done);
+
+	for (int i = 0; i < workers; i++) {
+		struct pool_worker *w = &pool->worker[i];
+		w->pool = pool;
+		w->band = i + 1;
+
+		if (!pool_thread_start(w)) {
+			pool_stop_workers(pool, i);
+			pool->workers = i;
+			nv12_scale_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void nv12_scale_pool_destroy(struct nv12_scale_pool *pool)
+{
+	if (!pool)
+		return;
+
+	if (!pool->exiting)
+		pool_stop_workers(pool, pool->workers);
+
+	for (int i = 0; i <= pool->workers; i++)
+		free(pool->scratch[i]);
+
+	pool_cond_destroy(&pool->done);
+	pool_cond_destroy(&pool->start);
+	pool_mutex_destroy(&pool->mutex);
+
+	free(pool->scratch);
+	free(pool->worker);
+	free(pool);
+}
+
+bool nv12_scale_pool_reserve(struct nv12_scale_pool *pool, size_t size)
+{
+	if (size <= pool->scratch_size)
+		return true;
+
+	/* only called between runs, so the workers aren't using these */
+	for (int i = 0; i <= pool->workers; i++) {
+		uint8_t *ptr = realloc(pool->scratch[i], size);
+		if (!ptr)
+			return false;
+		pool->scratch[i] = ptr;
+	}
+
+	pool->scratch_size = size;
+	return true;
+}
+
+void nv12_scale_pool_run(struct nv12_scale_pool *pool,
+			 nv12_scale_band_func func, void *param)
+{
+	const int bands = pool->workers + 1;
+
+	pool_mutex_lock(&pool->mutex);
+	pool->func = func;
+	pool->param = param;
+	pool->remaining = pool->workers;
+	pool->generation++;
+	pool_cond_broadcast(&pool->start);
+	pool_mutex_unlock(&pool->mutex);
+
+	func(param, 0, bands, pool->scratch[0]);
+
+	pool_mutex_lock(&pool->mutex);
+	while (pool->remaining > 0)
+		pool_cond_wait(&pool->done, &pool->mutex);
+	pool_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* fixed set of worker threads for tiny-nv12-scale.c.  a run splits the work
+ * into one band per worker plus one for the calling thread, which takes part
+ * instead of just waiting. */
+
+struct nv12_scale_pool;
+
+typedef void (*nv12_scale_band_func)(void *param, int band, int bands,
+				     uint8_t *scratch);
+
+extern struct nv12_scale_pool *nv12_scale_pool_create(int workers);
+extern void nv12_scale_pool_destroy(struct nv12_scale_pool *pool);
+
+/* makes sure every band has at least 'size' bytes of scratch memory */
+extern bool nv12_scale_pool_reserve(struct nv12_scale_pool *pool, size_t size);
+
+/* calls func for every band and returns once all of them are done */
+extern void nv12_scale_pool_run(struct nv12_scale_pool *pool,
+				nv12_scale_band_func func, void *param);
+
+#ifdef __cplusplus
+}
+#endif
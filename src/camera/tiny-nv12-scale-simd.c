@@ -0,0 +1,641 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include "tiny-nv12-scale-simd.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+	defined(__i386__)
+#define NV12_SCALE_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(_M_ARM64) || defined(__aarch64__) || defined(__ARM_NEON)
+#define NV12_SCALE_NEON
+#include <arm_neon.h>
+#endif
+
+/* msvc lets any function use any intrinsic, gcc and clang need to be told
+ * which functions may contain avx2 code so the rest of the file (and the
+ * callers) stay plain sse2/baseline. */
+#if defined(NV12_SCALE_X86) && !defined(_MSC_VER)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* plain C                                                                   */
+
+static void split_uv_c(uint8_t *dst_u, uint8_t *dst_v, const uint8_t *src_uv,
+		       int pairs)
+{
+	for (int i = 0; i < pairs; i++) {
+		dst_u[i] = src_uv[i * 2];
+		dst_v[i] = src_uv[i * 2 + 1];
+	}
+}
+
+static void pack_yuy2_c(uint8_t *dst, const uint8_t *src_y,
+			const uint8_t *src_uv, int cx)
+{
+	for (int x = 0; x < cx; x++) {
+		*(dst++) = src_y[x];
+		*(dst++) = src_uv[x];
+	}
+}
+
+static void blend_rows_c(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+			 int weight, int n)
+{
+	const int inv = 256 - weight;
+
+	for (int i = 0; i < n; i++)
+		dst[i] = (uint8_t)((a[i] * inv + b[i] * weight + 128) >> 8);
+}
+
+static void add_row_c(uint16_t *acc, const uint8_t *src, int n)
+{
+	for (int i = 0; i < n; i++)
+		acc[i] += src[i];
+}
+
+static inline uint8_t rgb_to_y(int r, int g, int b)
+{
+	return (uint8_t)((66 * r + 129 * g + 25 * b + 128 + (16 << 8)) >> 8);
+}
+
+/* r, g and b are sums of four pixels */
+static inline uint8_t rgb_to_u(int r, int g, int b)
+{
+	return (uint8_t)((-38 * r - 74 * g + 112 * b + 512 + (128 << 10)) >>
+			 10);
+}
+
+static inline uint8_t rgb_to_v(int r, int g, int b)
+{
+	return (uint8_t)((112 * r - 94 * g - 18 * b + 512 + (128 << 10)) >>
+			 10);
+}
+
+static void rgb32_to_nv12_c(uint8_t *dst_y0, uint8_t *dst_y1, uint8_t *dst_uv,
+			    const uint8_t *src0, const uint8_t *src1, int cx,
+			    bool bgr)
+{
+	const int ri = bgr ? 2 : 0;
+	const int bi = bgr ? 0 : 2;
+
+	for (int x = 0; x + 1 < cx; x += 2) {
+		const uint8_t *p = src0 + x * 4;
+		const uint8_t *q = src1 + x * 4;
+
+		dst_y0[x] = rgb_to_y(p[ri], p[1], p[bi]);
+		dst_y0[x + 1] = rgb_to_y(p[ri + 4], p[5], p[bi + 4]);
+		dst_y1[x] = rgb_to_y(q[ri], q[1], q[bi]);
+		dst_y1[x + 1] = rgb_to_y(q[ri + 4], q[5], q[bi + 4]);
+
+		const int r = p[ri] + p[ri + 4] + q[ri] + q[ri + 4];
+		const int g = p[1] + p[5] + q[1] + q[5];
+		const int b = p[bi] + p[bi + 4] + q[bi] + q[bi + 4];
+
+		dst_uv[x] = rgb_to_u(r, g, b);
+		dst_uv[x + 1] = rgb_to_v(r, g, b);
+	}
+}
+
+static const struct nv12_scale_kernels kernels_c = {
+	NV12_SCALE_CPU_C, split_uv_c,      pack_yuy2_c,
+	blend_rows_c,     add_row_c,       rgb32_to_nv12_c,
+};
+
+/* ------------------------------------------------------------------------- */
+/* x86                                                                       */
+
+#ifdef NV12_SCALE_X86
+
+static void split_uv_sse2(uint8_t *dst_u, uint8_t *dst_v, const uint8_t *src_uv,
+			  int pairs)
+{
+	const __m128i mask = _mm_set1_epi16(0x00FF);
+	int i = 0;
+
+	for (; i + 16 <= pairs; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src_uv + i * 2));
+		__m128i b = _mm_loadu_si128(
+			(const __m128i *)(src_uv + i * 2 + 16));
+
+		__m128i u = _mm_packus_epi16(_mm_and_si128(a, mask),
+					     _mm_and_si128(b, mask));
+		__m128i v = _mm_packus_epi16(_mm_srli_epi16(a, 8),
+					     _mm_srli_epi16(b, 8));
+
+		_mm_storeu_si128((__m128i *)(dst_u + i), u);
+		_mm_storeu_si128((__m128i *)(dst_v + i), v);
+	}
+
+	split_uv_c(dst_u + i, dst_v + i, src_uv + i * 2, pairs - i);
+}
+
+static void pack_yuy2_sse2(uint8_t *dst, const uint8_t *src_y,
+			   const uint8_t *src_uv, int cx)
+{
+	int x = 0;
+
+	/* y0 u0 y1 v0 is just the luma row interleaved with the uv row */
+	for (; x + 16 <= cx; x += 16) {
+		__m128i y = _mm_loadu_si128((const __m128i *)(src_y + x));
+		__m128i uv = _mm_loadu_si128((const __m128i *)(src_uv + x));
+
+		_mm_storeu_si128((__m128i *)(dst + x * 2),
+				 _mm_unpacklo_epi8(y, uv));
+		_mm_storeu_si128((__m128i *)(dst + x * 2 + 16),
+				 _mm_unpackhi_epi8(y, uv));
+	}
+
+	pack_yuy2_c(dst + x * 2, src_y + x, src_uv + x, cx - x);
+}
+
+/* a * inv + b * weight + 128 never exceeds 65408, so plain 16-bit lanes are
+ * enough and the result matches the C version exactly */
+static void blend_rows_sse2(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+			    int weight, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wa = _mm_set1_epi16((short)(256 - weight));
+	const __m128i wb = _mm_set1_epi16((short)weight);
+	const __m128i round = _mm_set1_epi16(128);
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+		__m128i lo = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+		__m128i hi = _mm_add_epi16(
+			_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_packus_epi16(lo, hi));
+	}
+
+	blend_rows_c(dst + i, a + i, b + i, weight, n - i);
+}
+
+static void add_row_sse2(uint16_t *acc, const uint8_t *src, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i *p = (__m128i *)(acc + i);
+
+		_mm_storeu_si128(p, _mm_add_epi16(_mm_loadu_si128(p),
+						  _mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128(p + 1,
+				 _mm_add_epi16(_mm_loadu_si128(p + 1),
+					       _mm_unpackhi_epi8(v, zero)));
+	}
+
+	add_row_c(acc + i, src + i, n - i);
+}
+
+/* both halves of a 32-bit lane as one madd_epi16 coefficient pair */
+static inline __m128i coeff_pair(int16_t lo, int16_t hi)
+{
+	return _mm_set1_epi32((int)((uint32_t)(uint16_t)lo |
+				    ((uint32_t)(uint16_t)hi << 16)));
+}
+
+/* r, g and b of four pixels, one per 32-bit lane */
+static inline void rgb32_channels_sse2(__m128i v, __m128i shift_r,
+				       __m128i shift_b, __m128i *r, __m128i *g,
+				       __m128i *b)
+{
+	const __m128i mask = _mm_set1_epi32(0xFF);
+
+	*r = _mm_and_si128(_mm_srl_epi32(v, shift_r), mask);
+	*g = _mm_and_si128(_mm_srli_epi32(v, 8), mask);
+	*b = _mm_and_si128(_mm_srl_epi32(v, shift_b), mask);
+}
+
+/* the lanes hold at most 1020, so r and g share a lane as a 16-bit pair and
+ * one madd does both products in 32 bits, no different from the C version */
+static inline __m128i rgb_dot_sse2(__m128i r, __m128i g, __m128i b,
+				   __m128i c_rg, __m128i c_b, __m128i round,
+				   int shift)
+{
+	__m128i rg = _mm_or_si128(r, _mm_slli_epi32(g, 16));
+	__m128i sum = _mm_add_epi32(_mm_madd_epi16(rg, c_rg),
+				    _mm_madd_epi16(b, c_b));
+	return _mm_srai_epi32(_mm_add_epi32(sum, round), shift);
+}
+
+/* sums the 2x2 blocks of eight pixels from two rows, four per lane */
+static inline __m128i sum_2x2_sse2(__m128i a0, __m128i b0, __m128i a1,
+				   __m128i b1)
+{
+	__m128i s = _mm_add_epi16(_mm_packs_epi32(a0, b0),
+				  _mm_packs_epi32(a1, b1));
+	return _mm_madd_epi16(s, _mm_set1_epi16(1));
+}
+
+static void rgb32_to_nv12_sse2(uint8_t *dst_y0, uint8_t *dst_y1,
+			       uint8_t *dst_uv, const uint8_t *src0,
+			       const uint8_t *src1, int cx, bool bgr)
+{
+	const __m128i shift_r = _mm_cvtsi32_si128(bgr ? 16 : 0);
+	const __m128i shift_b = _mm_cvtsi32_si128(bgr ? 0 : 16);
+	const __m128i y_rg = coeff_pair(66, 129);
+	const __m128i y_b = coeff_pair(25, 0);
+	const __m128i y_round = _mm_set1_epi32(128 + (16 << 8));
+	const __m128i u_rg = coeff_pair(-38, -74);
+	const __m128i u_b = coeff_pair(112, 0);
+	const __m128i v_rg = coeff_pair(112, -94);
+	const __m128i v_b = coeff_pair(-18, 0);
+	const __m128i uv_round = _mm_set1_epi32(512 + (128 << 10));
+	int x = 0;
+
+	for (; x + 8 <= cx; x += 8) {
+		__m128i ra0, ga0, ba0, rb0, gb0, bb0;
+		__m128i ra1, ga1, ba1, rb1, gb1, bb1;
+
+		rgb32_channels_sse2(
+			_mm_loadu_si128((const __m128i *)(src0 + x * 4)),
+			shift_r, shift_b, &ra0, &ga0, &ba0);
+		rgb32_channels_sse2(
+			_mm_loadu_si128((const __m128i *)(src0 + x * 4 + 16)),
+			shift_r, shift_b, &rb0, &gb0, &bb0);
+		rgb32_channels_sse2(
+			_mm_loadu_si128((const __m128i *)(src1 + x * 4)),
+			shift_r, shift_b, &ra1, &ga1, &ba1);
+		rgb32_channels_sse2(
+			_mm_loadu_si128((const __m128i *)(src1 + x * 4 + 16)),
+			shift_r, shift_b, &rb1, &gb1, &bb1);
+
+		__m128i y0 = _mm_packs_epi32(
+			rgb_dot_sse2(ra0, ga0, ba0, y_rg, y_b, y_round, 8),
+			rgb_dot_sse2(rb0, gb0, bb0, y_rg, y_b, y_round, 8));
+		__m128i y1 = _mm_packs_epi32(
+			rgb_dot_sse2(ra1, ga1, ba1, y_rg, y_b, y_round, 8),
+			rgb_dot_sse2(rb1, gb1, bb1, y_rg, y_b, y_round, 8));
+
+		_mm_storel_epi64((__m128i *)(dst_y0 + x),
+				 _mm_packus_epi16(y0, y0));
+		_mm_storel_epi64((__m128i *)(dst_y1 + x),
+				 _mm_packus_epi16(y1, y1));
+
+		__m128i r = sum_2x2_sse2(ra0, rb0, ra1, rb1);
+		__m128i g = sum_2x2_sse2(ga0, gb0, ga1, gb1);
+		__m128i b = sum_2x2_sse2(ba0, bb0, ba1, bb1);
+
+		__m128i u = rgb_dot_sse2(r, g, b, u_rg, u_b, uv_round, 10);
+		__m128i v = rgb_dot_sse2(r, g, b, v_rg, v_b, uv_round, 10);
+		__m128i uv = _mm_or_si128(u, _mm_slli_epi32(v, 16));
+
+		_mm_storel_epi64((__m128i *)(dst_uv + x),
+				 _mm_packus_epi16(uv, uv));
+	}
+
+	rgb32_to_nv12_c(dst_y0 + x, dst_y1 + x, dst_uv + x, src0 + x * 4,
+			src1 + x * 4, cx - x, bgr);
+}
+
+static const struct nv12_scale_kernels kernels_sse2 = {
+	NV12_SCALE_CPU_SSE2, split_uv_sse2,   pack_yuy2_sse2,
+	blend_rows_sse2,     add_row_sse2,    rgb32_to_nv12_sse2,
+};
+
+TARGET_AVX2 static void split_uv_avx2(uint8_t *dst_u, uint8_t *dst_v,
+				      const uint8_t *src_uv, int pairs)
+{
+	const __m256i mask = _mm256_set1_epi16(0x00FF);
+	int i = 0;
+
+	for (; i + 32 <= pairs; i += 32) {
+		__m256i a = _mm256_loadu_si256(
+			(const __m256i *)(src_uv + i * 2));
+		__m256i b = _mm256_loadu_si256(
+			(const __m256i *)(src_uv + i * 2 + 32));
+
+		__m256i u = _mm256_packus_epi16(_mm256_and_si256(a, mask),
+						_mm256_and_si256(b, mask));
+		__m256i v = _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+						_mm256_srli_epi16(b, 8));
+
+		/* packus works per 128-bit lane, put the quadwords back in
+		 * order */
+		u = _mm256_permute4x64_epi64(u, 0xD8);
+		v = _mm256_permute4x64_epi64(v, 0xD8);
+
+		_mm256_storeu_si256((__m256i *)(dst_u + i), u);
+		_mm256_storeu_si256((__m256i *)(dst_v + i), v);
+	}
+
+	split_uv_sse2(dst_u + i, dst_v + i, src_uv + i * 2, pairs - i);
+}
+
+TARGET_AVX2 static void pack_yuy2_avx2(uint8_t *dst, const uint8_t *src_y,
+				       const uint8_t *src_uv, int cx)
+{
+	int x = 0;
+
+	for (; x + 32 <= cx; x += 32) {
+		__m256i y = _mm256_loadu_si256((const __m256i *)(src_y + x));
+		__m256i uv = _mm256_loadu_si256((const __m256i *)(src_uv + x));
+
+		__m256i lo = _mm256_unpacklo_epi8(y, uv);
+		__m256i hi = _mm256_unpackhi_epi8(y, uv);
+
+		_mm256_storeu_si256((__m256i *)(dst + x * 2),
+				    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + x * 2 + 32),
+				    _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	pack_yuy2_sse2(dst + x * 2, src_y + x, src_uv + x, cx - x);
+}
+
+TARGET_AVX2 static void blend_rows_avx2(uint8_t *dst, const uint8_t *a,
+					const uint8_t *b, int weight, int n)
+{
+	const __m256i wa = _mm256_set1_epi16((short)(256 - weight));
+	const __m256i wb = _mm256_set1_epi16((short)weight);
+	const __m256i round = _mm256_set1_epi16(128);
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i va = _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i *)(a + i)));
+		__m256i vb = _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i *)(b + i)));
+
+		__m256i v = _mm256_add_epi16(_mm256_mullo_epi16(va, wa),
+					     _mm256_mullo_epi16(vb, wb));
+		v = _mm256_srli_epi16(_mm256_add_epi16(v, round), 8);
+
+		/* narrow the two 128-bit halves back into 16 bytes */
+		__m128i out = _mm_packus_epi16(_mm256_castsi256_si128(v),
+					       _mm256_extracti128_si256(v, 1));
+		_mm_storeu_si128((__m128i *)(dst + i), out);
+	}
+
+	blend_rows_sse2(dst + i, a + i, b + i, weight, n - i);
+}
+
+TARGET_AVX2 static void add_row_avx2(uint16_t *acc, const uint8_t *src, int n)
+{
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((const __m128i *)(src + i)));
+		__m256i *p = (__m256i *)(acc + i);
+
+		_mm256_storeu_si256(p,
+				    _mm256_add_epi16(_mm256_loadu_si256(p), v));
+	}
+
+	add_row_sse2(acc + i, src + i, n - i);
+}
+
+/* the rgb conversion only runs on the placeholder and on rgba sources, the
+ * sse2 version is used as is */
+static const struct nv12_scale_kernels kernels_avx2 = {
+	NV12_SCALE_CPU_AVX2, split_uv_avx2,   pack_yuy2_avx2,
+	blend_rows_avx2,     add_row_avx2,    rgb32_to_nv12_sse2,
+};
+
+static void cpuid(int info[4], int leaf)
+{
+#ifdef _MSC_VER
+	__cpuidex(info, leaf, 0);
+#else
+	__asm__ __volatile__("cpuid"
+			     : "=a"(info[0]), "=b"(info[1]), "=c"(info[2]),
+			       "=d"(info[3])
+			     : "a"(leaf), "c"(0));
+#endif
+}
+
+static uint64_t xgetbv0(void)
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static enum nv12_scale_cpu detect_cpu(void)
+{
+	int info[4];
+
+	cpuid(info, 0);
+	const int max_leaf = info[0];
+
+	cpuid(info, 1);
+	const bool sse2 = (info[3] & (1 << 26)) != 0;
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+
+	if (!sse2)
+		return NV12_SCALE_CPU_C;
+
+	/* avx2 also needs the os to save the ymm registers */
+	if (max_leaf >= 7 && osxsave && avx && (xgetbv0() & 0x6) == 0x6) {
+		cpuid(info, 7);
+		if (info[1] & (1 << 5))
+			return NV12_SCALE_CPU_AVX2;
+	}
+
+	return NV12_SCALE_CPU_SSE2;
+}
+
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* arm                                                                       */
+
+#ifdef NV12_SCALE_NEON
+
+static void split_uv_neon(uint8_t *dst_u, uint8_t *dst_v, const uint8_t *src_uv,
+			  int pairs)
+{
+	int i = 0;
+
+	for (; i + 16 <= pairs; i += 16) {
+		uint8x16x2_t uv = vld2q_u8(src_uv + i * 2);
+		vst1q_u8(dst_u + i, uv.val[0]);
+		vst1q_u8(dst_v + i, uv.val[1]);
+	}
+
+	split_uv_c(dst_u + i, dst_v + i, src_uv + i * 2, pairs - i);
+}
+
+static void pack_yuy2_neon(uint8_t *dst, const uint8_t *src_y,
+			   const uint8_t *src_uv, int cx)
+{
+	int x = 0;
+
+	for (; x + 16 <= cx; x += 16) {
+		uint8x16x2_t out;
+		out.val[0] = vld1q_u8(src_y + x);
+		out.val[1] = vld1q_u8(src_uv + x);
+		vst2q_u8(dst + x * 2, out);
+	}
+
+	pack_yuy2_c(dst + x * 2, src_y + x, src_uv + x, cx - x);
+}
+
+static void blend_rows_neon(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+			    int weight, int n)
+{
+	const uint8x8_t wa = vdup_n_u8((uint8_t)(256 - weight));
+	const uint8x8_t wb = vdup_n_u8((uint8_t)weight);
+	int i = 0;
+
+	/* 256 - weight only fits in 8 bits for a non-zero weight, a zero
+	 * weight is left to the C version */
+	for (; weight && i + 8 <= n; i += 8) {
+		uint16x8_t v = vmull_u8(vld1_u8(a + i), wa);
+		v = vmlal_u8(v, vld1_u8(b + i), wb);
+		vst1_u8(dst + i, vrshrn_n_u16(v, 8));
+	}
+
+	blend_rows_c(dst + i, a + i, b + i, weight, n - i);
+}
+
+static void add_row_neon(uint16_t *acc, const uint8_t *src, int n)
+{
+	int i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i),
+					    vld1_u8(src + i)));
+
+	add_row_c(acc + i, src + i, n - i);
+}
+
+/* sums the 2x2 blocks of eight pixels from two rows, four per lane */
+static inline int32x4_t sum_2x2_neon(uint8x8_t a, uint8x8_t b)
+{
+	return vreinterpretq_s32_u32(vpaddlq_u16(vaddl_u8(a, b)));
+}
+
+static inline int16x4_t rgb_to_chroma_neon(int32x4_t r, int32x4_t g,
+					   int32x4_t b, int32_t cr, int32_t cg,
+					   int32_t cb)
+{
+	int32x4_t v = vdupq_n_s32(512 + (128 << 10));
+	v = vmlaq_n_s32(v, r, cr);
+	v = vmlaq_n_s32(v, g, cg);
+	v = vmlaq_n_s32(v, b, cb);
+	return vmovn_s32(vshrq_n_s32(v, 10));
+}
+
+static void rgb32_to_nv12_neon(uint8_t *dst_y0, uint8_t *dst_y1,
+			       uint8_t *dst_uv, const uint8_t *src0,
+			       const uint8_t *src1, int cx, bool bgr)
+{
+	const int ri = bgr ? 2 : 0;
+	const int bi = bgr ? 0 : 2;
+	const uint16x8_t round = vdupq_n_u16(128 + (16 << 8));
+	int x = 0;
+
+	for (; x + 8 <= cx; x += 8) {
+		uint8x8x4_t p = vld4_u8(src0 + x * 4);
+		uint8x8x4_t q = vld4_u8(src1 + x * 4);
+
+		/* 66 * 255 + 129 * 255 + 25 * 255 + 4224 still fits 16 bits */
+		uint16x8_t y0 = vmlal_u8(round, p.val[ri], vdup_n_u8(66));
+		y0 = vmlal_u8(y0, p.val[1], vdup_n_u8(129));
+		y0 = vmlal_u8(y0, p.val[bi], vdup_n_u8(25));
+		uint16x8_t y1 = vmlal_u8(round, q.val[ri], vdup_n_u8(66));
+		y1 = vmlal_u8(y1, q.val[1], vdup_n_u8(129));
+		y1 = vmlal_u8(y1, q.val[bi], vdup_n_u8(25));
+
+		vst1_u8(dst_y0 + x, vshrn_n_u16(y0, 8));
+		vst1_u8(dst_y1 + x, vshrn_n_u16(y1, 8));
+
+		int32x4_t r = sum_2x2_neon(p.val[ri], q.val[ri]);
+		int32x4_t g = sum_2x2_neon(p.val[1], q.val[1]);
+		int32x4_t b = sum_2x2_neon(p.val[bi], q.val[bi]);
+
+		int16x4x2_t uv = vzip_s16(
+			rgb_to_chroma_neon(r, g, b, -38, -74, 112),
+			rgb_to_chroma_neon(r, g, b, 112, -94, -18));
+		vst1_u8(dst_uv + x,
+			vqmovun_s16(vcombine_s16(uv.val[0], uv.val[1])));
+	}
+
+	rgb32_to_nv12_c(dst_y0 + x, dst_y1 + x, dst_uv + x, src0 + x * 4,
+			src1 + x * 4, cx - x, bgr);
+}
+
+static const struct nv12_scale_kernels kernels_neon = {
+	NV12_SCALE_CPU_NEON, split_uv_neon,   pack_yuy2_neon,
+	blend_rows_neon,     add_row_neon,    rgb32_to_nv12_neon,
+};
+
+static enum nv12_scale_cpu detect_cpu(void)
+{
+	/* neon is mandatory on aarch64 */
+	return NV12_SCALE_CPU_NEON;
+}
+
+#endif
+
+#if !defined(NV12_SCALE_X86) && !defined(NV12_SCALE_NEON)
+static enum nv12_scale_cpu detect_cpu(void)
+{
+	return NV12_SCALE_CPU_C;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+static enum nv12_scale_cpu host_cpu(void)
+{
+	/* racing threads all store the same value, so no locking here */
+	static volatile int cpu = -1;
+	if (cpu == -1)
+		cpu = (int)detect_cpu();
+	return (enum nv12_scale_cpu)cpu;
+}
+
+const struct nv12_scale_kernels *
+nv12_scale_get_kernels_for(enum nv12_scale_cpu cpu)
+{
+	const enum nv12_scale_cpu host = host_cpu();
+
+	switch (cpu) {
+	case NV12_SCALE_CPU_C:
+		return &kernels_c;
+#ifdef NV12_SCALE_X86
+	case NV12_SCALE_CPU_SSE2:
+		return host >= NV12_SCALE_CPU_SSE2 ? &kernels_sse2 : NULL;
+	case NV12_SCALE_CPU_AVX2:
+		return host >= NV12_SCALE_CPU_AVX2 ? &kernels_avx2 : NULL;
+#endif
+#ifdef NV12_SCALE_NEON
+	case NV12_SCALE_CPU_NEON:
+		return host == NV12_SCALE_CPU_NEON ? &kernels_neon : NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+const struct nv12_scale_kernels *nv12_scale_get_kernels(void)
+{
+	return nv12_scale_get_kernels_for(host_cpu());
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* row kernels used by tiny-nv12-scale.c.  every kernel has a plain C version
+ * that the vectorized ones must match bit for bit, the best one for the
+ * running cpu is picked once by nv12_scale_get_kernels(). */
+
+enum nv12_scale_cpu {
+	NV12_SCALE_CPU_C,
+	NV12_SCALE_CPU_SSE2,
+	NV12_SCALE_CPU_AVX2,
+	NV12_SCALE_CPU_NEON,
+};
+
+struct nv12_scale_kernels {
+	enum nv12_scale_cpu cpu;
+
+	/* splits 'pairs' interleaved uv pairs into separate u and v rows */
+	void (*split_uv)(uint8_t *dst_u, uint8_t *dst_v, const uint8_t *src_uv,
+			 int pairs);
+
+	/* packs 'cx' luma samples and cx / 2 uv pairs into a yuy2 row */
+	void (*pack_yuy2)(uint8_t *dst, const uint8_t *src_y,
+			  const uint8_t *src_uv, int cx);
+
+	/* dst = (a * (256 - weight) + b * weight + 128) >> 8, weight is in
+	 * [0, 256) */
+	void (*blend_rows)(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+			   int weight, int n);
+
+	/* acc += src, widened to 16 bits */
+	void (*add_row)(uint16_t *acc, const uint8_t *src, int n);
+
+	/* converts two rows of 'cx' 32-bit rgb pixels (cx even) into two luma
+	 * rows and the uv row between them, bt.601 limited range with each uv
+	 * pair the average of a 2x2 block.  'bgr' is the gdi byte order, blue
+	 * first, otherwise red comes first as in rgba.  the fourth byte is
+	 * ignored. */
+	void (*rgb32_to_nv12)(uint8_t *dst_y0, uint8_t *dst_y1,
+			      uint8_t *dst_uv, const uint8_t *src0,
+			      const uint8_t *src1, int cx, bool bgr);
+};
+
+extern const struct nv12_scale_kernels *nv12_scale_get_kernels(void);
+extern const struct nv12_scale_kernels *
+nv12_scale_get_kernels_for(enum nv12_scale_cpu cpu);
+
+#ifdef __cplusplus
+}
+#endif
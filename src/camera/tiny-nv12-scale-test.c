@@ -0,0 +1,208 @@
+/* checks every vectorized kernel table the cpu can run against the plain C
+ * kernels, bit for bit, over lengths that leave every possible tail and with
+ * unaligned buffers.  the bytes around each output are compared too, so a
+ * kernel writing past its row fails as well. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tiny-nv12-scale-simd.h"
+
+#define MAX_LEN 300
+#define GUARD 32
+
+static const char *cpu_names[] = {"c", "sse2", "avx2", "neon"};
+
+static uint32_t rng = 0x12345678;
+
+static uint8_t next_byte(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return (uint8_t)(rng >> 11);
+}
+
+static void fill(void *buf, size_t size)
+{
+	uint8_t *p = buf;
+	for (size_t i = 0; i < size; i++)
+		p[i] = next_byte();
+}
+
+static int failures;
+
+static void check(const char *kernel, const char *cpu, int n, const void *a,
+		  const void *b, size_t size)
+{
+	if (memcmp(a, b, size) == 0)
+		return;
+
+	fprintf(stderr, "%s %s differs from c at length %d\n", kernel, cpu, n);
+	failures++;
+}
+
+/* the source and destination offsets move the buffers off any alignment */
+static void test_split_uv(const struct nv12_scale_kernels *c,
+			  const struct nv12_scale_kernels *k, const char *cpu)
+{
+	static uint8_t src[MAX_LEN * 2 + GUARD];
+	static uint8_t u[2][MAX_LEN + GUARD], v[2][MAX_LEN + GUARD];
+
+	for (int n = 0; n <= MAX_LEN; n++) {
+		const int off = n % 3;
+
+		fill(src, sizeof(src));
+		fill(u[0], sizeof(u[0]));
+		fill(v[0], sizeof(v[0]));
+		memcpy(u[1], u[0], sizeof(u[0]));
+		memcpy(v[1], v[0], sizeof(v[0]));
+
+		c->split_uv(u[0] + off, v[0] + off, src + off, n);
+		k->split_uv(u[1] + off, v[1] + off, src + off, n);
+
+		check("split_uv", cpu, n, u[0], u[1], sizeof(u[0]));
+		check("split_uv", cpu, n, v[0], v[1], sizeof(v[0]));
+	}
+}
+
+static void test_pack_yuy2(const struct nv12_scale_kernels *c,
+			   const struct nv12_scale_kernels *k, const char *cpu)
+{
+	static uint8_t y[MAX_LEN + GUARD], uv[MAX_LEN + GUARD];
+	static uint8_t dst[2][MAX_LEN * 2 + GUARD];
+
+	for (int n = 0; n <= MAX_LEN; n++) {
+		const int off = n % 3;
+
+		fill(y, sizeof(y));
+		fill(uv, sizeof(uv));
+		fill(dst[0], sizeof(dst[0]));
+		memcpy(dst[1], dst[0], sizeof(dst[0]));
+
+		c->pack_yuy2(dst[0] + off, y + off, uv + off, n);
+		k->pack_yuy2(dst[1] + off, y + off, uv + off, n);
+
+		check("pack_yuy2", cpu, n, dst[0], dst[1], sizeof(dst[0]));
+	}
+}
+
+static void test_blend_rows(const struct nv12_scale_kernels *c,
+			    const struct nv12_scale_kernels *k, const char *cpu)
+{
+	static const int weights[] = {0, 1, 64, 127, 128, 200, 255};
+	static uint8_t a[MAX_LEN + GUARD], b[MAX_LEN + GUARD];
+	static uint8_t dst[2][MAX_LEN + GUARD];
+
+	for (size_t w = 0; w < sizeof(weights) / sizeof(weights[0]); w++) {
+		for (int n = 0; n <= MAX_LEN; n++) {
+			const int off = n % 3;
+
+			fill(a, sizeof(a));
+			fill(b, sizeof(b));
+			fill(dst[0], sizeof(dst[0]));
+			memcpy(dst[1], dst[0], sizeof(dst[0]));
+
+			c->blend_rows(dst[0] + off, a + off, b + off,
+				      weights[w], n);
+			k->blend_rows(dst[1] + off, a + off, b + off,
+				      weights[w], n);
+
+			check("blend_rows", cpu, n, dst[0], dst[1],
+			      sizeof(dst[0]));
+		}
+	}
+}
+
+static void test_add_row(const struct nv12_scale_kernels *c,
+			 const struct nv12_scale_kernels *k, const char *cpu)
+{
+	static uint8_t src[MAX_LEN + GUARD];
+	static uint16_t acc[2][MAX_LEN + GUARD];
+
+	for (int n = 0; n <= MAX_LEN; n++) {
+		const int off = n % 3;
+
+		fill(src, sizeof(src));
+		fill(acc[0], sizeof(acc[0]));
+		memcpy(acc[1], acc[0], sizeof(acc[0]));
+
+		c->add_row(acc[0] + off, src + off, n);
+		k->add_row(acc[1] + off, src + off, n);
+
+		check("add_row", cpu, n, acc[0], acc[1], sizeof(acc[0]));
+	}
+}
+
+/* cx is always even here, the uv row has a pair per two pixels */
+static void test_rgb32_to_nv12(const struct nv12_scale_kernels *c,
+			       const struct nv12_scale_kernels *k,
+			       const char *cpu)
+{
+	static uint8_t src0[MAX_LEN * 4 + GUARD], src1[MAX_LEN * 4 + GUARD];
+	static uint8_t y0[2][MAX_LEN + GUARD], y1[2][MAX_LEN + GUARD];
+	static uint8_t uv[2][MAX_LEN + GUARD];
+
+	for (int bgr = 0; bgr < 2; bgr++) {
+		for (int n = 0; n <= MAX_LEN; n += 2) {
+			const int off = (n / 2) % 3;
+
+			fill(src0, sizeof(src0));
+			fill(src1, sizeof(src1));
+
+			/* the extremes, where rounding and saturation show */
+			if (n % 8 == 2) {
+				memset(src0, 0xFF, sizeof(src0));
+				memset(src1, 0x00, sizeof(src1));
+			}
+
+			fill(y0[0], sizeof(y0[0]));
+			fill(y1[0], sizeof(y1[0]));
+			fill(uv[0], sizeof(uv[0]));
+			memcpy(y0[1], y0[0], sizeof(y0[0]));
+			memcpy(y1[1], y1[0], sizeof(y1[0]));
+			memcpy(uv[1], uv[0], sizeof(uv[0]));
+
+			c->rgb32_to_nv12(y0[0] + off, y1[0] + off, uv[0] + off,
+					 src0 + off, src1 + off, n, bgr);
+			k->rgb32_to_nv12(y0[1] + off, y1[1] + off, uv[1] + off,
+					 src0 + off, src1 + off, n, bgr);
+
+			check("rgb32_to_nv12", cpu, n, y0[0], y0[1],
+			      sizeof(y0[0]));
+			check("rgb32_to_nv12", cpu, n, y1[0], y1[1],
+			      sizeof(y1[0]));
+			check("rgb32_to_nv12", cpu, n, uv[0], uv[1],
+			      sizeof(uv[0]));
+		}
+	}
+}
+
+int main(void)
+{
+	const struct nv12_scale_kernels *c =
+		nv12_scale_get_kernels_for(NV12_SCALE_CPU_C);
+	int tested = 0;
+
+	for (int cpu = NV12_SCALE_CPU_SSE2; cpu <= NV12_SCALE_CPU_NEON; cpu++) {
+		const struct nv12_scale_kernels *k =
+			nv12_scale_get_kernels_for((enum nv12_scale_cpu)cpu);
+		if (!k)
+			continue;
+
+		const char *name = cpu_names[cpu];
+		test_split_uv(c, k, name);
+		test_pack_yuy2(c, k, name);
+		test_blend_rows(c, k, name);
+		test_add_row(c, k, name);
+		test_rgb32_to_nv12(c, k, name);
+
+		printf("%s kernels checked\n", name);
+		tested++;
+	}
+
+	if (!tested)
+		printf("no vectorized kernels on this cpu\n");
+
+	return failures ? 1 : 0;
+}
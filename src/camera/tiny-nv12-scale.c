@@ -1,10 +1,179 @@
+#include <stdlib.h>
 #include <string.h>
 #include "tiny-nv12-scale.h"
+#include "tiny-nv12-scale-simd.h"
+#include "tiny-nv12-scale-pool.h"
+
+/* the same-size conversions, the rgba source conversion and the vertical
+ * passes of the bilinear and area filters go through the vectorized row
+ * kernels in tiny-nv12-scale-simd.c.  the horizontal passes are per-pixel
+ * gathers through tables built once per geometry, not per frame, and the
+ * i420, yuy2 and p010 source conversions are plain loops. */
+
+/* per-axis source sample tables, in pixels of the plane (chroma tables count
+ * uv pairs).  nearest: take begin.  bilinear: blend begin and end by
+ * weight / 256.  area: average [begin, end), weight is 65536 / count. */
+struct scale_axis {
+	int *begin;
+	int *end;
+	uint32_t *weight;
+};
+
+struct nv12_scale_data {
+	/* what the tables were built for, uv_y's length depends on format */
+	enum target_format format;
+	enum scale_filter filter;
+	bool box;
+
+	struct scale_axis lum_x;
+	struct scale_axis lum_y;
+	struct scale_axis uv_x;
+	struct scale_axis uv_y;
+
+	/* vertical pass row (16-bit accumulators for area) plus one luma and
+	 * one chroma output row for the formats that repack */
+	uint8_t *scratch;
+};
+
+/* the area filter sums up to this many source rows in 16-bit lanes */
+#define MAX_BOX_ROWS 256
+
+static void axis_free(struct scale_axis *a)
+{
+	free(a->begin);
+	free(a->end);
+	free(a->weight);
+	memset(a, 0, sizeof(*a));
+}
+
+static bool axis_alloc(struct scale_axis *a, int count)
+{
+	const size_t n = count > 0 ? (size_t)count : 1;
+
+	a->begin = malloc(n * sizeof(int));
+	a->end = malloc(n * sizeof(int));
+	a->weight = malloc(n * sizeof(uint32_t));
+	return a->begin && a->end && a->weight;
+}
+
+static void axis_init_bilinear(struct scale_axis *a, int dst, int src)
+{
+	for (int i = 0; i < dst; i++) {
+		/* pixel centers line up: (i + 0.5) * src / dst - 0.5, 16.16 */
+		int64_t pos = ((int64_t)(2 * i + 1) * src << 16) / (2 * dst) -
+			      (1 << 15);
+		if (pos < 0)
+			pos = 0;
+
+		int first = (int)(pos >> 16);
+		uint32_t weight = (uint32_t)(pos & 0xFFFF) >> 8;
+
+		if (first >= src - 1) {
+			first = src - 1;
+			weight = 0;
+		}
+
+		a->begin[i] = first;
+		a->end[i] = weight ? first + 1 : first;
+		a->weight[i] = weight;
+	}
+}
+
+static void axis_init_box(struct scale_axis *a, int dst, int src, int max)
+{
+	for (int i = 0; i < dst; i++) {
+		int first = (int)((int64_t)i * src / dst);
+		int last = (int)((int64_t)(i + 1) * src / dst);
+
+		if (last - first > max)
+			last = first + max;
+
+		a->begin[i] = first;
+		a->end[i] = last;
+		a->weight[i] = (65536 + (last - first) / 2) / (last - first);
+	}
+}
 
-/* TODO: optimize this stuff later, or replace with something better.  it's
- * kind of garbage.  although normally it shouldn't be called that often.  plus
- * it's nearest neighbor so not really a huge deal.  at the very least it
- * should be sse2 at some point. */
+static void axis_init_nearest(struct scale_axis *a, int dst, int src)
+{
+	for (int i = 0; i < dst; i++) {
+		a->begin[i] = (int)((int64_t)i * src / dst);
+		a->end[i] = a->begin[i];
+		a->weight[i] = 0;
+	}
+}
+
+static void axis_init(struct scale_axis *a, enum scale_filter filter, bool box,
+		      int dst, int src, int max)
+{
+	if (filter == SCALE_FILTER_NEAREST)
+		axis_init_nearest(a, dst, src);
+	else if (box)
+		axis_init_box(a, dst, src, max);
+	else
+		axis_init_bilinear(a, dst, src);
+}
+
+static void scale_data_free(struct nv12_scale_data *d)
+{
+	if (!d)
+		return;
+
+	axis_free(&d->lum_x);
+	axis_free(&d->lum_y);
+	axis_free(&d->uv_x);
+	axis_free(&d->uv_y);
+	free(d->scratch);
+	free(d);
+}
+
+static inline size_t scratch_size(const nv12_scale_t *s)
+{
+	return (size_t)s->src_cx * sizeof(uint16_t) + (size_t)s->dst_cx * 2 +
+	       64;
+}
+
+static struct nv12_scale_data *scale_data_create(const nv12_scale_t *s)
+{
+	struct nv12_scale_data *d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+
+	const int dst_cx_d2 = s->dst_cx / 2;
+	const int src_cx_d2 = s->src_cx / 2;
+	const int src_cy_d2 = (s->src_cy + 1) / 2;
+
+	/* yuy2 needs chroma for an odd last row as well */
+	const int dst_cy_d2 = s->format == TARGET_FORMAT_YUY2
+				      ? (s->dst_cy + 1) / 2
+				      : s->dst_cy / 2;
+
+	d->format = s->format;
+	d->filter = s->filter;
+	d->box = s->filter == SCALE_FILTER_AREA && s->dst_cx < s->src_cx &&
+		 s->dst_cy < s->src_cy;
+
+	bool success = axis_alloc(&d->lum_x, s->dst_cx) &&
+		       axis_alloc(&d->lum_y, s->dst_cy) &&
+		       axis_alloc(&d->uv_x, dst_cx_d2) &&
+		       axis_alloc(&d->uv_y, dst_cy_d2);
+
+	d->scratch = malloc(scratch_size(s));
+
+	if (!success || !d->scratch) {
+		scale_data_free(d);
+		return NULL;
+	}
+
+	axis_init(&d->lum_x, d->filter, d->box, s->dst_cx, s->src_cx,
+		  s->src_cx);
+	axis_init(&d->lum_y, d->filter, d->box, s->dst_cy, s->src_cy,
+		  MAX_BOX_ROWS);
+	axis_init(&d->uv_x, d->filter, d->box, dst_cx_d2, src_cx_d2, src_cx_d2);
+	axis_init(&d->uv_y, d->filter, d->box, dst_cy_d2, src_cy_d2,
+		  MAX_BOX_ROWS);
+	return d;
+}
 
 void nv12_scale_init(nv12_scale_t *s, enum target_format format, int dst_cx,
 		     int dst_cy, int src_cx, int src_cy)
@@ -16,192 +185,479 @@ void nv12_scale_init(nv12_scale_t *s, enum target_format format, int dst_cx,
 
 	s->dst_cx = dst_cx;
 	s->dst_cy = dst_cy;
+
+	scale_data_free(s->data);
+	s->data = NULL;
+
+	/* the tables only depend on the geometry and the filter, so they are
+	 * built here once rather than per frame */
+	if (src_cx != dst_cx || src_cy != dst_cy)
+		s->data = scale_data_create(s);
 }
 
-static void nv12_scale_nearest(nv12_scale_t *s, uint8_t *dst_start,
-			       const uint8_t *src)
+void nv12_scale_free(nv12_scale_t *s)
 {
-	register uint8_t *dst = dst_start;
-	const int src_cx = s->src_cx;
-	const int src_cy = s->src_cy;
-	const int dst_cx = s->dst_cx;
-	const int dst_cy = s->dst_cy;
+	scale_data_free(s->data);
+	s->data = NULL;
+
+	nv12_scale_pool_destroy(s->pool);
+	s->pool = NULL;
+	s->threads = 0;
+
+	free(s->src_nv12);
+	s->src_nv12 = NULL;
+	s->src_nv12_size = 0;
+}
 
-	/* lum */
-	for (int y = 0; y < dst_cy; y++) {
-		const int src_line = y * src_cy / dst_cy * s->src_cx;
+/* ------------------------------------------------------------------------- */
+/* scaling                                                                   */
 
-		for (int x = 0; x < dst_cx; x++) {
-			const int src_x = x * src_cx / dst_cx;
+static void nearest_row(const struct scale_axis *ax, const uint8_t *row,
+			int ch, uint8_t *dst, int dst_w)
+{
+	const int *begin = ax->begin;
 
-			*(dst++) = src[src_line + src_x];
+	if (ch == 1) {
+		for (int x = 0; x < dst_w; x++)
+			dst[x] = row[begin[x]];
+	} else {
+		for (int x = 0; x < dst_w; x++) {
+			const uint8_t *p = row + begin[x] * 2;
+			*(dst++) = p[0];
+			*(dst++) = p[1];
 		}
 	}
+}
 
-	src += src_cx * src_cy;
+static inline uint8_t box_value(uint32_t sum, uint64_t w)
+{
+	const uint64_t val = (sum * w + (1ULL << 31)) >> 32;
+	return (uint8_t)(val > 255 ? 255 : val);
+}
 
-	/* uv */
-	const int dst_cx_d2 = dst_cx / 2;
-	const int dst_cy_d2 = dst_cy / 2;
+static void box_row(const struct scale_axis *ax, const uint16_t *acc,
+		    uint32_t wy, int ch, uint8_t *dst, int dst_w)
+{
+	const int *begin = ax->begin;
+	const int *end = ax->end;
+	const uint32_t *weight = ax->weight;
 
-	for (int y = 0; y < dst_cy_d2; y++) {
-		const int src_line = y * src_cy / dst_cy * src_cx;
+	if (ch == 1) {
+		for (int x = 0; x < dst_w; x++) {
+			uint32_t sum = 0;
+			for (int i = begin[x]; i < end[x]; i++)
+				sum += acc[i];
 
-		for (int x = 0; x < dst_cx_d2; x++) {
-			const int src_x = x * src_cx / dst_cx * 2;
-			const int pos = src_line + src_x;
+			dst[x] = box_value(sum, (uint64_t)weight[x] * wy);
+		}
+	} else {
+		for (int x = 0; x < dst_w; x++) {
+			uint32_t sum_u = 0;
+			uint32_t sum_v = 0;
+			for (int i = begin[x]; i < end[x]; i++) {
+				sum_u += acc[i * 2];
+				sum_v += acc[i * 2 + 1];
+			}
+
+			const uint64_t w = (uint64_t)weight[x] * wy;
+			*(dst++) = box_value(sum_u, w);
+			*(dst++) = box_value(sum_v, w);
+		}
+	}
+}
 
-			*(dst++) = src[pos];
-			*(dst++) = src[pos + 1];
+static void bilinear_row(const struct scale_axis *ax, const uint8_t *row,
+			 int ch, uint8_t *dst, int dst_w)
+{
+	const int *begin = ax->begin;
+	const int *end = ax->end;
+	const uint32_t *weight = ax->weight;
+
+	if (ch == 1) {
+		for (int x = 0; x < dst_w; x++) {
+			const uint32_t w = weight[x];
+			dst[x] = (uint8_t)((row[begin[x]] * (256 - w) +
+					    row[end[x]] * w + 128) >>
+					   8);
+		}
+	} else {
+		for (int x = 0; x < dst_w; x++) {
+			const uint8_t *a = row + begin[x] * 2;
+			const uint8_t *b = row + end[x] * 2;
+			const uint32_t w = weight[x];
+			const uint32_t inv = 256 - w;
+
+			*(dst++) = (uint8_t)((a[0] * inv + b[0] * w + 128) >> 8);
+			*(dst++) = (uint8_t)((a[1] * inv + b[1] * w + 128) >> 8);
 		}
 	}
 }
 
-static void nv12_scale_nearest_to_i420(nv12_scale_t *s, uint8_t *dst_start,
-				       const uint8_t *src)
+/* scales one row of a plane with 'ch' interleaved channels.  'plane' and
+ * 'stride' describe the source plane, 'tmp' must hold src_w * ch 16-bit
+ * values. */
+static void filter_row(const struct nv12_scale_kernels *k,
+		       const struct nv12_scale_data *d,
+		       const struct scale_axis *ax, const struct scale_axis *ay,
+		       int y, const uint8_t *plane, int stride, int src_w,
+		       int ch, uint8_t *dst, int dst_w, uint8_t *tmp)
 {
-	register uint8_t *dst = dst_start;
+	const int n = src_w * ch;
+
+	if (d->filter == SCALE_FILTER_NEAREST) {
+		nearest_row(ax, plane + ay->begin[y] * stride, ch, dst, dst_w);
+		return;
+	}
+
+	if (d->box) {
+		uint16_t *acc = (uint16_t *)tmp;
+
+		memset(acc, 0, n * sizeof(uint16_t));
+		for (int sy = ay->begin[y]; sy < ay->end[y]; sy++)
+			k->add_row(acc, plane + sy * stride, n);
+
+		box_row(ax, acc, ay->weight[y], ch, dst, dst_w);
+		return;
+	}
+
+	/* vertical pass, skipped when the row lands on a source row */
+	const uint8_t *row = plane + ay->begin[y] * stride;
+	if (ay->weight[y]) {
+		k->blend_rows(tmp, row, plane + ay->end[y] * stride,
+			      (int)ay->weight[y], n);
+		row = tmp;
+	}
+
+	bilinear_row(ax, row, ch, dst, dst_w);
+}
+
+/* scales output rows [y_begin, y_end) and the chroma rows that go with them,
+ * y_begin must be even so bands never share a chroma row */
+static void nv12_scale_rows(nv12_scale_t *s, uint8_t *dst, const uint8_t *src,
+			    int y_begin, int y_end, uint8_t *tmp)
+{
+	const struct nv12_scale_kernels *k = nv12_scale_get_kernels();
+	const struct nv12_scale_data *d = s->data;
 	const int src_cx = s->src_cx;
 	const int src_cy = s->src_cy;
 	const int dst_cx = s->dst_cx;
 	const int dst_cy = s->dst_cy;
-	const int size = src_cx * src_cy;
+	const int dst_cx_d2 = dst_cx / 2;
+	const int dst_cy_d2 = dst_cy / 2;
+
+	const uint8_t *src_uv = src + src_cx * src_cy;
+	uint8_t *row_y = tmp + src_cx * sizeof(uint16_t);
+	uint8_t *row_uv = row_y + dst_cx;
 
-	/* lum */
-	for (int y = 0; y < dst_cy; y++) {
-		const int src_line = y * src_cy / dst_cy * s->src_cx;
+	if (s->format == TARGET_FORMAT_YUY2) {
+		int prev_y2 = -1;
 
-		for (int x = 0; x < dst_cx; x++) {
-			const int src_x = x * src_cx / dst_cx;
+		for (int y = y_begin; y < y_end; y++) {
+			const int y2 = y / 2;
+
+			filter_row(k, d, &d->lum_x, &d->lum_y, y, src, src_cx,
+				   src_cx, 1, row_y, dst_cx, tmp);
+
+			/* each chroma row is shared by two luma rows */
+			if (y2 != prev_y2) {
+				filter_row(k, d, &d->uv_x, &d->uv_y, y2, src_uv,
+					   src_cx, src_cx / 2, 2, row_uv,
+					   dst_cx_d2, tmp);
+				prev_y2 = y2;
+			}
+
+			k->pack_yuy2(dst + y * dst_cx * 2, row_y, row_uv,
+				     dst_cx);
+		}
+		return;
+	}
 
-			*(dst++) = src[src_line + src_x];
+	for (int y = y_begin; y < y_end; y++)
+		filter_row(k, d, &d->lum_x, &d->lum_y, y, src, src_cx, src_cx,
+			   1, dst + y * dst_cx, dst_cx, tmp);
+
+	uint8_t *dst_uv = dst + dst_cx * dst_cy;
+	uint8_t *dst_u = dst_uv;
+	uint8_t *dst_v = dst_u + dst_cx * dst_cy / 4;
+	const int y2_end = y_end == dst_cy ? dst_cy_d2 : y_end / 2;
+
+	for (int y = y_begin / 2; y < y2_end; y++) {
+		if (s->format == TARGET_FORMAT_I420) {
+			filter_row(k, d, &d->uv_x, &d->uv_y, y, src_uv, src_cx,
+				   src_cx / 2, 2, row_uv, dst_cx_d2, tmp);
+			k->split_uv(dst_u + y * dst_cx_d2, dst_v + y * dst_cx_d2,
+				    row_uv, dst_cx_d2);
+		} else {
+			filter_row(k, d, &d->uv_x, &d->uv_y, y, src_uv, src_cx,
+				   src_cx / 2, 2, dst_uv + y * dst_cx,
+				   dst_cx_d2, tmp);
 		}
 	}
+}
 
-	src += size;
+/* ------------------------------------------------------------------------- */
+/* same size                                                                 */
 
-	/* uv */
-	const int dst_cx_d2 = dst_cx / 2;
-	const int dst_cy_d2 = dst_cy / 2;
+static void nv12_convert_rows(nv12_scale_t *s, uint8_t *dst,
+			      const uint8_t *src, int y_begin, int y_end)
+{
+	const struct nv12_scale_kernels *k = nv12_scale_get_kernels();
+	const int cx = s->src_cx;
+	const int cy = s->src_cy;
+	const int size = cx * cy;
+	const int y2_begin = y_begin / 2;
+	const int y2_end = y_end == cy ? cy / 2 : y_end / 2;
 
-	register uint8_t *dst2 = dst + dst_cx * dst_cy / 4;
+	const uint8_t *src_uv = src + size;
+
+	/* an odd last row has a chroma row of its own, see nv12_source_size */
+	if (s->format == TARGET_FORMAT_YUY2) {
+		for (int y = y_begin; y < y_end; y++)
+			k->pack_yuy2(dst + y * cx * 2, src + y * cx,
+				     src_uv + (y / 2) * cx, cx);
+		return;
+	}
 
-	for (int y = 0; y < dst_cy_d2; y++) {
-		const int src_line = y * src_cy / dst_cy * src_cx;
+	memcpy(dst + y_begin * cx, src + y_begin * cx,
+	       (size_t)(y_end - y_begin) * cx);
 
-		for (int x = 0; x < dst_cx_d2; x++) {
-			const int src_x = x * src_cx / dst_cx * 2;
-			const int pos = src_line + src_x;
+	if (s->format == TARGET_FORMAT_I420) {
+		const int cx_d2 = cx / 2;
+		uint8_t *dst_u = dst + size;
+		uint8_t *dst_v = dst_u + size / 4;
 
-			*(dst++) = src[pos];
-			*(dst2++) = src[pos + 1];
-		}
+		k->split_uv(dst_u + y2_begin * cx_d2, dst_v + y2_begin * cx_d2,
+			    src_uv + y2_begin * cx,
+			    (y2_end - y2_begin) * cx_d2);
+	} else {
+		memcpy(dst + size + y2_begin * cx, src_uv + y2_begin * cx,
+		       (size_t)(y2_end - y2_begin) * cx);
 	}
 }
 
-static void nv12_convert_to_i420(nv12_scale_t *s, uint8_t *dst_start,
-				 const uint8_t *src_start)
+/* ------------------------------------------------------------------------- */
+/* source formats                                                            */
+
+/* sources have a chroma row for an odd last row, like queue_format_planes */
+static inline size_t nv12_source_size(int cx, int cy)
 {
-	const int size = s->src_cx * s->src_cy;
-	const int size_d4 = size / 4;
+	return (size_t)cx * cy + (size_t)cx * ((cy + 1) / 2);
+}
 
-	memcpy(dst_start, src_start, size);
+static void i420_to_nv12(uint8_t *dst, const uint8_t *src, int cx, int cy)
+{
+	const size_t size = (size_t)cx * cy;
+	const size_t pairs = (size_t)(cx / 2) * ((cy + 1) / 2);
+	const uint8_t *src_u = src + size;
+	const uint8_t *src_v = src_u + pairs;
+	uint8_t *dst_uv = dst + size;
+
+	memcpy(dst, src, size);
+	for (size_t i = 0; i < pairs; i++) {
+		*(dst_uv++) = src_u[i];
+		*(dst_uv++) = src_v[i];
+	}
+}
+
+/* yuy2 carries chroma for every row, nv12 for every other one */
+static void yuy2_to_nv12(uint8_t *dst, const uint8_t *src, int cx, int cy)
+{
+	const int stride = cx * 2;
+	uint8_t *dst_uv = dst + (size_t)cx * cy;
 
-	register uint8_t *dst1 = dst_start + size;
-	register uint8_t *dst2 = dst1 + size_d4;
-	register uint8_t *dst_end = dst2 + size_d4;
-	register const uint8_t *src = src_start + size;
+	for (int y = 0; y < cy; y++) {
+		const uint8_t *row = src + (size_t)y * stride;
+		uint8_t *dst_y = dst + (size_t)y * cx;
 
-	while (dst2 < dst_end) {
-		*(dst1++) = *(src++);
-		*(dst2++) = *(src++);
+		for (int x = 0; x < cx; x++)
+			dst_y[x] = row[x * 2];
+	}
+
+	for (int y = 0; y < (cy + 1) / 2; y++) {
+		const uint8_t *a = src + (size_t)(y * 2) * stride + 1;
+		const uint8_t *b = y * 2 + 1 < cy ? a + stride : a;
+		uint8_t *uv = dst_uv + (size_t)y * cx;
+
+		for (int x = 0; x < cx; x++)
+			uv[x] = (uint8_t)((a[x * 2] + b[x * 2] + 1) >> 1);
 	}
 }
 
-static void nv12_scale_nearest_to_yuy2(nv12_scale_t *s, uint8_t *dst_start,
-				       const uint8_t *src)
+static void p010_to_nv12(uint8_t *dst, const uint8_t *src, int cx, int cy)
 {
-	register uint8_t *dst = dst_start;
-	const int src_cx = s->src_cx;
-	const int src_cy = s->src_cy;
-	const int dst_cx = s->dst_cx;
-	const int dst_cy = s->dst_cy;
-	const int src_cx_d2 = src_cx / 2;
-	const int src_cy_d2 = src_cy / 2;
-	const int dst_cx_d2 = dst_cx / 2;
-	const int dst_cy_d2 = dst_cy / 2;
-	const int size = src_cx * src_cy;
+	const size_t samples = nv12_source_size(cx, cy);
 
-	const uint8_t *src_uv = src + size;
+	/* little endian, the high byte holds the top 8 of the 10 bits */
+	for (size_t i = 0; i < samples; i++)
+		dst[i] = src[i * 2 + 1];
+}
 
-	register int uv_flip = 0;
+static void rgba_to_nv12(uint8_t *dst, const uint8_t *src, int cx, int cy)
+{
+	const struct nv12_scale_kernels *k = nv12_scale_get_kernels();
+	const int stride = cx * 4;
+	uint8_t *dst_uv = dst + (size_t)cx * cy;
 
-	for (int y = 0; y < dst_cy; y++) {
-		const int src_line = y * src_cy / dst_cy * s->src_cx;
-		const int src_line_d2 =
-			y / 2 * src_cy_d2 / dst_cy_d2 * s->src_cx;
+	for (int y = 0; y < cy; y += 2) {
+		const uint8_t *a = src + (size_t)y * stride;
+		uint8_t *dst_a = dst + (size_t)y * cx;
 
-		for (int x = 0; x < dst_cx; x++) {
-			const int src_x = x * src_cx / dst_cx;
-			const int src_x_d2 = x / 2 * src_cx_d2 / dst_cx_d2;
-			const int pos = src_line + src_x;
-			const int pos_uv = src_line_d2 + src_x_d2 * 2 + uv_flip;
+		/* an odd last row is paired with itself */
+		const bool last = y + 1 == cy;
 
-			*(dst++) = src[pos];
-			*(dst++) = src_uv[pos_uv];
+		k->rgb32_to_nv12(dst_a, last ? dst_a : dst_a + cx,
+				 dst_uv + (size_t)(y / 2) * cx, a,
+				 last ? a : a + stride, cx, false);
+	}
+}
 
-			uv_flip ^= 1;
-		}
+static inline size_t source_frame_size(enum source_format format, int cx,
+				       int cy)
+{
+	const size_t size = (size_t)cx * cy;
+
+	switch (format) {
+	case SOURCE_FORMAT_YUY2:
+		return size * 2;
+	case SOURCE_FORMAT_P010:
+		return nv12_source_size(cx, cy) * 2;
+	case SOURCE_FORMAT_RGBA:
+		return size * 4;
+	default:
+		return nv12_source_size(cx, cy);
 	}
 }
 
-static void nv12_convert_to_yuy2(nv12_scale_t *s, uint8_t *dst_start,
-				 const uint8_t *src_start)
+/* same size and the source already is what was asked for.  the output's
+ * chroma isn't rounded up, an odd height i420 goes through nv12. */
+static inline bool source_passthrough(const nv12_scale_t *s)
 {
-	const int size = s->src_cx * s->src_cy;
-	const int size_dst_line = s->src_cx * 4;
+	return (s->src_format == SOURCE_FORMAT_I420 &&
+		s->format == TARGET_FORMAT_I420 && !(s->src_cy & 1)) ||
+	       (s->src_format == SOURCE_FORMAT_YUY2 &&
+		s->format == TARGET_FORMAT_YUY2);
+}
 
-	register const uint8_t *src_y = src_start;
-	register const uint8_t *src_uv = src_y + size;
-	register uint8_t *dst = dst_start;
-	register uint8_t *dst_end = dst + size * 2;
+/* returns the source as nv12, NULL if the buffer couldn't be allocated */
+static const uint8_t *source_to_nv12(nv12_scale_t *s, const uint8_t *src)
+{
+	const int cx = s->src_cx;
+	const int cy = s->src_cy;
 
-	while (dst < dst_end) {
-		register uint8_t *dst_line_end = dst + size_dst_line;
-		const uint8_t *src_uv_start = src_uv;
-		while (dst < dst_line_end) {
-			*(dst++) = *(src_y++);
-			*(dst++) = *(src_uv++);
-			*(dst++) = *(src_y++);
-			*(dst++) = *(src_uv++);
-		}
+	const size_t size = nv12_source_size(cx, cy);
 
-		dst_line_end = dst + size_dst_line;
-		src_uv = src_uv_start;
-		while (dst < dst_line_end) {
-			*(dst++) = *(src_y++);
-			*(dst++) = *(src_uv++);
-			*(dst++) = *(src_y++);
-			*(dst++) = *(src_uv++);
-		}
+	if (s->src_nv12_size < size) {
+		uint8_t *buf = realloc(s->src_nv12, size);
+		if (!buf)
+			return NULL;
+
+		s->src_nv12 = buf;
+		s->src_nv12_size = size;
+	}
+
+	switch (s->src_format) {
+	case SOURCE_FORMAT_I420:
+		i420_to_nv12(s->src_nv12, src, cx, cy);
+		break;
+	case SOURCE_FORMAT_YUY2:
+		yuy2_to_nv12(s->src_nv12, src, cx, cy);
+		break;
+	case SOURCE_FORMAT_P010:
+		p010_to_nv12(s->src_nv12, src, cx, cy);
+		break;
+	case SOURCE_FORMAT_RGBA:
+		rgba_to_nv12(s->src_nv12, src, cx, cy);
+		break;
+	default:
+		return src;
 	}
+
+	return s->src_nv12;
+}
+
+/* ------------------------------------------------------------------------- */
+/* threading                                                                 */
+
+/* below this many output pixels the frame is done on the calling thread, the
+ * hand-off would cost more than it saves */
+#define MT_MIN_PIXELS (1280 * 720)
+
+struct scale_job {
+	nv12_scale_t *s;
+	uint8_t *dst;
+	const uint8_t *src;
+};
+
+static void scale_band(void *param, int band, int bands, uint8_t *scratch)
+{
+	struct scale_job *job = param;
+	nv12_scale_t *s = job->s;
+	const int rows = s->dst_cy;
+
+	/* even band edges keep every chroma row inside one band */
+	const int y_begin = (int)((int64_t)rows * band / bands) & ~1;
+	const int y_end = band == bands - 1
+				  ? rows
+				  : (int)((int64_t)rows * (band + 1) / bands) &
+					    ~1;
+
+	if (y_begin >= y_end)
+		return;
+
+	if (s->data)
+		nv12_scale_rows(s, job->dst, job->src, y_begin, y_end, scratch);
+	else
+		nv12_convert_rows(s, job->dst, job->src, y_begin, y_end);
 }
 
+void nv12_scale_set_threads(nv12_scale_t *s, int threads)
+{
+	if (threads == s->threads)
+		return;
+
+	nv12_scale_pool_destroy(s->pool);
+	s->pool = threads > 1 ? nv12_scale_pool_create(threads - 1) : NULL;
+	s->threads = s->pool ? threads : 1;
+}
+
+/* ------------------------------------------------------------------------- */
+
 void nv12_do_scale(nv12_scale_t *s, uint8_t *dst, const uint8_t *src)
 {
-	if (s->src_cx == s->dst_cx && s->src_cy == s->dst_cy) {
-		if (s->format == TARGET_FORMAT_I420)
-			nv12_convert_to_i420(s, dst, src);
-		else if (s->format == TARGET_FORMAT_YUY2)
-			nv12_convert_to_yuy2(s, dst, src);
-		else
-			memcpy(dst, src, s->src_cx * s->src_cy * 3 / 2);
+	const bool same_size = s->src_cx == s->dst_cx &&
+			       s->src_cy == s->dst_cy;
+
+	if (s->src_format != SOURCE_FORMAT_NV12) {
+		if (same_size && source_passthrough(s)) {
+			memcpy(dst, src,
+			       source_frame_size(s->src_format, s->src_cx,
+						 s->src_cy));
+			return;
+		}
+
+		src = source_to_nv12(s, src);
+		if (!src)
+			return;
+	}
+
+	if (!same_size) {
+		/* the format or filter may have been switched since the last
+		 * init */
+		if (!s->data || s->data->format != s->format ||
+		    s->data->filter != s->filter)
+			nv12_scale_init(s, s->format, s->dst_cx, s->dst_cy,
+					s->src_cx, s->src_cy);
+
+		if (!s->data)
+			return;
+	}
+
+	struct scale_job job = {s, dst, src};
+
+	if (s->pool && s->dst_cx * s->dst_cy >= MT_MIN_PIXELS &&
+	    nv12_scale_pool_reserve(s->pool, scratch_size(s))) {
+		nv12_scale_pool_run(s->pool, scale_band, &job);
 	} else {
-		if (s->format == TARGET_FORMAT_I420)
-			nv12_scale_nearest_to_i420(s, dst, src);
-		else if (s->format == TARGET_FORMAT_YUY2)
-			nv12_scale_nearest_to_yuy2(s, dst, src);
-		else
-			nv12_scale_nearest(s, dst, src);
+		scale_band(&job, 0, 1, s->data ? s->data->scratch : NULL);
 	}
 }
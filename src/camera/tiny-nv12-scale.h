@@ -13,20 +13,66 @@ enum target_format {
 	TARGET_FORMAT_YUY2,
 };
 
+/* what the source frames hold, packed planes without row padding.  the
+ * scaler works on nv12 internally, the others are converted first unless
+ * they can be copied as they are. */
+enum source_format {
+	SOURCE_FORMAT_NV12,
+	SOURCE_FORMAT_I420,
+	SOURCE_FORMAT_YUY2,
+	/* 10 bits in the high bits of 16, reduced to 8 */
+	SOURCE_FORMAT_P010,
+	/* full range rgb, converted to bt.601 limited range */
+	SOURCE_FORMAT_RGBA,
+};
+
+enum scale_filter {
+	SCALE_FILTER_NEAREST,
+	SCALE_FILTER_BILINEAR,
+	/* box average when both axes shrink, bilinear otherwise */
+	SCALE_FILTER_AREA,
+};
+
+struct nv12_scale_data;
+struct nv12_scale_pool;
+
 struct nv12_scale {
 	enum target_format format;
+	enum scale_filter filter;
+	/* 0 (nv12) unless set, may be changed between frames */
+	enum source_format src_format;
 
 	int src_cx;
 	int src_cy;
 
 	int dst_cx;
 	int dst_cy;
+
+	/* tables and scratch rows, owned by the scaler */
+	struct nv12_scale_data *data;
+
+	/* the source converted to nv12, for the other source formats */
+	uint8_t *src_nv12;
+	size_t src_nv12_size;
+
+	/* optional workers, see nv12_scale_set_threads */
+	int threads;
+	struct nv12_scale_pool *pool;
 };
 
 typedef struct nv12_scale nv12_scale_t;
 
+/* the scaler must be zero initialized before the first nv12_scale_init, it
+ * can then be re-initialized any number of times and is released with
+ * nv12_scale_free.  format and filter may be changed between frames. */
 extern void nv12_scale_init(nv12_scale_t *s, enum target_format format,
 			    int dst_cx, int dst_cy, int src_cx, int src_cy);
+extern void nv12_scale_free(nv12_scale_t *s);
+
+/* converts frames of 1280x720 and up in horizontal bands on 'threads'
+ * threads, the calling thread included.  0 or 1 keeps everything on the
+ * calling thread.  survives nv12_scale_init. */
+extern void nv12_scale_set_threads(nv12_scale_t *s, int threads);
 extern void nv12_do_scale(nv12_scale_t *s, uint8_t *dst, const uint8_t *src);
 
 #ifdef __cplusplus
@@ -0,0 +1,60 @@
+/* dumps the latency histograms the readers of a camera's queue fill in, from
+ * network receive to the frame being handed downstream, for example
+ *
+ *   virtualcam-latency 0
+ *
+ * the histograms cover everything since the writer started the queue. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "shared-memory-queue.h"
+
+static const char *span_names[QUEUE_LATENCY_SPANS] = {
+	"receive -> decode", "decode -> sink",   "sink -> written",
+	"written -> read",   "read -> delivered", "total",
+};
+
+static double to_ms(uint64_t value)
+{
+	return value / 10000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t index = argc > 1 ? (uint32_t)atoi(argv[1]) : 0;
+
+	if (index >= MAX_QUEUE_INSTANCES) {
+		fprintf(stderr, "usage: %s [index]\n", argv[0]);
+		return 1;
+	}
+
+	video_queue_t *vq = video_queue_open(index);
+	if (!vq) {
+		fprintf(stderr, "camera %u is not running\n", index);
+		return 1;
+	}
+
+	struct latency_histogram spans[QUEUE_LATENCY_SPANS];
+	video_queue_get_latency(vq, spans);
+	video_queue_close(vq);
+
+	printf("%-18s %8s %8s %8s %8s %8s %8s\n", "ms", "frames", "mean",
+	       "p50", "p90", "p99", "max");
+	for (int i = 0; i < QUEUE_LATENCY_SPANS; i++) {
+		const struct latency_histogram *hist = &spans[i];
+		if (!hist->count) {
+			printf("%-18s %8u\n", span_names[i], 0u);
+			continue;
+		}
+
+		printf("%-18s %8u %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+		       span_names[i], hist->count,
+		       to_ms(hist->sum / hist->count),
+		       to_ms(latency_percentile(hist, 0.5)),
+		       to_ms(latency_percentile(hist, 0.9)),
+		       to_ms(latency_percentile(hist, 0.99)),
+		       to_ms(hist->max));
+	}
+
+	return 0;
+}
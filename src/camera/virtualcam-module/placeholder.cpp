@@ -2,144 +2,361 @@
 #include <strsafe.h>
 #include <gdiplus.h>
 #include <stdint.h>
+#include <mutex>
 #include <vector>
 
+#ifdef OBS_LEGACY
+#include "../tiny-nv12-scale.h"
+#include "../tiny-nv12-scale-simd.h"
+#else
+#include <tiny-nv12-scale.h>
+#include <tiny-nv12-scale-simd.h>
+#endif
+
 using namespace Gdiplus;
 
 extern HINSTANCE dll_inst;
 
-static std::vector<uint8_t> placeholder;
+/* the png is converted once and the nv12 frames are kept in placeholder.nv12
+ * next to the dll (or in the temp directory when that isn't writable), later
+ * loads only map the file.  besides the png's own size it holds the sizes
+ * cameras are usually opened at, a filter switching to one of those doesn't
+ * have to scale. */
+
+#define CACHE_FILE L"placeholder.nv12"
+#define CACHE_MAGIC 0x3231564E /* "NV12" */
+#define CACHE_VERSION 1
+#define CACHE_MAX_SIZES 8
+
+static const struct {
+	int cx;
+	int cy;
+} common_sizes[] = {
+	{1920, 1080}, {1280, 720}, {960, 540}, {640, 480}, {640, 360},
+};
+
+struct cache_entry {
+	uint32_t cx;
+	uint32_t cy;
+	uint64_t offset;
+};
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t version;
+
+	/* the png the frames were converted from */
+	uint64_t source_size;
+	uint64_t source_time;
+
+	/* the first entry is the png's own size */
+	uint32_t count;
+	uint32_t reserved;
+	struct cache_entry entries[CACHE_MAX_SIZES];
+};
+
+static std::once_flag load_once;
 static bool initialized = false;
-int cx, cy;
 
-/* XXX: optimize this later.  or don't, it's only called once. */
+/* either a read only view of the cache file, or the cache built in memory
+ * when the file couldn't be written */
+static const struct cache_header *cache = nullptr;
+static std::vector<uint8_t> built;
+
+static inline size_t nv12_size(uint32_t cx, uint32_t cy)
+{
+	return (size_t)cx * cy * 3 / 2;
+}
 
-static void convert_placeholder(const uint8_t *rgb_in, int width, int height)
+/* GDI+ hands out 32-bit rows as b, g, r, x, each pair of them is converted
+ * straight into nv12 */
+static void convert_placeholder(uint8_t *nv12, const uint8_t *bgrx,
+				int stride, int width, int height)
 {
-	size_t size = width * height * 3;
-	size_t linesize = width * 3;
+	const struct nv12_scale_kernels *k = nv12_scale_get_kernels();
+	uint8_t *chroma = nv12 + (size_t)width * height;
 
-	std::vector<uint8_t> yuv_out;
-	yuv_out.resize(size);
+	for (int y = 0; y < height; y += 2) {
+		const uint8_t *row = bgrx + (ptrdiff_t)y * stride;
+		uint8_t *out = nv12 + (size_t)y * width;
 
-	const uint8_t *in = rgb_in;
-	const uint8_t *end = in + size;
-	uint8_t *out = &yuv_out[0];
+		k->rgb32_to_nv12(out, out + width,
+				 chroma + (size_t)(y / 2) * width, row,
+				 row + stride, width, true);
+	}
+}
 
-	while (in < end) {
-		const int16_t b = *(in++);
-		const int16_t g = *(in++);
-		const int16_t r = *(in++);
+static bool get_source_info(const wchar_t *file, uint64_t *size,
+			    uint64_t *time)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if (!GetFileAttributesExW(file, GetFileExInfoStandard, &attr))
+		return false;
+
+	*size = ((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+	*time = ((uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32) |
+		attr.ftLastWriteTime.dwLowDateTime;
+	return true;
+}
 
-		*(out++) = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) +
-				     16);
-		*(out++) = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) +
-				     128);
-		*(out++) = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) +
-				     128);
+static bool cache_valid(const struct cache_header *header, uint64_t file_size,
+			uint64_t source_size, uint64_t source_time)
+{
+	if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+	    header->source_size != source_size ||
+	    header->source_time != source_time || !header->count ||
+	    header->count > CACHE_MAX_SIZES)
+		return false;
+
+	for (uint32_t i = 0; i < header->count; i++) {
+		const struct cache_entry *entry = &header->entries[i];
+		if (entry->offset > file_size ||
+		    nv12_size(entry->cx, entry->cy) >
+			    file_size - entry->offset)
+			return false;
+	}
+
+	return true;
+}
+
+static const struct cache_header *map_cache(const wchar_t *file,
+					    uint64_t source_size,
+					    uint64_t source_time)
+{
+	HANDLE handle = CreateFileW(file, GENERIC_READ, FILE_SHARE_READ,
+				    nullptr, OPEN_EXISTING, 0, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	LARGE_INTEGER size;
+	HANDLE mapping = nullptr;
+	void *view = nullptr;
+
+	if (GetFileSizeEx(handle, &size) &&
+	    (uint64_t)size.QuadPart >= sizeof(struct cache_header))
+		mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0,
+					     0, nullptr);
+	if (mapping)
+		view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+	/* the view keeps the file mapped on its own */
+	if (mapping)
+		CloseHandle(mapping);
+	CloseHandle(handle);
+
+	if (view && !cache_valid((const struct cache_header *)view,
+				 (uint64_t)size.QuadPart, source_size,
+				 source_time)) {
+		UnmapViewOfFile(view);
+		view = nullptr;
 	}
 
-	placeholder.resize(width * height * 3 / 2);
+	return (const struct cache_header *)view;
+}
+
+/* written under a temporary name and moved into place, another process
+ * mapping it at the same time never sees half a file */
+static bool write_cache(const wchar_t *file)
+{
+	wchar_t temp[MAX_PATH];
+	StringCbPrintfW(temp, sizeof(temp), L"%s.%lu", file,
+			GetCurrentProcessId());
 
-	in = &yuv_out[0];
-	end = in + size;
+	HANDLE handle = CreateFileW(temp, GENERIC_WRITE, 0, nullptr,
+				    CREATE_ALWAYS, 0, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
 
-	out = &placeholder[0];
-	uint8_t *chroma = out + width * height;
+	DWORD written = 0;
+	bool ok = WriteFile(handle, built.data(), (DWORD)built.size(),
+			    &written, nullptr) &&
+		  written == built.size();
+	CloseHandle(handle);
+
+	if (ok)
+		ok = !!MoveFileExW(temp, file, MOVEFILE_REPLACE_EXISTING);
+	if (!ok)
+		DeleteFileW(temp);
+	return ok;
+}
 
-	while (in < end) {
-		const uint8_t *in2 = in + linesize;
-		const uint8_t *end2 = in2;
-		uint8_t *out2 = out + width;
+static bool decode_placeholder(const wchar_t *file, std::vector<uint8_t> &nv12,
+			       int *out_cx, int *out_cy)
+{
+	Bitmap bmp(file);
+	if (bmp.GetLastStatus() != Status::Ok) {
+		return false;
+	}
 
-		while (in < end2) {
-			int16_t u;
-			int16_t v;
+	/* nv12 needs even sizes, an odd last row or column is dropped */
+	const int cx = (int)bmp.GetWidth() & ~1;
+	const int cy = (int)bmp.GetHeight() & ~1;
+	if (!cx || !cy) {
+		return false;
+	}
 
-			*(out++) = *(in++);
-			u = *(in++);
-			v = *(in++);
+	BitmapData bmd = {};
+	Rect r(0, 0, cx, cy);
 
-			*(out++) = *(in++);
-			u += *(in++);
-			v += *(in++);
+	Status s = bmp.LockBits(&r, ImageLockModeRead, PixelFormat32bppRGB,
+				&bmd);
+	if (s != Status::Ok) {
+		return false;
+	}
 
-			*(out2++) = *(in2++);
-			u += *(in2++);
-			v += *(in2++);
+	nv12.resize(nv12_size(cx, cy));
+	convert_placeholder(nv12.data(), (const uint8_t *)bmd.Scan0,
+			    bmd.Stride, cx, cy);
 
-			*(out2++) = *(in2++);
-			u += *(in2++);
-			v += *(in2++);
+	bmp.UnlockBits(&bmd);
 
-			*(chroma++) = (uint8_t)(u / 4);
-			*(chroma++) = (uint8_t)(v / 4);
-		}
+	*out_cx = cx;
+	*out_cy = cy;
+	return true;
+}
 
-		in = in2;
-		out = out2;
+/* the png's own size and every common size that differs from it, one after
+ * the other behind the header */
+static void build_cache(const std::vector<uint8_t> &nv12, int cx, int cy,
+			uint64_t source_size, uint64_t source_time)
+{
+	struct cache_header header = {};
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.source_size = source_size;
+	header.source_time = source_time;
+
+	uint64_t offset = sizeof(header);
+	header.entries[header.count++] = {(uint32_t)cx, (uint32_t)cy, offset};
+	offset += nv12.size();
+
+	for (const auto &size : common_sizes) {
+		if (size.cx == cx && size.cy == cy)
+			continue;
+
+		header.entries[header.count++] = {(uint32_t)size.cx,
+						  (uint32_t)size.cy, offset};
+		offset += nv12_size(size.cx, size.cy);
 	}
+
+	built.resize((size_t)offset);
+	memcpy(built.data() + header.entries[0].offset, nv12.data(),
+	       nv12.size());
+
+	nv12_scale_t scaler = {};
+	scaler.filter = SCALE_FILTER_AREA;
+
+	for (uint32_t i = 1; i < header.count; i++) {
+		const struct cache_entry *entry = &header.entries[i];
+		nv12_scale_init(&scaler, TARGET_FORMAT_NV12, (int)entry->cx,
+				(int)entry->cy, cx, cy);
+		nv12_do_scale(&scaler, built.data() + entry->offset,
+			      nv12.data());
+	}
+
+	nv12_scale_free(&scaler);
+	memcpy(built.data(), &header, sizeof(header));
 }
 
 static bool load_placeholder_internal()
 {
-	Status s;
-
-	wchar_t file[MAX_PATH];
-	if (!GetModuleFileNameW(dll_inst, file, MAX_PATH)) {
+	wchar_t dirs[2][MAX_PATH];
+	if (!GetModuleFileNameW(dll_inst, dirs[0], MAX_PATH)) {
 		return false;
 	}
 
-	wchar_t *slash = wcsrchr(file, '\\');
+	wchar_t *slash = wcsrchr(dirs[0], '\\');
 	if (!slash) {
 		return false;
 	}
 
 	slash[1] = 0;
 
+	const int dir_count = GetTempPathW(MAX_PATH, dirs[1]) ? 2 : 1;
+
+	wchar_t file[MAX_PATH];
+	StringCbCopyW(file, sizeof(file), dirs[0]);
 	StringCbCat(file, sizeof(file), L"placeholder.png");
 
-	Bitmap bmp(file);
-	if (bmp.GetLastStatus() != Status::Ok) {
+	uint64_t source_size, source_time;
+	if (!get_source_info(file, &source_size, &source_time)) {
 		return false;
 	}
 
-	cx = bmp.GetWidth();
-	cy = bmp.GetHeight();
+	wchar_t cache_files[2][MAX_PATH];
+	for (int i = 0; i < dir_count; i++) {
+		StringCbCopyW(cache_files[i], sizeof(cache_files[i]), dirs[i]);
+		StringCbCat(cache_files[i], sizeof(cache_files[i]), CACHE_FILE);
 
-	BitmapData bmd = {};
-	Rect r(0, 0, cx, cy);
+		cache = map_cache(cache_files[i], source_size, source_time);
+		if (cache)
+			return true;
+	}
 
-	s = bmp.LockBits(&r, ImageLockModeRead, PixelFormat24bppRGB, &bmd);
-	if (s != Status::Ok) {
+	/* no usable cache, decode the png and leave one for the next time */
+	std::vector<uint8_t> nv12;
+	int cx, cy;
+
+	GdiplusStartupInput si;
+	ULONG_PTR token;
+	GdiplusStartup(&token, &si, nullptr);
+
+	bool decoded = decode_placeholder(file, nv12, &cx, &cy);
+
+	GdiplusShutdown(token);
+
+	if (!decoded) {
 		return false;
 	}
 
-	convert_placeholder((const uint8_t *)bmd.Scan0, cx, cy);
+	build_cache(nv12, cx, cy, source_size, source_time);
+
+	for (int i = 0; i < dir_count; i++) {
+		if (write_cache(cache_files[i])) {
+			cache = map_cache(cache_files[i], source_size,
+					  source_time);
+			break;
+		}
+	}
+
+	if (cache) {
+		built.clear();
+		built.shrink_to_fit();
+	} else {
+		cache = (const struct cache_header *)built.data();
+	}
 
-	bmp.UnlockBits(&bmd);
 	return true;
 }
 
+/* safe to call from any number of filters at once, the first one loads and
+ * the others wait for it */
 bool initialize_placeholder()
 {
-	if (initialized)
-		return true;
+	std::call_once(load_once,
+		       [] { initialized = load_placeholder_internal(); });
+	return initialized;
+}
 
-	GdiplusStartupInput si;
-	ULONG_PTR token;
-	GdiplusStartup(&token, &si, nullptr);
+/* the placeholder in nv12 at cx by cy if the cache has that size */
+const uint8_t *get_placeholder_nv12(int cx, int cy)
+{
+	if (!initialized)
+		return nullptr;
 
-	initialized = load_placeholder_internal();
+	for (uint32_t i = 0; i < cache->count; i++) {
+		const struct cache_entry *entry = &cache->entries[i];
+		if ((int)entry->cx == cx && (int)entry->cy == cy)
+			return (const uint8_t *)cache + entry->offset;
+	}
 
-	GdiplusShutdown(token);
-	return initialized;
+	return nullptr;
 }
 
 const uint8_t *get_placeholder_ptr()
 {
 	if (initialized)
-		return placeholder.data();
+		return (const uint8_t *)cache + cache->entries[0].offset;
 
 	return nullptr;
 }
@@ -147,8 +364,8 @@ const uint8_t *get_placeholder_ptr()
 const bool get_placeholder_size(int *out_cx, int *out_cy)
 {
 	if (initialized) {
-		*out_cx = cx;
-		*out_cy = cy;
+		*out_cx = (int)cache->entries[0].cx;
+		*out_cy = (int)cache->entries[0].cy;
 		return true;
 	}
 
@@ -1,7 +1,44 @@
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <errno.h>
+#include <time.h>
+#endif
 #include <stdbool.h>
+#include <stdlib.h>
 #include "sleepto.h"
 
+/* default spin windows, a high resolution waitable timer or clock_nanosleep
+ * is usually within a few tens of microseconds, a classic waitable timer is
+ * only as good as the system tick */
+#define SPIN_WINDOW_PRECISE 2000ULL
+#define SPIN_WINDOW_COARSE 20000ULL
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+struct sleepto_timer {
+#ifdef _WIN32
+	HANDLE handle;
+#endif
+	uint64_t spin_window;
+	struct sleepto_stats stats;
+};
+
+static inline void cpu_relax(void)
+{
+#if defined(_WIN32)
+	YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+#ifdef _WIN32
+
 static bool have_clockfreq = false;
 static LARGE_INTEGER clock_freq;
 
@@ -28,23 +65,152 @@ uint64_t gettime_100ns(void)
 	return (uint64_t)time_val;
 }
 
-bool sleepto_100ns(uint64_t time_target)
+static bool timer_init(struct sleepto_timer *timer)
+{
+	timer->handle = CreateWaitableTimerExW(
+		NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+		TIMER_ALL_ACCESS);
+	if (timer->handle) {
+		timer->spin_window = SPIN_WINDOW_PRECISE;
+		return true;
+	}
+
+	/* high resolution timers need windows 10 1803 */
+	timer->handle = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+	timer->spin_window = SPIN_WINDOW_COARSE;
+	return timer->handle != NULL;
+}
+
+static void timer_free(struct sleepto_timer *timer)
+{
+	CloseHandle(timer->handle);
+}
+
+static void timer_sleep(struct sleepto_timer *timer, uint64_t now,
+			uint64_t wake)
+{
+	LARGE_INTEGER due;
+	due.QuadPart = -(LONGLONG)(wake - now);
+
+	if (SetWaitableTimer(timer->handle, &due, 0, NULL, NULL, false))
+		WaitForSingleObject(timer->handle, INFINITE);
+}
+
+#else
+
+uint64_t gettime_100ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 10000000ULL + (uint64_t)ts.tv_nsec / 100;
+}
+
+static bool timer_init(struct sleepto_timer *timer)
+{
+	timer->spin_window = SPIN_WINDOW_PRECISE;
+	return true;
+}
+
+static void timer_free(struct sleepto_timer *timer)
+{
+	(void)timer;
+}
+
+static void timer_sleep(struct sleepto_timer *timer, uint64_t now,
+			uint64_t wake)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(wake / 10000000ULL);
+	ts.tv_nsec = (long)(wake % 10000000ULL) * 100;
+
+	(void)timer;
+	(void)now;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+struct sleepto_timer *sleepto_timer_create(void)
+{
+	struct sleepto_timer *timer = calloc(1, sizeof(*timer));
+	if (!timer)
+		return NULL;
+
+	if (!timer_init(timer)) {
+		free(timer);
+		return NULL;
+	}
+
+	return timer;
+}
+
+void sleepto_timer_destroy(struct sleepto_timer *timer)
+{
+	if (!timer)
+		return;
+
+	timer_free(timer);
+	free(timer);
+}
+
+void sleepto_timer_set_spin_window(struct sleepto_timer *timer,
+				   uint64_t window_100ns)
+{
+	timer->spin_window = window_100ns;
+}
+
+bool sleepto_timer_wait(struct sleepto_timer *timer, uint64_t time_target)
 {
+	struct sleepto_stats *stats = &timer->stats;
 	uint64_t t = gettime_100ns();
-	uint32_t milliseconds;
 
 	if (t >= time_target)
 		return false;
 
-	milliseconds = (uint32_t)((time_target - t) / 10000);
-	if (milliseconds > 1)
-		Sleep(milliseconds - 1);
+	stats->sleeps++;
+
+	if (time_target - t > timer->spin_window) {
+		uint64_t wake = time_target - timer->spin_window;
+		timer_sleep(timer, t, wake);
 
-	for (;;) {
 		t = gettime_100ns();
-		if (t >= time_target)
-			return true;
+		uint64_t error = t > wake ? t - wake : wake - t;
+		stats->wake_error_total += error;
+		if (error > stats->wake_error_max)
+			stats->wake_error_max = error;
+	}
 
-		Sleep(0);
+	uint64_t spin_start = t;
+	while (t < time_target) {
+		cpu_relax();
+		t = gettime_100ns();
 	}
+
+	stats->spin_total += t - spin_start;
+	if (t - time_target > stats->late_max)
+		stats->late_max = t - time_target;
+	return true;
+}
+
+void sleepto_timer_get_stats(struct sleepto_timer *timer,
+			     struct sleepto_stats *stats)
+{
+	*stats = timer->stats;
+}
+
+/* ------------------------------------------------------------------------- */
+
+bool sleepto_100ns(uint64_t time_target)
+{
+	struct sleepto_timer *timer = sleepto_timer_create();
+	if (!timer)
+		return false;
+
+	bool ret = sleepto_timer_wait(timer, time_target);
+	sleepto_timer_destroy(timer);
+	return ret;
 }
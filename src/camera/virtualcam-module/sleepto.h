@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -9,6 +10,33 @@ extern "C" {
 extern uint64_t gettime_100ns(void);
 extern bool sleepto_100ns(uint64_t time_target);
 
+/* precise pacing for one thread: sleeps on a high resolution timer until
+ * 'spin window' before the target and only spins for the rest */
+struct sleepto_timer;
+
+struct sleepto_stats {
+	uint64_t sleeps;
+
+	/* how far the os timer woke us from where we asked it to, in 100ns
+	 * units, summed for the average and the worst case */
+	uint64_t wake_error_total;
+	uint64_t wake_error_max;
+
+	/* time spent spinning and how late the target was still missed */
+	uint64_t spin_total;
+	uint64_t late_max;
+};
+
+extern struct sleepto_timer *sleepto_timer_create(void);
+extern void sleepto_timer_destroy(struct sleepto_timer *timer);
+
+extern void sleepto_timer_set_spin_window(struct sleepto_timer *timer,
+					  uint64_t window_100ns);
+extern bool sleepto_timer_wait(struct sleepto_timer *timer,
+			       uint64_t time_target);
+extern void sleepto_timer_get_stats(struct sleepto_timer *timer,
+				    struct sleepto_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
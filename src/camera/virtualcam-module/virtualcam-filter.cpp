@@ -4,25 +4,85 @@
 #include <shlobj_core.h>
 #include <strsafe.h>
 #include <inttypes.h>
+#include <stdlib.h>
 
 using namespace DShow;
 
 extern bool initialize_placeholder();
 extern const uint8_t *get_placeholder_ptr();
 extern const bool get_placeholder_size(int *out_cx, int *out_cy);
+extern const uint8_t *get_placeholder_nv12(int cx, int cy);
 extern volatile long locks;
 
 /* ========================================================================= */
 
-VCamFilter::VCamFilter() : OutputFilter()
+/* VIRTUALCAM_SCALE_THREADS overrides the number of scaler threads, by default
+ * half the logical processors are used, capped at 4 so a host app that does
+ * its own encoding isn't starved */
+#define MAX_SCALE_THREADS 4
+
+static int get_scale_threads()
+{
+	char value[16];
+	DWORD len = GetEnvironmentVariableA("VIRTUALCAM_SCALE_THREADS", value,
+					    sizeof(value));
+	if (len > 0 && len < sizeof(value))
+		return atoi(value);
+
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+
+	int threads = (int)info.dwNumberOfProcessors / 2;
+	return threads < MAX_SCALE_THREADS ? threads : MAX_SCALE_THREADS;
+}
+
+/* VIRTUALCAM_SPIN_US overrides how long before a frame is due the thread
+ * stops sleeping and spins, -1 if not set */
+static int64_t get_spin_window()
+{
+	char value[16];
+	DWORD len = GetEnvironmentVariableA("VIRTUALCAM_SPIN_US", value,
+					    sizeof(value));
+	if (len == 0 || len >= sizeof(value))
+		return -1;
+
+	return (int64_t)atoi(value) * 10;
+}
+
+/* VIRTUALCAM_LOW_LATENCY=1 hands frames out as soon as the writer publishes
+ * them instead of on a fixed schedule */
+static bool get_low_latency()
+{
+	char value[16];
+	DWORD len = GetEnvironmentVariableA("VIRTUALCAM_LOW_LATENCY", value,
+					    sizeof(value));
+	return len > 0 && len < sizeof(value) && atoi(value) != 0;
+}
+
+/* VIRTUALCAM_SYNC_DELAY_MS shows frames this much later than they can arrive
+ * at the earliest, the queue then has time to absorb delivery jitter and
+ * frames go out at the spacing of their timestamps */
+static uint64_t get_sync_delay()
+{
+	char value[16];
+	DWORD len = GetEnvironmentVariableA("VIRTUALCAM_SYNC_DELAY_MS", value,
+					    sizeof(value));
+	if (len == 0 || len >= sizeof(value))
+		return 0;
+
+	return (uint64_t)atoi(value) * 10000;
+}
+
+/* ========================================================================= */
+
+VCamFilter::VCamFilter(uint32_t instance_)
+	: OutputFilter(), instance(instance_)
 {
 	thread_start = CreateEvent(nullptr, true, false, nullptr);
 	thread_stop = CreateEvent(nullptr, true, false, nullptr);
 
 	format = VideoFormat::NV12;
 
-	placeholder.scaled_data = nullptr;
-
 	/* ---------------------------------------- */
 	/* detect if this filter is within obs      */
 
@@ -46,7 +106,7 @@ VCamFilter::VCamFilter() : OutputFilter()
 	uint32_t new_obs_cy = obs_cy;
 	uint64_t new_obs_interval = obs_interval;
 
-	vq = video_queue_open();
+	vq = video_queue_open(instance);
 	if (vq) {
 		if (video_queue_state(vq) == SHARED_QUEUE_STATE_READY) {
 			video_queue_get_info(vq, &new_obs_cx, &new_obs_cy,
@@ -60,8 +120,15 @@ VCamFilter::VCamFilter() : OutputFilter()
 		wchar_t res_file[MAX_PATH];
 		SHGetFolderPathW(nullptr, CSIDL_APPDATA, nullptr,
 				 SHGFP_TYPE_CURRENT, res_file);
-		StringCbCat(res_file, sizeof(res_file),
-			    L"\\obs-virtualcam.txt");
+		wchar_t res_name[64];
+		if (instance)
+			StringCbPrintfW(res_name, sizeof(res_name),
+					L"\\obs-virtualcam%u.txt",
+					instance + 1);
+		else
+			StringCbCopyW(res_name, sizeof(res_name),
+				      L"\\obs-virtualcam.txt");
+		StringCbCat(res_file, sizeof(res_file), res_name);
 
 		HANDLE file = CreateFileW(res_file, GENERIC_READ, 0, nullptr,
 					  OPEN_EXISTING, 0, nullptr);
@@ -117,10 +184,23 @@ VCamFilter::~VCamFilter()
 	SetEvent(thread_stop);
 	if (th.joinable())
 		th.join();
-	video_queue_close(vq);
+	CloseQueue();
+
+	if (placeholder.hits || placeholder.misses) {
+		wchar_t msg[128];
+		StringCbPrintfW(msg, sizeof(msg),
+				L"virtualcam: placeholder, %" PRIu32
+				L" renditions reused, %" PRIu32 L" scaled\n",
+				placeholder.hits, placeholder.misses);
+		OutputDebugStringW(msg);
+	}
 
-	if (placeholder.scaled_data)
-		free(placeholder.scaled_data);
+	for (placeholder_slot_t &slot : placeholder.slots)
+		free(slot.data);
+
+	nv12_scale_free(&scaler);
+	nv12_scale_free(&rendition_scaler);
+	nv12_scale_free(&placeholder.scaler);
 
 	os_atomic_dec_long(&locks);
 }
@@ -171,6 +251,10 @@ inline uint64_t VCamFilter::GetTime()
 
 void VCamFilter::Thread()
 {
+	/* load the placeholder while the graph is still being built, GDI+ and
+	   the conversion then never hold up the first frames */
+	bool have_placeholder = initialize_placeholder();
+
 	HANDLE h[2] = {thread_start, thread_stop};
 	DWORD ret = WaitForMultipleObjects(2, h, false, INFINITE);
 	if (ret != WAIT_OBJECT_0)
@@ -188,15 +272,21 @@ void VCamFilter::Thread()
 	/* ---------------------------------------- */
 	/* load placeholder image                   */
 
-	if (initialize_placeholder()) {
+	if (have_placeholder) {
 		placeholder.source_data = get_placeholder_ptr();
 		get_placeholder_size(&placeholder.cx, &placeholder.cy);
 	} else {
 		placeholder.source_data = nullptr;
 	}
 
-	/* Created dynamically based on output resolution changes */
-	placeholder.scaled_data = nullptr;
+	/* Filter once here rather than with a videoscale element on the
+	   sending side, area averaging falls back to bilinear when
+	   upscaling */
+	scaler.filter = SCALE_FILTER_AREA;
+	placeholder.scaler.filter = SCALE_FILTER_AREA;
+
+	/* only the main scaler, the placeholder is scaled once per resolution */
+	nv12_scale_set_threads(&scaler, get_scale_threads());
 
 	nv12_scale_init(&scaler, TARGET_FORMAT_NV12, obs_cx, obs_cy, obs_cx,
 			obs_cy);
@@ -205,11 +295,98 @@ void VCamFilter::Thread()
 
 	UpdatePlaceholder();
 
+	low_latency = get_low_latency();
+	sync_delay = get_sync_delay();
+	queue_clock_init(&ref_clock);
+
+	struct sleepto_timer *timer = sleepto_timer_create();
+	int64_t spin_window = get_spin_window();
+	if (timer && spin_window >= 0)
+		sleepto_timer_set_spin_window(timer, (uint64_t)spin_window);
+
 	while (!stopped()) {
-		if (os_atomic_load_bool(&active))
+		bool running = os_atomic_load_bool(&active);
+		if (running)
 			Frame(filter_time);
-		sleepto_100ns(cur_time += obs_interval);
-		filter_time += obs_interval;
+
+		/* only a running filter reads, and reading is what moves the
+		   queue's wake mark; a stopped one would find every wait over
+		   at once as soon as the writer publishes */
+		if (low_latency && running && vq &&
+		    prev_state == SHARED_QUEUE_STATE_READY) {
+			/* wake when the next frame lands, if the writer
+			   stalls repeat the last one after an interval and
+			   a half like the fixed schedule would */
+			uint64_t timeout = obs_interval + obs_interval / 2;
+			video_queue_wait(rq ? rq : vq,
+					 (uint32_t)(timeout / 10000));
+
+			uint64_t now = gettime_100ns();
+			filter_time += now - cur_time;
+			cur_time = now;
+		} else {
+			cur_time += obs_interval;
+			if (timer)
+				sleepto_timer_wait(timer, cur_time);
+			else
+				sleepto_100ns(cur_time);
+			filter_time += obs_interval;
+		}
+	}
+
+	if (timer) {
+		struct sleepto_stats stats;
+		sleepto_timer_get_stats(timer, &stats);
+
+		if (stats.sleeps) {
+			wchar_t msg[256];
+			StringCbPrintfW(
+				msg, sizeof(msg),
+				L"virtualcam: %" PRIu64 L" frame waits, "
+				L"wake error avg %" PRIu64 L"us max %" PRIu64
+				L"us, spin avg %" PRIu64 L"us, late max %" PRIu64
+				L"us\n",
+				stats.sleeps,
+				stats.wake_error_total / stats.sleeps / 10,
+				stats.wake_error_max / 10,
+				stats.spin_total / stats.sleeps / 10,
+				stats.late_max / 10);
+			OutputDebugStringW(msg);
+		}
+
+		sleepto_timer_destroy(timer);
+	}
+
+	/* shared by every reader of the queue, virtualcam-latency dumps the
+	   same histograms per stage while the camera runs */
+	if (vq) {
+		struct latency_histogram spans[QUEUE_LATENCY_SPANS];
+		video_queue_get_latency(vq, spans);
+
+		const struct latency_histogram *total =
+			&spans[QUEUE_LATENCY_TOTAL];
+		if (total->count) {
+			wchar_t msg[256];
+			StringCbPrintfW(
+				msg, sizeof(msg),
+				L"virtualcam: %u frames, latency p50 %" PRIu64
+				L"us p99 %" PRIu64 L"us max %uus\n",
+				total->count,
+				latency_percentile(total, 0.5) / 10,
+				latency_percentile(total, 0.99) / 10,
+				total->max / 10);
+			OutputDebugStringW(msg);
+		}
+	}
+
+	int64_t drift = queue_clock_drift(&ref_clock);
+	if (drift) {
+		wchar_t msg[128];
+		StringCbPrintfW(msg, sizeof(msg),
+				L"virtualcam: reference clock drift %" PRId64
+				L" ppb\n",
+				drift);
+		OutputDebugStringW(msg);
 	}
 }
 
@@ -225,7 +402,12 @@ void VCamFilter::Frame(uint64_t ts)
 	   filter output! */
 
 	if (!vq) {
-		vq = video_queue_open();
+		vq = video_queue_open(instance);
+
+		/* other apps showing the camera at the same format and size
+		   reuse each other's conversions */
+		if (vq)
+			video_queue_share_renditions(vq, true);
 	}
 
 	enum queue_state state = video_queue_state(vq);
@@ -236,8 +418,7 @@ void VCamFilter::Frame(uint64_t ts)
 			video_queue_get_info(vq, &new_obs_cx, &new_obs_cy,
 					     &new_obs_interval);
 		} else if (state == SHARED_QUEUE_STATE_STOPPING) {
-			video_queue_close(vq);
-			vq = nullptr;
+			CloseQueue();
 		}
 
 		prev_state = state;
@@ -316,58 +497,189 @@ void VCamFilter::Frame(uint64_t ts)
 	uint8_t *ptr;
 	if (LockSampleData(&ptr)) {
 		if (state == SHARED_QUEUE_STATE_READY)
-			ShowOBSFrame(ptr);
+			ShowOBSFrame(ptr, ts);
 		else
 			ShowDefaultFrame(ptr);
 
 		UnlockSampleData(ts, ts + obs_interval);
+
+		/* the frame is downstream now, which completes its trace */
+		struct queue_trace trace;
+		if (vq && frame_queue &&
+		    video_queue_get_trace(frame_queue, &trace)) {
+			trace.stamp[QUEUE_TRACE_DELIVERED] = queue_clock_now();
+			video_queue_record_trace(vq, &trace);
+		}
+	}
+}
+
+/* The writer's own rendition when it publishes one in exactly the output
+   format and size, the camera's queue otherwise */
+video_queue_t *VCamFilter::SourceQueue(nv12_scale_t **scale)
+{
+	int match = video_queue_find_rendition(vq, &scaler);
+	if (match != rendition || (match >= 0 && !rq)) {
+		video_queue_close(rq);
+		rq = match >= 0 ? video_queue_open_rendition(instance,
+							     (uint32_t)match)
+				: nullptr;
+		rendition = match;
 	}
+
+	if (!rq || video_queue_state(rq) != SHARED_QUEUE_STATE_READY) {
+		*scale = &scaler;
+		return vq;
+	}
+
+	if (rendition_scaler.format != scaler.format ||
+	    rendition_scaler.dst_cx != scaler.dst_cx ||
+	    rendition_scaler.dst_cy != scaler.dst_cy)
+		nv12_scale_init(&rendition_scaler, scaler.format,
+				scaler.dst_cx, scaler.dst_cy, scaler.dst_cx,
+				scaler.dst_cy);
+
+	*scale = &rendition_scaler;
+	return rq;
+}
+
+void VCamFilter::CloseQueue()
+{
+	video_queue_close(rq);
+	rq = nullptr;
+	rendition = -1;
+
+	video_queue_close(vq);
+	vq = nullptr;
+	frame_queue = nullptr;
 }
 
-void VCamFilter::ShowOBSFrame(uint8_t *ptr)
+void VCamFilter::ShowOBSFrame(uint8_t *ptr, uint64_t ts)
 {
+	bool read;
 	uint64_t temp;
-	if (!video_queue_read(vq, &scaler, ptr, &temp)) {
-		video_queue_close(vq);
-		vq = nullptr;
+	nv12_scale_t *scale;
+	video_queue_t *src = SourceQueue(&scale);
+
+	if (low_latency) {
+		/* woken by the frame itself, it is always the one to show */
+		read = video_queue_read(src, scale, ptr, &temp);
+	} else {
+		/* the graph clock may be an audio device running at its own
+		   rate, follow it against the queue's clock */
+		queue_clock_update(&ref_clock, GetTime(), queue_clock_now());
+		uint64_t target = queue_clock_map(&ref_clock, ts) - sync_delay;
+		read = video_queue_read_at(src, scale, ptr, target, &temp);
+	}
+	frame_queue = src;
+
+	if (!read) {
+		uint64_t retried, shown;
+		video_queue_get_torn_frames(src, &retried, &shown);
+		if (retried || shown) {
+			wchar_t msg[128];
+			StringCbPrintfW(msg, sizeof(msg),
+					L"virtualcam: torn frames, %" PRIu64
+					L" re-read, %" PRIu64 L" shown\n",
+					retried, shown);
+			OutputDebugStringW(msg);
+		}
+
+		CloseQueue();
 	}
 }
 
 void VCamFilter::ShowDefaultFrame(uint8_t *ptr)
 {
-	if (placeholder.scaled_data) {
-		memcpy(ptr, placeholder.scaled_data, GetOutputBufferSize());
+	if (placeholder.frame) {
+		memcpy(ptr, placeholder.frame, GetOutputBufferSize());
 	} else {
 		memset(ptr, 127, GetOutputBufferSize());
 	}
 }
 
-/* Called when the output resolution or format has changed to re-scale
-   the placeholder graphic into the placeholder.scaled_data buffer. */
+/* the slot holding format at cx by cy, otherwise an empty one or the least
+   recently used one to scale into */
+static placeholder_slot_t *find_placeholder_slot(placeholder_t *p,
+						 enum target_format format,
+						 int cx, int cy, bool *hit)
+{
+	placeholder_slot_t *victim = &p->slots[0];
+
+	for (placeholder_slot_t &slot : p->slots) {
+		if (slot.data && slot.format == format && slot.cx == cx &&
+		    slot.cy == cy) {
+			victim = &slot;
+			break;
+		}
+
+		if (!victim->data)
+			continue;
+		if (!slot.data || slot.last_use < victim->last_use)
+			victim = &slot;
+	}
+
+	*hit = victim->data && victim->format == format && victim->cx == cx &&
+	       victim->cy == cy;
+	victim->last_use = ++p->uses;
+	return victim;
+}
+
+/* Called when the output resolution or format has changed to point
+   placeholder.frame at the placeholder graphic in the new format.  Sizes
+   the cache file holds in NV12 are shown straight from it, anything else
+   is scaled once into a slot and reused when the client comes back to it. */
 void VCamFilter::UpdatePlaceholder(void)
 {
+	placeholder.frame = nullptr;
+
 	if (!placeholder.source_data)
 		return;
 
-	if (placeholder.scaled_data)
-		free(placeholder.scaled_data);
+	const enum target_format target = placeholder.scaler.format;
+	const uint8_t *cached = get_placeholder_nv12(GetCX(), GetCY());
+	if (cached && target == TARGET_FORMAT_NV12) {
+		placeholder.frame = cached;
+		placeholder.hits++;
+		return;
+	}
 
-	placeholder.scaled_data = (uint8_t *)malloc(GetOutputBufferSize());
-	if (!placeholder.scaled_data)
+	bool hit;
+	placeholder_slot_t *slot = find_placeholder_slot(
+		&placeholder, target, GetCX(), GetCY(), &hit);
+	if (hit) {
+		placeholder.frame = slot->data;
+		placeholder.hits++;
 		return;
+	}
 
-	if (placeholder.cx == GetCX() && placeholder.cy == GetCY() &&
-	    placeholder.scaler.format == TARGET_FORMAT_NV12) {
-		/* No scaling necessary if it matches exactly */
-		memcpy(placeholder.scaled_data, placeholder.source_data,
-		       GetOutputBufferSize());
+	placeholder.misses++;
+
+	/* the slot keeps its buffer when the new rendition fits */
+	const size_t size = (size_t)GetOutputBufferSize();
+	if (slot->size < size) {
+		free(slot->data);
+		slot->data = (uint8_t *)malloc(size);
+		slot->size = slot->data ? size : 0;
+		if (!slot->data)
+			return;
+	}
+
+	slot->format = target;
+	slot->cx = GetCX();
+	slot->cy = GetCY();
+
+	if (cached) {
+		nv12_scale_init(&placeholder.scaler, target, GetCX(), GetCY(),
+				GetCX(), GetCY());
+		nv12_do_scale(&placeholder.scaler, slot->data, cached);
 	} else {
-		nv12_scale_init(&placeholder.scaler, placeholder.scaler.format,
-				GetCX(), GetCY(), placeholder.cx,
-				placeholder.cy);
-		nv12_do_scale(&placeholder.scaler, placeholder.scaled_data,
+		nv12_scale_init(&placeholder.scaler, target, GetCX(), GetCY(),
+				placeholder.cx, placeholder.cy);
+		nv12_do_scale(&placeholder.scaler, slot->data,
 			      placeholder.source_data);
 	}
+
+	placeholder.frame = slot->data;
 }
 
 /* Calculate the size of the output buffer based on the filter's
@@ -20,22 +20,44 @@
 #include <util/threading-windows.h>
 #endif
 
+/* placeholder renditions a filter keeps across renegotiations, clients
+   probing formats switch back and forth between a handful of them.  once
+   all are taken the least recently used one is overwritten. */
+#define PLACEHOLDER_SLOTS 4
+
+typedef struct {
+	enum target_format format;
+	int cx;
+	int cy;
+	uint8_t *data;
+	size_t size;
+	uint64_t last_use;
+} placeholder_slot_t;
+
 typedef struct {
 	int cx;
 	int cy;
 	nv12_scale_t scaler;
 	const uint8_t *source_data;
-	uint8_t *scaled_data;
+	placeholder_slot_t slots[PLACEHOLDER_SLOTS];
+	uint64_t uses;
+	/* renditions found in a slot or the mapped cache, and ones that had
+	   to be scaled */
+	uint32_t hits;
+	uint32_t misses;
+	/* what is shown, a slot or a frame of the mapped cache */
+	const uint8_t *frame;
 } placeholder_t;
 
 class VCamFilter : public DShow::OutputFilter {
 	std::thread th;
 
+	uint32_t instance = 0;
 	video_queue_t *vq = nullptr;
 	int queue_mode = 0;
 	bool in_obs = false;
 	enum queue_state prev_state = SHARED_QUEUE_STATE_INVALID;
-	placeholder_t placeholder;
+	placeholder_t placeholder = {};
 	uint32_t obs_cx = 0;
 	uint32_t obs_cy = 0;
 	uint64_t obs_interval = 0;
@@ -48,6 +70,21 @@ class VCamFilter : public DShow::OutputFilter {
 
 	nv12_scale_t scaler = {};
 
+	/* the writer's rendition in exactly the output format and size, if
+	   it publishes one, read with a scaler that only copies */
+	video_queue_t *rq = nullptr;
+	int rendition = -1;
+	nv12_scale_t rendition_scaler = {};
+
+	/* where the frame being shown came from, its trace is taken there */
+	video_queue_t *frame_queue = nullptr;
+
+	/* maps the graph's reference clock onto the queue's, frames are picked
+	   by presentation time in that domain */
+	struct queue_clock ref_clock = {};
+	uint64_t sync_delay = 0;
+	bool low_latency = false;
+
 	inline bool stopped() const
 	{
 		return WaitForSingleObject(thread_stop, 0) != WAIT_TIMEOUT;
@@ -57,7 +94,9 @@ class VCamFilter : public DShow::OutputFilter {
 
 	void Thread();
 	void Frame(uint64_t ts);
-	void ShowOBSFrame(uint8_t *ptr);
+	video_queue_t *SourceQueue(nv12_scale_t **scale);
+	void CloseQueue();
+	void ShowOBSFrame(uint8_t *ptr, uint64_t ts);
 	void ShowDefaultFrame(uint8_t *ptr);
 	void UpdatePlaceholder(void);
 	const int GetOutputBufferSize(void);
@@ -66,7 +105,7 @@ protected:
 	const wchar_t *FilterName() const override;
 
 public:
-	VCamFilter();
+	VCamFilter(uint32_t instance);
 	~VCamFilter() override;
 
 	STDMETHODIMP Pause() override;
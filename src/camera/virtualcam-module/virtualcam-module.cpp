@@ -5,6 +5,34 @@
 
 /* ========================================================================= */
 
+/* every queue instance is its own camera: the first one keeps the configured
+ * GUID and name, the others count up from it */
+static CLSID GetInstanceCLSID(uint32_t index) {
+  CLSID cls = CLSID_OBS_VirtualVideo;
+  cls.Data1 += index;
+  return cls;
+}
+
+static bool GetInstanceIndex(REFCLSID cls, uint32_t* index) {
+  for (uint32_t i = 0; i < MAX_QUEUE_INSTANCES; i++) {
+    if (IsEqualCLSID(cls, GetInstanceCLSID(i))) {
+      *index = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void GetInstanceName(uint32_t index, wchar_t* name, size_t size) {
+  if (index) {
+    StringCbPrintfW(name, size, L"%s %u", CAMERA_NAME, index + 1);
+  } else {
+    StringCbCopyW(name, size, CAMERA_NAME);
+  }
+}
+
+/* ========================================================================= */
+
 static const REGPINTYPES AMSMediaTypesV = {&MEDIATYPE_Video,
                                            &MEDIASUBTYPE_NV12};
 
@@ -77,8 +105,9 @@ STDMETHODIMP VCamFactory::CreateInstance(LPUNKNOWN parent,
     return E_NOINTERFACE;
   }
 
-  if (IsEqualCLSID(cls, CLSID_OBS_VirtualVideo)) {
-    *p_ptr = (void*)new VCamFilter();
+  uint32_t index;
+  if (GetInstanceIndex(cls, &index)) {
+    *p_ptr = (void*)new VCamFilter(index);
     return S_OK;
   }
 
@@ -160,11 +189,20 @@ static bool RegServers(bool reg) {
     return false;
   }
 
-  if (reg) {
-    return RegServer(CLSID_OBS_VirtualVideo, CAMERA_NAME, file);
-  } else {
-    return UnregServer(CLSID_OBS_VirtualVideo);
+  bool success = true;
+
+  for (uint32_t i = 0; i < MAX_QUEUE_INSTANCES; i++) {
+    wchar_t name[128];
+    GetInstanceName(i, name, sizeof(name));
+
+    if (reg) {
+      success = RegServer(GetInstanceCLSID(i), name, file) && success;
+    } else {
+      success = UnregServer(GetInstanceCLSID(i)) && success;
+    }
   }
+
+  return success;
 }
 
 static bool RegFilters(bool reg) {
@@ -177,28 +215,35 @@ static bool RegFilters(bool reg) {
     return false;
   }
 
-  if (reg) {
-    ComPtr<IMoniker> moniker;
-    REGFILTER2 rf2;
-    rf2.dwVersion = 1;
-    rf2.dwMerit = MERIT_DO_NOT_USE;
-    rf2.cPins = 1;
-    rf2.rgPins = &AMSPinVideo;
-
-    hr = fm->RegisterFilter(CLSID_OBS_VirtualVideo, CAMERA_NAME, &moniker,
-                            &CLSID_VideoInputDeviceCategory, nullptr, &rf2);
-    if (FAILED(hr)) {
-      return false;
-    }
-  } else {
-    hr = fm->UnregisterFilter(&CLSID_VideoInputDeviceCategory, 0,
-                              CLSID_OBS_VirtualVideo);
-    if (FAILED(hr)) {
-      return false;
+  bool success = true;
+
+  for (uint32_t i = 0; i < MAX_QUEUE_INSTANCES; i++) {
+    if (reg) {
+      wchar_t name[128];
+      GetInstanceName(i, name, sizeof(name));
+
+      ComPtr<IMoniker> moniker;
+      REGFILTER2 rf2;
+      rf2.dwVersion = 1;
+      rf2.dwMerit = MERIT_DO_NOT_USE;
+      rf2.cPins = 1;
+      rf2.rgPins = &AMSPinVideo;
+
+      hr = fm->RegisterFilter(GetInstanceCLSID(i), name, &moniker,
+                              &CLSID_VideoInputDeviceCategory, nullptr, &rf2);
+      if (FAILED(hr)) {
+        return false;
+      }
+    } else {
+      hr = fm->UnregisterFilter(&CLSID_VideoInputDeviceCategory, 0,
+                                GetInstanceCLSID(i));
+      if (FAILED(hr)) {
+        success = false;
+      }
     }
   }
 
-  return true;
+  return success;
 }
 
 /* ========================================================================= */
@@ -252,7 +297,8 @@ STDAPI DllGetClassObject(REFCLSID cls, REFIID riid, void** p_ptr) {
   if (riid != IID_IClassFactory && riid != IID_IUnknown) {
     return E_NOINTERFACE;
   }
-  if (!IsEqualCLSID(cls, CLSID_OBS_VirtualVideo)) {
+  uint32_t index;
+  if (!GetInstanceIndex(cls, &index)) {
     return E_INVALIDARG;
   }
 
@@ -0,0 +1,98 @@
+#pragma once
+
+// The handful of libobs util calls virtualcam.c makes, for platforms the util
+// library isn't built on. Same names and behavior, so the camera code itself
+// doesn't change.
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_ERROR 100
+#define LOG_WARNING 200
+#define LOG_INFO 300
+#define LOG_DEBUG 400
+
+#define UNUSED_PARAMETER(param) (void)param
+
+static inline void* bzalloc(size_t size) {
+  return calloc(1, size);
+}
+
+static inline void bfree(void* ptr) {
+  free(ptr);
+}
+
+static inline void blog(int level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(level <= LOG_WARNING ? stderr : stdout, format, args);
+  va_end(args);
+  fputc('\n', level <= LOG_WARNING ? stderr : stdout);
+}
+
+static inline void os_atomic_set_bool(volatile bool* ptr, bool val) {
+  __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+static inline bool os_atomic_load_bool(const volatile bool* ptr) {
+  return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+// $XDG_CONFIG_HOME/name, or ~/.config/name
+static inline char* os_get_config_path_ptr(const char* name) {
+  const char* base = getenv("XDG_CONFIG_HOME");
+  const char* suffix = "";
+  if (base == NULL || *base == '\0') {
+    base = getenv("HOME");
+    suffix = "/.config";
+  }
+  if (base == NULL) {
+    base = ".";
+    suffix = "";
+  }
+
+  size_t size = strlen(base) + strlen(suffix) + strlen(name) + 2;
+  char* path = (char*)malloc(size);
+  if (path != NULL) {
+    snprintf(path, size, "%s%s/%s", base, suffix, name);
+  }
+  return path;
+}
+
+// Written next to the target and renamed over it, a reader never sees half
+// a file. No marker or backup is kept.
+static inline bool os_quick_write_utf8_file_safe(const char* path,
+                                                 const char* str, size_t len,
+                                                 bool marker,
+                                                 const char* temp_ext,
+                                                 const char* backup_ext) {
+  UNUSED_PARAMETER(marker);
+  UNUSED_PARAMETER(backup_ext);
+
+  if (path == NULL) {
+    return false;
+  }
+
+  size_t size = strlen(path) + strlen(temp_ext) + 2;
+  char* temp = (char*)malloc(size);
+  if (temp == NULL) {
+    return false;
+  }
+  snprintf(temp, size, "%s.%s", path, temp_ext);
+
+  FILE* file = fopen(temp, "wb");
+  bool ok = file != NULL && fwrite(str, 1, len, file) == len;
+  if (file != NULL && fclose(file) != 0) {
+    ok = false;
+  }
+  ok = ok && rename(temp, path) == 0;
+  if (!ok) {
+    remove(temp);
+  }
+
+  free(temp);
+  return ok;
+}
@@ -0,0 +1,107 @@
+/* prints live frame rates and timings of a camera's queue once a second,
+ * without registering as one of its readers, for example
+ *
+ *   virtualcam-stats 0
+ *
+ * reader columns are summed over every reader of the camera. */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "shared-memory-queue.h"
+
+static volatile sig_atomic_t exiting;
+
+static void on_signal(int signum)
+{
+	(void)signum;
+	exiting = 1;
+}
+
+static double per_sec(uint64_t cur, uint64_t prev, double seconds)
+{
+	return (double)(cur - prev) / seconds;
+}
+
+/* average in ms of 'time' (100ns units) over 'count' */
+static double avg_ms(uint64_t time, uint64_t count)
+{
+	return count ? (double)time / (double)count / 10000.0 : 0.0;
+}
+
+static void print_header(void)
+{
+	printf("%9s %8s %8s %6s %6s %6s %6s %7s %8s %8s\n", "written/s",
+	       "read/s", "shared/s", "dup/s", "over/s", "torn/s", "drop/s",
+	       "readers", "copy ms", "scale ms");
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t index = argc > 1 ? (uint32_t)atoi(argv[1]) : 0;
+	uint32_t interval_ms = argc > 2 ? (uint32_t)atoi(argv[2]) : 1000;
+
+	if (index >= MAX_QUEUE_INSTANCES || !interval_ms) {
+		fprintf(stderr, "usage: %s [index] [interval ms]\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	video_queue_t *vq = NULL;
+	struct queue_stats prev = {0};
+	double seconds = interval_ms / 1000.0;
+	int lines = 0;
+
+	while (!exiting) {
+		if (!vq) {
+			vq = video_queue_open_read_only(index);
+			if (vq)
+				video_queue_get_stats(vq, &prev);
+			else if (!lines++)
+				fprintf(stderr, "waiting for camera %u\n",
+					index);
+		} else if (video_queue_state(vq) ==
+			   SHARED_QUEUE_STATE_STOPPING) {
+			fprintf(stderr, "camera %u stopped\n", index);
+			video_queue_close(vq);
+			vq = NULL;
+			lines = 0;
+		} else {
+			struct queue_stats cur;
+			video_queue_get_stats(vq, &cur);
+
+			if (lines++ % 20 == 0)
+				print_header();
+			printf("%9.1f %8.1f %8.1f %6.1f %6.1f %6.1f %6.1f "
+			       "%7u %8.2f %8.2f\n",
+			       per_sec(cur.written, prev.written, seconds),
+			       per_sec(cur.read, prev.read, seconds),
+			       per_sec(cur.shared_hits, prev.shared_hits,
+				       seconds),
+			       per_sec(cur.duplicates, prev.duplicates,
+				       seconds),
+			       per_sec(cur.overwritten, prev.overwritten,
+				       seconds),
+			       per_sec(cur.torn, prev.torn, seconds),
+			       per_sec(cur.pinned_drops, prev.pinned_drops,
+				       seconds),
+			       cur.readers,
+			       avg_ms(cur.copy_time - prev.copy_time,
+				      cur.written - prev.written),
+			       avg_ms(cur.scale_time - prev.scale_time,
+				      (cur.read - prev.read) -
+					      (cur.shared_hits -
+					       prev.shared_hits)));
+			fflush(stdout);
+			prev = cur;
+		}
+
+		usleep(interval_ms * 1000);
+	}
+
+	video_queue_close(vq);
+	return 0;
+}
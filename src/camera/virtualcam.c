@@ -1,20 +1,53 @@
 #include "shared-memory-queue.h"
+#include "tiny-nv12-scale.h"
 
+#ifdef _WIN32
 #include "util/bmem.h"
 #include "util/platform.h"
 #include "util/threading.h"
+#else
+#include "virtualcam-posix.h"
+#endif
 
 #include "virtualcam.h"
 
+struct virtualcam_rendition {
+  enum queue_format format;
+  uint32_t w;
+  uint32_t h;
+  video_queue_t* vq;
+  nv12_scale_t scale;
+};
+
 struct virtualcam_data {
+  uint32_t index;
   video_queue_t* vq;
+  struct virtualcam_rendition renditions[QUEUE_MAX_RENDITIONS];
+  uint32_t rendition_count;
+  audio_queue_t* aq;
+  // shared by both queues so they map timestamps the same way
+  struct queue_clock clock;
+  uint32_t slots;
+  enum virtualcam_video_format format;
   volatile bool active;
   volatile bool stopping;
 };
 
+static void virtualcam_close_renditions(struct virtualcam_data* vcam) {
+  for (uint32_t i = 0; i < vcam->rendition_count; i++) {
+    struct virtualcam_rendition* r = &vcam->renditions[i];
+    video_queue_close(r->vq);
+    r->vq = NULL;
+    nv12_scale_free(&r->scale);
+  }
+}
+
 static void virtualcam_deactive(struct virtualcam_data* vcam) {
+  virtualcam_close_renditions(vcam);
   video_queue_close(vcam->vq);
   vcam->vq = NULL;
+  audio_queue_close(vcam->aq);
+  vcam->aq = NULL;
 
   os_atomic_set_bool(&vcam->active, false);
   os_atomic_set_bool(&vcam->stopping, false);
@@ -22,44 +55,159 @@ static void virtualcam_deactive(struct virtualcam_data* vcam) {
 
 void virtualcam_destroy(void* data) {
   struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+  virtualcam_close_renditions(vcam);
   video_queue_close(vcam->vq);
+  audio_queue_close(vcam->aq);
   bfree(data);
 }
 
 void* virtualcam_create() {
+  return virtualcam_create_instance(0);
+}
+
+void* virtualcam_create_instance(uint32_t index) {
+  if (index >= MAX_QUEUE_INSTANCES) {
+    blog(LOG_ERROR, "Invalid virtual camera index %u", index);
+    return NULL;
+  }
+
   struct virtualcam_data* vcam =
       (struct virtualcam_data*)bzalloc(sizeof(*vcam));
+  vcam->index = index;
   return vcam;
 }
 
+uint32_t virtualcam_max_instances() {
+  return MAX_QUEUE_INSTANCES;
+}
+
+static enum queue_format queue_video_format(
+    enum virtualcam_video_format format) {
+  switch (format) {
+    case VIRTUALCAM_VIDEO_I420:
+      return QUEUE_FORMAT_I420;
+    case VIRTUALCAM_VIDEO_YUY2:
+      return QUEUE_FORMAT_YUY2;
+    case VIRTUALCAM_VIDEO_P010:
+      return QUEUE_FORMAT_P010;
+    case VIRTUALCAM_VIDEO_RGBA:
+      return QUEUE_FORMAT_RGBA;
+    default:
+      return QUEUE_FORMAT_NV12;
+  }
+}
+
 bool virtualcam_start(void* data, uint32_t w, uint32_t h, uint16_t fps) {
-  if (w == 0 || h == 0 || fps == 0) {
+  if (fps == 0) {
+    blog(LOG_ERROR, "Invalid resolution or fps");
+    return false;
+  }
+
+  return virtualcam_start_interval(data, w, h, 10000000ULL / fps);
+}
+
+bool virtualcam_start_interval(void* data, uint32_t w, uint32_t h,
+                               uint64_t interval) {
+  if (w == 0 || h == 0 || interval == 0) {
     blog(LOG_ERROR, "Invalid resolution or fps");
     return false;
   }
 
   struct virtualcam_data* vcam = (struct virtualcam_data*)data;
-  uint64_t interval = 10000000ULL / fps;
+  if (vcam->vq) {
+    blog(LOG_ERROR, "Virtual output %u is already started", vcam->index);
+    return false;
+  }
 
   char res[64];
   snprintf(res, sizeof(res), "%dx%dx%lld", (int)w, (int)h, (long long)interval);
 
-  char* res_file = os_get_config_path_ptr("obs-virtualcam.txt");
+  // read by the camera's filter for its default format, one per instance
+  char res_name[64];
+  if (vcam->index)
+    snprintf(res_name, sizeof(res_name), "obs-virtualcam%u.txt",
+             vcam->index + 1);
+  else
+    snprintf(res_name, sizeof(res_name), "obs-virtualcam.txt");
+
+  char* res_file = os_get_config_path_ptr(res_name);
   os_quick_write_utf8_file_safe(res_file, res, strlen(res), false, "tmp", NULL);
   bfree(res_file);
 
-  vcam->vq = video_queue_create(w, h, interval);
+  vcam->vq = video_queue_create_format(vcam->index, w, h, interval,
+                                       vcam->slots,
+                                       queue_video_format(vcam->format));
   if (!vcam->vq) {
     return false;
   }
+  queue_clock_init(&vcam->clock);
+  video_queue_set_clock(vcam->vq, &vcam->clock);
+
+  for (uint32_t i = 0; i < vcam->rendition_count; i++) {
+    struct virtualcam_rendition* r = &vcam->renditions[i];
+    r->vq = video_queue_add_rendition(vcam->vq, r->format, r->w, r->h);
+    if (!r->vq) {
+      blog(LOG_WARNING, "Virtual output %u: no %ux%u rendition", vcam->index,
+           r->w, r->h);
+      continue;
+    }
+
+    // scaled once here instead of in every reader, so it gets the better
+    // filter
+    r->scale.filter = SCALE_FILTER_AREA;
+    nv12_scale_init(&r->scale, (enum target_format)r->format, (int)r->w,
+                    (int)r->h, (int)w, (int)h);
+  }
 
   os_atomic_set_bool(&vcam->active, true);
   os_atomic_set_bool(&vcam->stopping, false);
-  blog(LOG_INFO, "Virtual output started");
+  blog(LOG_INFO, "Virtual output %u started", vcam->index);
+
+  return true;
+}
 
+void virtualcam_set_slots(void* data, uint32_t slots) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+  vcam->slots = slots;
+}
+
+void virtualcam_set_format(void* data, enum virtualcam_video_format format) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+  vcam->format = format;
+}
+
+bool virtualcam_add_rendition(void* data, enum virtualcam_video_format format,
+                              uint32_t w, uint32_t h) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+
+  // the formats readers can be asked for, at sizes the scaler's output
+  // layout and the queue's agree on
+  if (vcam->rendition_count == QUEUE_MAX_RENDITIONS || w == 0 || h == 0 ||
+      (w & 1) || (h & 1) ||
+      (format != VIRTUALCAM_VIDEO_NV12 && format != VIRTUALCAM_VIDEO_I420 &&
+       format != VIRTUALCAM_VIDEO_YUY2))
+    return false;
+
+  struct virtualcam_rendition* r = &vcam->renditions[vcam->rendition_count++];
+  r->format = queue_video_format(format);
+  r->w = w;
+  r->h = h;
   return true;
 }
 
+static void virtualcam_write_renditions(struct virtualcam_data* vcam) {
+  for (uint32_t i = 0; i < vcam->rendition_count; i++) {
+    struct virtualcam_rendition* r = &vcam->renditions[i];
+    if (r->vq)
+      video_queue_write_rendition(vcam->vq, r->vq, &r->scale);
+  }
+}
+
+enum virtualcam_video_format virtualcam_get_format(void* data) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+  return vcam->format;
+}
+
 void virtualcam_stop(void* data, uint64_t ts) {
   struct virtualcam_data* vcam = (struct virtualcam_data*)data;
   os_atomic_set_bool(&vcam->stopping, true);
@@ -67,19 +215,137 @@ void virtualcam_stop(void* data, uint64_t ts) {
   UNUSED_PARAMETER(ts);
 }
 
-void virtual_video(void* data, VideoFrame* frame) {
-  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
-
+static bool virtualcam_writable(struct virtualcam_data* vcam) {
   if (!vcam->vq)
-    return;
+    return false;
 
   if (!os_atomic_load_bool(&vcam->active))
-    return;
+    return false;
 
   if (os_atomic_load_bool(&vcam->stopping)) {
     virtualcam_deactive(vcam);
-    return;
+    return false;
   }
 
+  return true;
+}
+
+void virtual_video(void* data, VideoFrame* frame) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+
+  if (!virtualcam_writable(vcam))
+    return;
+
   video_queue_write(vcam->vq, frame->data, frame->linesize, frame->timestamp);
+  virtualcam_write_renditions(vcam);
+}
+
+bool virtualcam_start_audio(void* data, uint32_t sample_rate,
+                            uint32_t channels,
+                            enum virtualcam_audio_format format) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+
+  if (!virtualcam_writable(vcam) || vcam->aq) {
+    blog(LOG_ERROR, "Virtual output %u is not running or has audio already",
+         vcam->index);
+    return false;
+  }
+
+  enum audio_queue_format queue_format = format == VIRTUALCAM_AUDIO_F32
+                                             ? AUDIO_QUEUE_FORMAT_F32
+                                             : AUDIO_QUEUE_FORMAT_S16;
+  vcam->aq = audio_queue_create(vcam->index, sample_rate, channels,
+                                queue_format, 0);
+  if (!vcam->aq) {
+    return false;
+  }
+  audio_queue_set_clock(vcam->aq, &vcam->clock);
+
+  blog(LOG_INFO, "Virtual audio %u started: %u Hz, %u channels", vcam->index,
+       sample_rate, channels);
+  return true;
+}
+
+void virtual_audio(void* data, AudioFrame* frame) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+
+  if (!virtualcam_writable(vcam) || !vcam->aq)
+    return;
+
+  audio_queue_write(vcam->aq, frame->data[0], frame->frames, frame->timestamp);
+}
+
+bool virtualcam_get_size(void* data, uint32_t* w, uint32_t* h) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+  uint64_t interval;
+
+  if (!vcam->vq)
+    return false;
+
+  video_queue_get_info(vcam->vq, w, h, &interval);
+  return true;
+}
+
+uint32_t virtualcam_get_planes(void* data, size_t* offsets,
+                               uint32_t* linesize) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+  struct queue_plane planes[QUEUE_MAX_PLANES];
+  uint32_t cx, cy;
+  uint64_t interval;
+
+  if (!vcam->vq)
+    return 0;
+
+  video_queue_get_info(vcam->vq, &cx, &cy, &interval);
+  uint32_t count = queue_format_planes(video_queue_get_format(vcam->vq), cx,
+                                       cy, planes);
+  for (uint32_t i = 0; i < count; i++) {
+    offsets[i] = planes[i].offset;
+    linesize[i] = planes[i].width;
+  }
+  return count;
+}
+
+size_t virtualcam_get_slot_count(void* data) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+  return vcam->vq ? video_queue_slot_count(vcam->vq) : 0;
+}
+
+uint8_t* virtualcam_get_slot(void* data, size_t idx, size_t* size) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+  return vcam->vq ? video_queue_get_slot(vcam->vq, idx, size) : NULL;
+}
+
+void virtualcam_begin_slot(void* data, size_t idx) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+
+  if (vcam->vq)
+    video_queue_begin_write(vcam->vq, idx);
+}
+
+void virtualcam_publish(void* data, size_t idx, uint64_t ts) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+
+  if (!virtualcam_writable(vcam))
+    return;
+
+  video_queue_publish(vcam->vq, idx, ts);
+  virtualcam_write_renditions(vcam);
+}
+
+uint64_t virtualcam_now() {
+  return queue_clock_now();
+}
+
+void virtualcam_trace_frame(void* data, const FrameTrace* trace) {
+  struct virtualcam_data* vcam = (struct virtualcam_data*)data;
+
+  if (!virtualcam_writable(vcam))
+    return;
+
+  struct queue_trace qt = {0};
+  qt.stamp[QUEUE_TRACE_RECEIVED] = trace->received;
+  qt.stamp[QUEUE_TRACE_DECODED] = trace->decoded;
+  qt.stamp[QUEUE_TRACE_SINK] = trace->sink;
+  video_queue_set_trace(vcam->vq, &qt);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef _MSC_VER
@@ -14,18 +17,103 @@
 extern "C" {
 #endif
 
+// Timestamps are in nanoseconds (GstClockTime), the queues map them to a
+// clock both sides share so readers can line audio and video up.
 typedef struct video_data {
   uint8_t* data[MAX_AV_PLANES];
   uint32_t linesize[MAX_AV_PLANES];
   uint64_t timestamp;
 } VideoFrame;
 
+// Interleaved PCM, only data[0] is used.
+typedef struct audio_data {
+  uint8_t* data[MAX_AV_PLANES];
+  uint32_t frames;
+  uint64_t timestamp;
+} AudioFrame;
+
+// Pixel layouts the queue carries as they are, readers convert to what the
+// application asked for. P010 is 10 bit 4:2:0 in 16 bit little endian words.
+enum virtualcam_video_format {
+  VIRTUALCAM_VIDEO_NV12,
+  VIRTUALCAM_VIDEO_I420,
+  VIRTUALCAM_VIDEO_YUY2,
+  VIRTUALCAM_VIDEO_P010,
+  VIRTUALCAM_VIDEO_RGBA,
+};
+
+enum virtualcam_audio_format {
+  VIRTUALCAM_AUDIO_S16,
+  VIRTUALCAM_AUDIO_F32,
+};
+
 EXPORT void virtualcam_destroy(void* data);
 EXPORT void* virtualcam_create();
+// Each instance publishes to its own queue and shows up as its own camera
+// ("Test Virtual Camera", "Test Virtual Camera 2", ...), so several streams
+// can run side by side. virtualcam_create() is instance 0.
+EXPORT void* virtualcam_create_instance(uint32_t index);
+EXPORT uint32_t virtualcam_max_instances();
+// Frame slots in the shared ring used by the next virtualcam_start, 0 keeps
+// the default of 3. More slots cost memory but give slow readers more time
+// before a frame is overwritten.
+EXPORT void virtualcam_set_slots(void* data, uint32_t slots);
+// Pixel format of the frames passed to the next virtualcam_start, NV12 unless
+// set. virtual_video then reads as many planes as the format has.
+EXPORT void virtualcam_set_format(void* data,
+                                  enum virtualcam_video_format format);
+EXPORT enum virtualcam_video_format virtualcam_get_format(void* data);
+// Also publishes every frame scaled to w x h in format (NV12, I420 or YUY2)
+// from the next virtualcam_start on, for readers that want exactly that and
+// would otherwise each scale it themselves. Up to four, false beyond that,
+// for other formats or for odd sizes.
+EXPORT bool virtualcam_add_rendition(void* data,
+                                     enum virtualcam_video_format format,
+                                     uint32_t w, uint32_t h);
 EXPORT bool virtualcam_start(void* data, uint32_t w, uint32_t h, uint16_t fps);
+// Like virtualcam_start for rates that aren't whole numbers, e.g. 30000/1001,
+// interval is the frame duration in 100ns units.
+EXPORT bool virtualcam_start_interval(void* data, uint32_t w, uint32_t h,
+                                      uint64_t interval);
 EXPORT void virtualcam_stop(void* data, uint64_t ts);
 EXPORT void virtual_video(void* data, VideoFrame* frame);
 
+// Virtual microphone: opens the instance's audio ring next to the camera's
+// video queue, call after virtualcam_start. Frames that don't fit because
+// the reader fell behind are dropped.
+EXPORT bool virtualcam_start_audio(void* data, uint32_t sample_rate,
+                                   uint32_t channels,
+                                   enum virtualcam_audio_format format);
+EXPORT void virtual_audio(void* data, AudioFrame* frame);
+
+// Zero copy output: the slots are packed frames of the started size and
+// format living in the shared queue. Fill one in place and publish its index
+// instead of calling virtual_video. Slot pointers stay valid until the camera
+// is stopped, the latest published slot must not be written to.
+EXPORT bool virtualcam_get_size(void* data, uint32_t* w, uint32_t* h);
+// Where each plane starts within a slot and its row stride, returns the
+// number of planes or 0 when the camera isn't started.
+EXPORT uint32_t virtualcam_get_planes(void* data, size_t* offsets,
+                                      uint32_t* linesize);
+EXPORT size_t virtualcam_get_slot_count(void* data);
+EXPORT uint8_t* virtualcam_get_slot(void* data, size_t idx, size_t* size);
+// Call before a slot's pixels change so readers still copying it notice.
+EXPORT void virtualcam_begin_slot(void* data, size_t idx);
+EXPORT void virtualcam_publish(void* data, size_t idx, uint64_t ts);
+
+// Latency tracing: when a frame reached the stages before the queue, in the
+// clock virtualcam_now() reads (100ns units), 0 for stages that weren't seen.
+// Applies to the next virtual_video or virtualcam_publish, readers add the
+// rest of the trip and keep histograms of it in the queue.
+typedef struct frame_trace {
+  uint64_t received;  // left the network source
+  uint64_t decoded;   // left the decoder
+  uint64_t sink;      // reached the app sink
+} FrameTrace;
+
+EXPORT uint64_t virtualcam_now();
+EXPORT void virtualcam_trace_frame(void* data, const FrameTrace* trace);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+/* stand-in for the capture endpoint of the virtual microphone: pulls fixed
+ * size periods off an audio queue the way a driver would and writes the raw
+ * pcm to stdout, for example
+ *
+ *   virtualmic-reader 0 10 | aplay -f S16_LE -r 48000 -c 2
+ *
+ * statistics go to stderr once a second. */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "shared-memory-queue.h"
+
+static volatile sig_atomic_t exiting;
+
+static void on_signal(int signum)
+{
+	(void)signum;
+	exiting = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static audio_queue_t *wait_for_writer(uint32_t index)
+{
+	while (!exiting) {
+		audio_queue_t *aq = audio_queue_open(index);
+		if (aq) {
+			enum queue_state state = audio_queue_state(aq);
+			if (state == SHARED_QUEUE_STATE_READY)
+				return aq;
+			if (state == SHARED_QUEUE_STATE_INVALID)
+				fprintf(stderr, "queue %u is taken\n", index);
+			audio_queue_close(aq);
+		}
+		usleep(100000);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t index = argc > 1 ? (uint32_t)atoi(argv[1]) : 0;
+	uint32_t period_ms = argc > 2 ? (uint32_t)atoi(argv[2]) : 10;
+	bool output = !isatty(STDOUT_FILENO);
+
+	if (index >= MAX_QUEUE_INSTANCES || !period_ms) {
+		fprintf(stderr, "usage: %s [index] [period ms]\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	audio_queue_t *aq = wait_for_writer(index);
+	if (!aq)
+		return 0;
+
+	uint32_t sample_rate, channels;
+	enum audio_queue_format format;
+	audio_queue_get_info(aq, &sample_rate, &channels, &format);
+
+	uint32_t frames = sample_rate * period_ms / 1000;
+	uint8_t *period = malloc((size_t)frames * audio_queue_frame_size(aq));
+	if (!frames || !period) {
+		audio_queue_close(aq);
+		return 1;
+	}
+
+	fprintf(stderr, "%u Hz, %u channels, %s, %u frame periods\n",
+		sample_rate, channels,
+		format == AUDIO_QUEUE_FORMAT_F32 ? "f32" : "s16", frames);
+
+	uint64_t periods = 0, underruns = 0, queued_max = 0;
+	int64_t lag_max = INT64_MIN;
+	uint64_t report = now_ns() + 1000000000ULL;
+
+	while (!exiting &&
+	       audio_queue_state(aq) == SHARED_QUEUE_STATE_READY) {
+		/* a period late means the writer stalled, count it once */
+		if (!audio_queue_wait(aq, frames, period_ms * 2)) {
+			underruns++;
+			continue;
+		}
+
+		uint32_t queued = audio_queue_available(aq);
+		if (queued > queued_max)
+			queued_max = queued;
+
+		uint64_t ts;
+		if (!audio_queue_read(aq, period, frames, &ts))
+			continue;
+		periods++;
+
+		/* how long after it could have arrived at the earliest the
+		 * period got here, in the clock the video queue uses too */
+		uint64_t mono = audio_queue_map_time(aq, ts);
+		if (mono) {
+			int64_t lag = (int64_t)(queue_clock_now() - mono);
+			if (lag > lag_max)
+				lag_max = lag;
+		}
+
+		if (output)
+			fwrite(period, audio_queue_frame_size(aq), frames,
+			       stdout);
+
+		if (now_ns() >= report) {
+			uint64_t dropped, skipped;
+			audio_queue_get_stats(aq, &dropped, &skipped);
+			fprintf(stderr,
+				"periods %llu, underruns %llu, max queued "
+				"%.1f ms, max lag %.1f ms, dropped %llu, "
+				"skipped %llu\n",
+				(unsigned long long)periods,
+				(unsigned long long)underruns,
+				queued_max * 1000.0 / sample_rate,
+				lag_max == INT64_MIN ? 0.0 : lag_max / 10000.0,
+				(unsigned long long)dropped,
+				(unsigned long long)skipped);
+			queued_max = 0;
+			lag_max = INT64_MIN;
+			report += 1000000000ULL;
+		}
+	}
+
+	free(period);
+	audio_queue_close(aq);
+	return 0;
+}
@@ -0,0 +1,251 @@
+#include "decoder-select.h"
+
+#include <gst/video/video.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "local-debug.h"
+
+// software decoders in order of preference, behind any hardware one
+static const char* software_decoders[] = {"avdec_h264", "openh264dec"};
+
+// frame threads add a frame of latency each, more than this rarely helps a
+// single 4K stream and starves everything else on the box
+#define MAX_DECODE_THREADS 8
+
+#define WATCH_INTERVAL_US (5 * G_USEC_PER_SEC)
+
+static bool factory_is_hardware(GstElementFactory* factory) {
+  const gchar* klass =
+      gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS);
+  return klass != nullptr && strstr(klass, "Hardware") != nullptr;
+}
+
+static int software_preference(GstElementFactory* factory) {
+  const gchar* name = GST_OBJECT_NAME(factory);
+  for (size_t i = 0; i < G_N_ELEMENTS(software_decoders); i++) {
+    if (g_strcmp0(name, software_decoders[i]) == 0) {
+      return (int)i;
+    }
+  }
+  return (int)G_N_ELEMENTS(software_decoders);
+}
+
+// A hardware decoder is registered when its plugin finds a device, but on a
+// headless box or in a session without GPU access opening it still fails.
+static bool factory_can_open(GstElementFactory* factory) {
+  GstElement* element = gst_element_factory_create(factory, nullptr);
+  if (element == nullptr) {
+    return false;
+  }
+
+  bool ok = gst_element_set_state(element, GST_STATE_READY) !=
+            GST_STATE_CHANGE_FAILURE;
+  gst_element_set_state(element, GST_STATE_NULL);
+  gst_object_unref(element);
+  return ok;
+}
+
+std::string decoder_select() {
+  GList* decoders = gst_element_factory_list_get_elements(
+      GST_ELEMENT_FACTORY_TYPE_DECODER, GST_RANK_MARGINAL);
+  GstCaps* caps = gst_caps_from_string("video/x-h264");
+  GList* h264 =
+      gst_element_factory_list_filter(decoders, caps, GST_PAD_SINK, FALSE);
+  gst_caps_unref(caps);
+  gst_plugin_feature_list_free(decoders);
+
+  std::vector<GstElementFactory*> ranked;
+  for (GList* l = h264; l != nullptr; l = l->next) {
+    ranked.push_back(GST_ELEMENT_FACTORY(l->data));
+  }
+
+  // hardware first, by rank, then the preferred software decoders
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](GstElementFactory* a, GstElementFactory* b) {
+                     bool hw_a = factory_is_hardware(a);
+                     bool hw_b = factory_is_hardware(b);
+                     if (hw_a != hw_b) {
+                       return hw_a;
+                     }
+                     if (!hw_a) {
+                       int pref_a = software_preference(a);
+                       int pref_b = software_preference(b);
+                       if (pref_a != pref_b) {
+                         return pref_a < pref_b;
+                       }
+                     }
+                     return gst_plugin_feature_get_rank(
+                                GST_PLUGIN_FEATURE(a)) >
+                            gst_plugin_feature_get_rank(GST_PLUGIN_FEATURE(b));
+                   });
+
+  std::string selected;
+  for (GstElementFactory* factory : ranked) {
+    bool hardware = factory_is_hardware(factory);
+    LOGD("decoder candidate %s (%s, rank %u)\n", GST_OBJECT_NAME(factory),
+         hardware ? "hardware" : "software",
+         gst_plugin_feature_get_rank(GST_PLUGIN_FEATURE(factory)));
+
+    if (selected.empty() && (!hardware || factory_can_open(factory))) {
+      selected = GST_OBJECT_NAME(factory);
+    }
+  }
+
+  gst_plugin_feature_list_free(h264);
+
+  if (selected.empty()) {
+    LOGE("no H.264 decoder found\n");
+  } else {
+    LOGI("selected decoder %s\n", selected.c_str());
+  }
+  return selected;
+}
+
+bool decoder_is_hardware(const std::string& name) {
+  GstElementFactory* factory = gst_element_factory_find(name.c_str());
+  if (factory == nullptr) {
+    return false;
+  }
+
+  bool hardware = factory_is_hardware(factory);
+  gst_object_unref(factory);
+  return hardware;
+}
+
+void decoder_configure(GstElement* decoder, guint threads) {
+  // avdec_* call it max-threads, 0 lets libav use every core
+  if (g_object_class_find_property(G_OBJECT_GET_CLASS(decoder),
+                                   "max-threads") == nullptr) {
+    return;
+  }
+
+  if (threads == 0) {
+    threads = std::min(g_get_num_processors(), (guint)MAX_DECODE_THREADS);
+  }
+  g_object_set(decoder, "max-threads", (gint)threads, nullptr);
+  LOGI("decoder %s uses %u threads\n", GST_OBJECT_NAME(decoder), threads);
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct DecodeWatch {
+  std::mutex lock;
+  // input time by pts, frames can leave the decoder in another order
+  std::map<GstClockTime, gint64> pending;
+
+  // one frame interval in us, anything longer and a single decoder thread
+  // can't keep up
+  gint64 budget = 0;
+
+  guint frames = 0;
+  guint over_budget = 0;
+  gint64 total = 0;
+  gint64 max = 0;
+  gint64 report_at = 0;
+};
+
+static gint64 frame_interval_us(GstPad* pad) {
+  GstCaps* caps = gst_pad_get_current_caps(pad);
+  if (caps == nullptr) {
+    return 0;
+  }
+
+  gint64 interval = 0;
+  GstVideoInfo info;
+  if (gst_video_info_from_caps(&info, caps) &&
+      GST_VIDEO_INFO_FPS_N(&info) > 0) {
+    interval = (gint64)gst_util_uint64_scale(G_USEC_PER_SEC,
+                                             GST_VIDEO_INFO_FPS_D(&info),
+                                             GST_VIDEO_INFO_FPS_N(&info));
+  }
+  gst_caps_unref(caps);
+  return interval;
+}
+
+static GstPadProbeReturn on_decoder_input(GstPad* pad, GstPadProbeInfo* info,
+                                          DecodeWatch* watch) {
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  GstClockTime pts = GST_BUFFER_PTS(buffer);
+  if (!GST_CLOCK_TIME_IS_VALID(pts)) {
+    return GST_PAD_PROBE_OK;
+  }
+
+  std::lock_guard<std::mutex> guard(watch->lock);
+  // frames the decoder dropped never come out, don't let them pile up
+  if (watch->pending.size() >= 64) {
+    watch->pending.erase(watch->pending.begin());
+  }
+  watch->pending[pts] = g_get_monotonic_time();
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn on_decoder_output(GstPad* pad, GstPadProbeInfo* info,
+                                           DecodeWatch* watch) {
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  gint64 now = g_get_monotonic_time();
+
+  std::lock_guard<std::mutex> guard(watch->lock);
+  auto it = watch->pending.find(GST_BUFFER_PTS(buffer));
+  if (it == watch->pending.end()) {
+    return GST_PAD_PROBE_OK;
+  }
+
+  gint64 elapsed = now - it->second;
+  watch->pending.erase(it);
+
+  if (watch->budget == 0) {
+    watch->budget = frame_interval_us(pad);
+  }
+
+  watch->frames++;
+  watch->total += elapsed;
+  watch->max = std::max(watch->max, elapsed);
+  if (watch->budget > 0 && elapsed > watch->budget) {
+    watch->over_budget++;
+  }
+
+  if (watch->report_at == 0) {
+    watch->report_at = now + WATCH_INTERVAL_US;
+  } else if (now >= watch->report_at) {
+    LOGI("decode: %u frames, avg %.2f ms, max %.2f ms, %u over the %.2f ms "
+         "budget\n",
+         watch->frames, watch->total / 1000.0 / watch->frames,
+         watch->max / 1000.0, watch->over_budget, watch->budget / 1000.0);
+    watch->frames = 0;
+    watch->over_budget = 0;
+    watch->total = 0;
+    watch->max = 0;
+    // picks up renegotiation
+    watch->budget = 0;
+    watch->report_at = now + WATCH_INTERVAL_US;
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+void decoder_watch(GstElement* decoder) {
+  GstPad* sink = gst_element_get_static_pad(decoder, "sink");
+  GstPad* src = gst_element_get_static_pad(decoder, "src");
+  if (sink == nullptr || src == nullptr) {
+    LOGW("decoder %s has no static pads to watch\n", GST_OBJECT_NAME(decoder));
+    if (sink != nullptr) gst_object_unref(sink);
+    if (src != nullptr) gst_object_unref(src);
+    return;
+  }
+
+  // owned by the decoder, the probes go away with its pads
+  DecodeWatch* watch = new DecodeWatch();
+  g_object_set_data_full(G_OBJECT(decoder), "decode-watch", watch,
+                         +[](gpointer data) { delete (DecodeWatch*)data; });
+
+  gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_decoder_input, watch, nullptr);
+  gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_decoder_output, watch, nullptr);
+  gst_object_unref(sink);
+  gst_object_unref(src);
+}
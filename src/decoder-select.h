@@ -0,0 +1,22 @@
+#pragma once
+
+#include <gst/gst.h>
+
+#include <string>
+
+// Picks the H.264 decoder for the pipeline: the highest ranked hardware
+// decoder that can actually open its device, otherwise avdec_h264, then
+// openh264dec, then any other software decoder. Empty if there is none.
+std::string decoder_select();
+
+// True for decoders that run on a GPU or other dedicated hardware, these
+// can hand over NV12 without a videoconvert behind them.
+bool decoder_is_hardware(const std::string& name);
+
+// Sets the thread count of a software decoder that has one, 0 picks one
+// from the number of cores.
+void decoder_configure(GstElement* decoder, guint threads);
+
+// Measures how long each frame spends in the decoder and logs it against
+// the frame interval every few seconds.
+void decoder_watch(GstElement* decoder);
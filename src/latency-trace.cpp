@@ -0,0 +1,120 @@
+#include "latency-trace.h"
+
+#include <atomic>
+
+// frames in flight between the source and the sink, the decoder's reorder
+// delay plus the queues in between stays well below this
+#define TRACE_FRAMES 64
+
+#define TRACE_STAGES (LATENCY_STAGE_SINK + 1)
+
+// Written only by the stage's thread, read by the writer thread. seq is odd
+// while the entry is being rewritten, a reader that sees the same even value
+// before and after got a whole entry.
+struct TraceEntry {
+  std::atomic<uint32_t> seq{0};
+  std::atomic<GstClockTime> pts{GST_CLOCK_TIME_NONE};
+  std::atomic<uint64_t> stamp{0};
+};
+
+// One ring per stage, each stage is stamped from one streaming thread at a
+// time (a pad's), so stamping takes no lock and never waits for the writer.
+struct TraceStage {
+  TraceEntry entries[TRACE_FRAMES];
+  // only touched by the stage's thread
+  guint next = 0;
+  GstClockTime last_pts = GST_CLOCK_TIME_NONE;
+};
+
+struct LatencyTrace {
+  TraceStage stages[TRACE_STAGES];
+};
+
+struct TraceWatch {
+  LatencyTrace* trace;
+  LatencyStage stage;
+};
+
+// the earliest stamp the stage has for pts, 0 if it has none. A frame shows
+// up more than once only if its packets were interleaved with another one's,
+// the first sighting is what counts.
+static uint64_t find_stamp(TraceStage* stage, GstClockTime pts) {
+  uint64_t found = 0;
+  for (TraceEntry& entry : stage->entries) {
+    uint32_t seq = entry.seq.load(std::memory_order_acquire);
+    if (seq & 1 || entry.pts.load(std::memory_order_relaxed) != pts) {
+      continue;
+    }
+
+    uint64_t stamp = entry.stamp.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry.seq.load(std::memory_order_relaxed) != seq) {
+      continue;
+    }
+    if (found == 0 || stamp < found) {
+      found = stamp;
+    }
+  }
+  return found;
+}
+
+LatencyTrace* latency_trace_new() {
+  return new LatencyTrace();
+}
+
+void latency_trace_free(LatencyTrace* trace) {
+  delete trace;
+}
+
+void latency_trace_stamp(LatencyTrace* trace, GstClockTime pts,
+                         LatencyStage stage) {
+  if (trace == nullptr || !GST_CLOCK_TIME_IS_VALID(pts)) {
+    return;
+  }
+
+  // the rest of a burst of RTP packets of one frame
+  TraceStage* ring = &trace->stages[stage];
+  if (ring->last_pts == pts) {
+    return;
+  }
+  ring->last_pts = pts;
+
+  // overwrites the oldest entry
+  TraceEntry* entry = &ring->entries[ring->next];
+  ring->next = (ring->next + 1) % TRACE_FRAMES;
+
+  uint32_t seq = entry->seq.load(std::memory_order_relaxed);
+  entry->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  entry->pts.store(pts, std::memory_order_relaxed);
+  entry->stamp.store(virtualcam_now(), std::memory_order_relaxed);
+  entry->seq.store(seq + 2, std::memory_order_release);
+}
+
+FrameTrace latency_trace_take(LatencyTrace* trace, GstClockTime pts) {
+  FrameTrace stamps = {};
+  if (trace == nullptr || !GST_CLOCK_TIME_IS_VALID(pts)) {
+    return stamps;
+  }
+
+  stamps.received =
+      find_stamp(&trace->stages[LATENCY_STAGE_RECEIVED], pts);
+  stamps.decoded = find_stamp(&trace->stages[LATENCY_STAGE_DECODED], pts);
+  stamps.sink = find_stamp(&trace->stages[LATENCY_STAGE_SINK], pts);
+  return stamps;
+}
+
+static GstPadProbeReturn on_trace_buffer(GstPad* pad, GstPadProbeInfo* info,
+                                         TraceWatch* watch) {
+  GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+  latency_trace_stamp(watch->trace, GST_BUFFER_PTS(buffer), watch->stage);
+  return GST_PAD_PROBE_OK;
+}
+
+void latency_trace_watch(LatencyTrace* trace, GstPad* pad,
+                         LatencyStage stage) {
+  TraceWatch* watch = new TraceWatch{trace, stage};
+  gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+                    (GstPadProbeCallback)on_trace_buffer, watch,
+                    +[](gpointer data) { delete (TraceWatch*)data; });
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <gst/gst.h>
+
+#include "camera/virtualcam.h"
+
+// Follows video frames through the pipeline by pts and notes when each one
+// reaches the stages of a FrameTrace, in virtualcam_now() time. Only the
+// first buffer with a pts counts, for RTP that is the frame's first packet.
+struct LatencyTrace;
+
+enum LatencyStage {
+  LATENCY_STAGE_RECEIVED,
+  LATENCY_STAGE_DECODED,
+  LATENCY_STAGE_SINK,
+};
+
+LatencyTrace* latency_trace_new();
+// Only once the pipeline is stopped, the probes use the trace until then.
+void latency_trace_free(LatencyTrace* trace);
+
+// Stamps 'stage' for the buffers that pass pad.
+void latency_trace_watch(LatencyTrace* trace, GstPad* pad, LatencyStage stage);
+// Takes no lock, but each stage must be stamped from one thread at a time,
+// as the buffers of a pad are.
+void latency_trace_stamp(LatencyTrace* trace, GstClockTime pts,
+                         LatencyStage stage);
+
+// The stamps of pts, all 0 for a pts that wasn't seen or that newer frames
+// pushed out already. Safe against the stamping threads.
+FrameTrace latency_trace_take(LatencyTrace* trace, GstClockTime pts);
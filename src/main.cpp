@@ -1,14 +1,17 @@
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 
 /// gstreamer headers
 #include <gio/gio.h>
 #include <glib.h>
 #include <gst/app/gstappsink.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/audio/audio.h>
 #include <gst/gst.h>
 #include <gst/rtsp/gstrtspmessage.h>
 #include <gst/sdp/gstsdpmessage.h>
-#include <gst/video/video-info.h>
+#include <gst/video/video.h>
 
 #include <chrono>
 #include <csignal>
@@ -16,8 +19,15 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 
+#include "app-config.h"
 #include "camera/virtualcam.h"
+#include "decoder-select.h"
+#include "latency-trace.h"
+#include "sample-handoff.h"
+#include "slot-buffer-pool.h"
+#include "video-format.h"
 
 // Logging
 #include "local-debug.h"
@@ -35,10 +45,24 @@ struct App {
 
   // Audio sink
   GstElement* audio_sink = nullptr;
+  GstAudioInfo* audio_info = nullptr;
   // Video sink
   GstElement* video_sink = nullptr;
   void* virtualcam = nullptr;
   GstVideoInfo* video_info = nullptr;
+  // set when upstream renegotiated to a size or format the running camera
+  // can't take, from the streaming thread
+  gint format_mismatch = FALSE;
+  // takes video samples off the streaming thread, everything from mapping the
+  // frame to publishing it runs on its writer thread
+  SampleHandoff* video_writer = nullptr;
+  // when frames left the network source and the decoder, by pts
+  LatencyTrace* latency = nullptr;
+  // offered upstream so frames are decoded straight into the queue slots
+  GstBufferPool* slot_pool = nullptr;
+  // latest published slot, held so the pool can't hand it out again while
+  // readers may still be copying it
+  GstBuffer* published = nullptr;
 
   // thread for the app
   std::unique_ptr<std::thread> thread = nullptr;
@@ -145,10 +169,9 @@ void get_video_info(App* app, GstSample* sample) {
          video_info_.height);
   } else {
     LOGE("Could not get video info from caps.\n");
+    return;
   }
 
-  gst_caps_unref(caps);
-
   app->video_info = gst_video_info_copy(&video_info_);
 
   GstVideoFormat gst_format = GST_VIDEO_INFO_FORMAT(app->video_info);
@@ -156,63 +179,277 @@ void get_video_info(App* app, GstSample* sample) {
        gst_video_format_to_string(gst_format));
 }
 
-// Video buffer callback from appsink element
-static GstFlowReturn on_new_video_sample(GstElement* sink, App* app) {
-  GstSample* sample = gst_app_sink_pull_sample(GST_APP_SINK(sink));
-  if (sample == nullptr) {
-    LOGE("failed to get sample from appsink\n");
-    return GST_FLOW_ERROR;
+static void publish_slot(App* app, GstBuffer* buffer, gint slot,
+                         GstClockTime pts) {
+  virtualcam_publish(app->virtualcam, slot, pts);
+  gst_buffer_replace(&app->published, buffer);
+}
+
+// Copies a frame that upstream didn't decode into the slot pool into one of
+// its buffers, writing to the queue directly would clobber slots that are
+// still in use upstream. Returns false when the pool isn't in use.
+static bool write_through_slot_pool(App* app, GstVideoFrame* src,
+                                    GstClockTime pts) {
+  if (app->slot_pool == nullptr ||
+      !gst_buffer_pool_is_active(app->slot_pool)) {
+    return false;
   }
 
+  GstBuffer* buffer = nullptr;
+  GstBufferPoolAcquireParams params = {};
+  params.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+  if (gst_buffer_pool_acquire_buffer(app->slot_pool, &buffer, &params) !=
+      GST_FLOW_OK) {
+    LOGD("no free slot, dropping frame\n");
+    return true;
+  }
+
+  GstVideoFrame dst;
+  if (gst_video_frame_map(&dst, app->video_info, buffer, GST_MAP_WRITE)) {
+    gst_video_frame_copy(&dst, src);
+    gst_video_frame_unmap(&dst);
+    publish_slot(app, buffer, slot_buffer_pool_get_slot(buffer), pts);
+  }
+
+  gst_buffer_unref(buffer);
+  return true;
+}
+
+// Writes one video sample to the virtual camera, on the writer thread. The
+// sample is unreffed by the handoff.
+static void write_video_sample(GstSample* sample, App* app) {
   GstBuffer* buffer = gst_sample_get_buffer(sample);
   if (buffer == nullptr) {
     LOGE("failed to get buffer from sample\n");
-    gst_sample_unref(sample);
-    return GST_FLOW_ERROR;
+    return;
   }
 
-  GstMapInfo map;
-  if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
-    LOGE("failed to map buffer\n");
-    gst_sample_unref(sample);
-    return GST_FLOW_ERROR;
+  // get video info, the caps are only looked at for the first sample
+  get_video_info(app, sample);
+  if (app->video_info == nullptr) {
+    return;
   }
 
-  // get video info
-  get_video_info(app, sample);
+  if (g_atomic_int_get(&app->format_mismatch)) {
+    return;
+  }
+
+  // goes into the slot along with the frame
+  FrameTrace trace = latency_trace_take(app->latency, GST_BUFFER_PTS(buffer));
+  virtualcam_trace_frame(app->virtualcam, &trace);
 
-  guint8* data = map.data;
-  gint width = app->video_info->width;
-  gint height = app->video_info->height;
-  guint stride_Y = width;        // Typically, stride for Y is equal to width
-  guint stride_UV = height / 2;  // Typically, stride for UV is half of width
+  // decoded straight into a queue slot, all that's left is to publish it
+  gint slot = slot_buffer_pool_get_slot(buffer);
+  if (slot >= 0) {
+    publish_slot(app, buffer, slot, GST_BUFFER_PTS(buffer));
+    return;
+  }
+
+  // map with the real plane offsets and strides, decoders commonly pad rows
+  // and planes (e.g. 1088 lines for 1080p h264), a GstVideoMeta on the buffer
+  // takes precedence over the layout derived from the caps
+  GstVideoFrame frame;
+  if (!gst_video_frame_map(&frame, app->video_info, buffer, GST_MAP_READ)) {
+    LOGE("failed to map video frame\n");
+    return;
+  }
 
-  // Access Y plane
-  guint8* Y_plane = data;
-  // Access UV plane
-  guint8* UV_plane = data + stride_Y * height;
-  // get PTS
-  GstClockTime pts = GST_BUFFER_PTS(buffer);
+  if (write_through_slot_pool(app, &frame, GST_BUFFER_PTS(buffer))) {
+    gst_video_frame_unmap(&frame);
+    return;
+  }
 
   VideoFrame vf = {0};
-  vf.data[0] = Y_plane;
-  vf.data[1] = UV_plane;
-  vf.linesize[0] = stride_Y;
-  vf.linesize[1] = stride_UV;
-  vf.timestamp = pts;
+  for (guint i = 0; i < GST_VIDEO_FRAME_N_PLANES(&frame); i++) {
+    vf.data[i] = (uint8_t*)GST_VIDEO_FRAME_PLANE_DATA(&frame, i);
+    vf.linesize[i] = GST_VIDEO_FRAME_PLANE_STRIDE(&frame, i);
+  }
+  vf.timestamp = GST_BUFFER_PTS(buffer);
 
-  // write to virtual camera module
+  // write to virtual camera module, the queue packs the planes
   virtual_video(app->virtualcam, &vf);
 
-  gst_buffer_unmap(buffer, &map);
-  gst_sample_unref(sample);
+  gst_video_frame_unmap(&frame);
+}
 
+// Video sample callback from the appsink's streaming thread, only hands the
+// sample over so decoding goes on while the writer copies
+static GstFlowReturn on_new_video_sample(GstAppSink* sink, gpointer user_data) {
+  App* app = (App*)user_data;
+  GstSample* sample = gst_app_sink_pull_sample(sink);
+  if (sample == nullptr) {
+    LOGE("failed to get sample from appsink\n");
+    return GST_FLOW_ERROR;
+  }
+
+  GstBuffer* buffer = gst_sample_get_buffer(sample);
+  if (buffer != nullptr) {
+    latency_trace_stamp(app->latency, GST_BUFFER_PTS(buffer),
+                        LATENCY_STAGE_SINK);
+  }
+
+  if (!sample_handoff_push(app->video_writer, sample)) {
+    LOGD("video writer busy, replaced the frame it hadn't taken yet\n");
+  }
   return GST_FLOW_OK;
 }
 
-// Audio buffer callback from appsink element
-static GstFlowReturn on_new_audio_sample(GstElement* sink, App* app) {
-  GstSample* sample = gst_app_sink_pull_sample(GST_APP_SINK(sink));
+// Offers the queue slots as upstream's output buffers when the negotiated
+// format can be stored in them unchanged
+static void propose_slot_pool(App* app, GstQuery* query) {
+  GstCaps* caps = nullptr;
+  gboolean need_pool = FALSE;
+  gst_query_parse_allocation(query, &caps, &need_pool);
+
+  GstVideoInfo info;
+  if (app->virtualcam == nullptr || caps == nullptr ||
+      !gst_video_info_from_caps(&info, caps) ||
+      !slot_buffer_pool_accepts(app->virtualcam, &info)) {
+    return;
+  }
+
+  if (app->slot_pool == nullptr) {
+    app->slot_pool = slot_buffer_pool_new(app->virtualcam);
+  }
+
+  guint slots = (guint)virtualcam_get_slot_count(app->virtualcam);
+  gst_query_add_allocation_pool(query, app->slot_pool, (guint)info.size, 0,
+                                slots);
+}
+
+// Starts the virtual camera with the size and rate upstream negotiated, before
+// the allocation query so the slot pool can be offered right away
+static void on_video_caps(App* app, GstCaps* caps) {
+  GstVideoInfo info;
+  if (!gst_video_info_from_caps(&info, caps)) {
+    LOGE("Could not get video info from caps.\n");
+    return;
+  }
+
+  // the queue carries these as they are, the readers convert
+  enum virtualcam_video_format format;
+  if (!video_format_to_virtualcam(GST_VIDEO_INFO_FORMAT(&info), &format)) {
+    LOGE("video format %s is not supported, use NV12, I420, YUY2, "
+         "P010_10LE or RGBA\n",
+         GST_VIDEO_INFO_NAME(&info));
+    g_atomic_int_set(&app->format_mismatch, TRUE);
+    return;
+  }
+
+  uint32_t cx, cy;
+  if (virtualcam_get_size(app->virtualcam, &cx, &cy)) {
+    // the readers have the size and format in their queue header, there is
+    // no telling them it changed
+    gboolean mismatch = cx != (uint32_t)GST_VIDEO_INFO_WIDTH(&info) ||
+                        cy != (uint32_t)GST_VIDEO_INFO_HEIGHT(&info) ||
+                        format != virtualcam_get_format(app->virtualcam);
+    g_atomic_int_set(&app->format_mismatch, mismatch);
+    if (mismatch) {
+      LOGE("video changed from %ux%u to %dx%d %s, restart to pick it up\n",
+           cx, cy, GST_VIDEO_INFO_WIDTH(&info), GST_VIDEO_INFO_HEIGHT(&info),
+           GST_VIDEO_INFO_NAME(&info));
+    }
+    return;
+  }
+  g_atomic_int_set(&app->format_mismatch, FALSE);
+
+  // variable or unknown frame rate, the filter still needs a default
+  uint64_t interval = 10000000ULL / 30;
+  if (GST_VIDEO_INFO_FPS_N(&info) > 0 && GST_VIDEO_INFO_FPS_D(&info) > 0) {
+    interval = gst_util_uint64_scale(10000000ULL, GST_VIDEO_INFO_FPS_D(&info),
+                                     GST_VIDEO_INFO_FPS_N(&info));
+  }
+
+  LOGI("starting virtual camera at %dx%d %s, %d/%d fps\n",
+       GST_VIDEO_INFO_WIDTH(&info), GST_VIDEO_INFO_HEIGHT(&info),
+       GST_VIDEO_INFO_NAME(&info), GST_VIDEO_INFO_FPS_N(&info),
+       GST_VIDEO_INFO_FPS_D(&info));
+  virtualcam_set_format(app->virtualcam, format);
+  if (!virtualcam_start_interval(app->virtualcam, GST_VIDEO_INFO_WIDTH(&info),
+                                 GST_VIDEO_INFO_HEIGHT(&info), interval)) {
+    LOGE("failed to start the virtual camera\n");
+  }
+}
+
+static GstPadProbeReturn on_video_sink_event(GstPad* pad,
+                                             GstPadProbeInfo* info,
+                                             App* app) {
+  GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+  if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+    GstCaps* caps = nullptr;
+    gst_event_parse_caps(event, &caps);
+    on_video_caps(app, caps);
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+// Lets upstream know the video sink understands GstVideoMeta, so decoders can
+// hand over padded frames as they are instead of copying them into a packed
+// layout first
+static GstPadProbeReturn on_video_sink_query(GstPad* pad,
+                                             GstPadProbeInfo* info,
+                                             App* app) {
+  GstQuery* query = GST_PAD_PROBE_INFO_QUERY(info);
+  if (GST_QUERY_TYPE(query) == GST_QUERY_ALLOCATION) {
+    propose_slot_pool(app, query);
+    gst_query_add_allocation_meta(query, GST_VIDEO_META_API_TYPE, nullptr);
+  }
+  return GST_PAD_PROBE_OK;
+}
+
+// Starts the virtual microphone with the format of the first audio sample
+static bool start_audio(App* app, GstSample* sample) {
+  if (app->audio_info != nullptr) {
+    return true;
+  }
+
+  GstAudioInfo audio_info_;
+  gst_audio_info_init(&audio_info_);
+
+  GstCaps* caps = gst_sample_get_caps(sample);
+  if (!gst_audio_info_from_caps(&audio_info_, caps)) {
+    LOGE("Could not get audio info from caps.\n");
+    return false;
+  }
+
+  virtualcam_audio_format format;
+  switch (GST_AUDIO_INFO_FORMAT(&audio_info_)) {
+    case GST_AUDIO_FORMAT_S16LE:
+      format = VIRTUALCAM_AUDIO_S16;
+      break;
+    case GST_AUDIO_FORMAT_F32LE:
+      format = VIRTUALCAM_AUDIO_F32;
+      break;
+    default:
+      LOGE("Unsupported audio format %s.\n",
+           GST_AUDIO_INFO_NAME(&audio_info_));
+      return false;
+  }
+  if (GST_AUDIO_INFO_LAYOUT(&audio_info_) != GST_AUDIO_LAYOUT_INTERLEAVED) {
+    LOGE("Audio must be interleaved.\n");
+    return false;
+  }
+
+  LOGI("The audio format of the buffer is %s, %d Hz, %d channels.\n",
+       GST_AUDIO_INFO_NAME(&audio_info_), GST_AUDIO_INFO_RATE(&audio_info_),
+       GST_AUDIO_INFO_CHANNELS(&audio_info_));
+
+  if (!virtualcam_start_audio(app->virtualcam,
+                              GST_AUDIO_INFO_RATE(&audio_info_),
+                              GST_AUDIO_INFO_CHANNELS(&audio_info_), format)) {
+    LOGE("Could not start the virtual microphone.\n");
+    return false;
+  }
+
+  app->audio_info = gst_audio_info_copy(&audio_info_);
+  return true;
+}
+
+// Audio buffer callback from appsink element, audio is small enough to be
+// written right on the streaming thread
+static GstFlowReturn on_new_audio_sample(GstAppSink* sink, gpointer user_data) {
+  App* app = (App*)user_data;
+  GstSample* sample = gst_app_sink_pull_sample(sink);
   if (sample == nullptr) {
     LOGE("failed to get sample from appsink\n");
     return GST_FLOW_ERROR;
@@ -225,6 +462,19 @@ static GstFlowReturn on_new_audio_sample(GstElement* sink, App* app) {
     return GST_FLOW_ERROR;
   }
 
+  // the microphone lives next to the camera's queue, which only exists once
+  // the video caps are known
+  uint32_t cx, cy;
+  if (!virtualcam_get_size(app->virtualcam, &cx, &cy)) {
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+  }
+
+  if (!start_audio(app, sample)) {
+    gst_sample_unref(sample);
+    return GST_FLOW_ERROR;
+  }
+
   GstMapInfo map;
   if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
     LOGE("failed to map buffer\n");
@@ -232,35 +482,68 @@ static GstFlowReturn on_new_audio_sample(GstElement* sink, App* app) {
     return GST_FLOW_ERROR;
   }
 
+  AudioFrame af = {0};
+  af.data[0] = map.data;
+  af.frames = (uint32_t)(map.size / GST_AUDIO_INFO_BPF(app->audio_info));
+  af.timestamp = GST_BUFFER_PTS(buffer);
+
+  // write to the virtual microphone, frames the reader has no room for are
+  // dropped
+  virtual_audio(app->virtualcam, &af);
+
   gst_buffer_unmap(buffer, &map);
   gst_sample_unref(sample);
 
   return GST_FLOW_OK;
 }
 
-static int init(App* app) {
-  gchar* video_pipeline = g_strdup_printf(
-      "rtspsrc location=rtsp://172.16.30.55/1 latency=50 protocols=4 ! queue "
-      "! rtph264depay ! h264parse ! queue ! d3d11h264dec ! queue ! "
-      "video/x-raw,format=NV12,width=1920,height=1080,framerate=30/1 ! queue ! "
-      "appsink name=videosink");
-  const gchar* audio_pipeline =
-      "audiotestsrc is-live=true wave=sine ! audioconvert ! queue ! appsink "
-      "name=audiosink";
+// Traces buffers leaving the element with the given name, if the pipeline has
+// one
+static void trace_element(App* app, const gchar* name, const gchar* pad_name,
+                          LatencyStage stage) {
+  GstElement* element = gst_bin_get_by_name(GST_BIN(app->pipeline), name);
+  if (element == nullptr) {
+    return;
+  }
+
+  GstPad* pad = gst_element_get_static_pad(element, pad_name);
+  if (pad != nullptr) {
+    latency_trace_watch(app->latency, pad, stage);
+    gst_object_unref(pad);
+  }
+  gst_object_unref(element);
+}
 
-  auto pipeline_desc = g_strdup_printf("%s %s", video_pipeline, audio_pipeline);
-  g_free(video_pipeline);
+static int init(App* app, const AppConfig& config) {
+  std::string desc = app_config_pipeline(config);
+  const gchar* pipeline_desc = desc.c_str();
 
   // create the pipeline
   GError* error = nullptr;
   app->pipeline = gst_parse_launch(pipeline_desc, &error);
   if (app->pipeline == nullptr || error != nullptr) {
-    g_free(pipeline_desc);
-    LOGE("failed to create pipeline, erorr: %s\n", error->message);
+    LOGE("failed to create pipeline, erorr: %s\n",
+         error != nullptr ? error->message : "unknown");
+    g_clear_error(&error);
     return -11;
   }
   LOGI("Running pipeline:\n\n%s\n\n", pipeline_desc);
-  g_free(pipeline_desc);
+
+  // only the generated pipeline is known to name its decoder
+  GstElement* decoder = gst_bin_get_by_name(GST_BIN(app->pipeline), "decoder");
+  if (decoder != nullptr) {
+    decoder_configure(decoder, config.threads);
+    if (config.decode_stats) {
+      decoder_watch(decoder);
+    }
+    gst_object_unref(decoder);
+  }
+
+  // "rtp" is the queue right behind the network source, readers of the
+  // camera add the rest of each frame's trip
+  app->latency = latency_trace_new();
+  trace_element(app, "rtp", "sink", LATENCY_STAGE_RECEIVED);
+  trace_element(app, "decoder", "src", LATENCY_STAGE_DECODED);
 
   // register appsink callback
   // video
@@ -269,23 +552,35 @@ static int init(App* app) {
     LOGE("app sink not found\n");
     return -12;
   }
-  g_object_set(app->video_sink, "emit-signals", TRUE, nullptr);
   g_object_set(app->video_sink, "max-buffers", 1, NULL);
   g_object_set(app->video_sink, "drop", TRUE, NULL);
-  g_signal_connect(app->video_sink, "new-sample",
-                   G_CALLBACK(on_new_video_sample), app);
-
-  // audio
+  // callbacks instead of signals, no marshalling per sample
+  app->video_writer = sample_handoff_new(
+      "video", (SampleHandoffFunc)write_video_sample, app);
+  GstAppSinkCallbacks video_callbacks = {};
+  video_callbacks.new_sample = on_new_video_sample;
+  gst_app_sink_set_callbacks(GST_APP_SINK(app->video_sink), &video_callbacks,
+                             app, nullptr);
+
+  GstPad* video_pad = gst_element_get_static_pad(app->video_sink, "sink");
+  gst_pad_add_probe(video_pad, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+                    (GstPadProbeCallback)on_video_sink_query, app, nullptr);
+  gst_pad_add_probe(video_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                    (GstPadProbeCallback)on_video_sink_event, app, nullptr);
+  gst_object_unref(video_pad);
+
+  // audio, optional
   app->audio_sink = gst_bin_get_by_name(GST_BIN(app->pipeline), "audiosink");
-  if (app->audio_sink == nullptr) {
-    LOGE("app sink not found\n");
-    return -12;
+  if (app->audio_sink != nullptr) {
+    g_object_set(app->audio_sink, "max-buffers", 30, NULL);
+    g_object_set(app->audio_sink, "drop", TRUE, NULL);
+    GstAppSinkCallbacks audio_callbacks = {};
+    audio_callbacks.new_sample = on_new_audio_sample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(app->audio_sink), &audio_callbacks,
+                               app, nullptr);
+  } else {
+    LOGI("no audiosink in the pipeline, microphone disabled\n");
   }
-  g_object_set(app->audio_sink, "emit-signals", TRUE, nullptr);
-  g_object_set(app->audio_sink, "max-buffers", 30, NULL);
-  g_object_set(app->audio_sink, "drop", TRUE, NULL);
-  g_signal_connect(app->audio_sink, "new-sample",
-                   G_CALLBACK(on_new_audio_sample), app);
 
   // set the pipeline to READY and return
   if (!update_pipeline_state(app, GST_STATE_READY)) {
@@ -305,7 +600,18 @@ static void deinit(App* app) {
 
   // reset the pipeline state to NULL
   update_pipeline_state(app, GST_STATE_NULL);
+  // no more samples come in now, let the writer finish the one it has
+  sample_handoff_free(app->video_writer);
+  app->video_writer = nullptr;
+  latency_trace_free(app->latency);
+  app->latency = nullptr;
   // free resources
+  gst_buffer_replace(&app->published, nullptr);
+  gst_clear_object(&app->slot_pool);
+  if (app->audio_info != nullptr) {
+    gst_audio_info_free(app->audio_info);
+    app->audio_info = nullptr;
+  }
   g_main_loop_unref(app->loop);
   app->loop = nullptr;
   gst_object_unref(app->video_sink);
@@ -377,32 +683,67 @@ int main(int argc, char* argv[]) {
   LOGI("GStreamer version: %s\n", gst_version_string());
   LOGI("GStreamer init...\n");
 
-  // init gstreamer
-  gst_init(nullptr, nullptr);
+  // read the config and the command line, this also inits gstreamer
+  AppConfig config;
+  GError* error = nullptr;
+  if (!app_config_load(&config, &argc, &argv, &error)) {
+    LOGE("%s\n", error != nullptr ? error->message : "invalid arguments");
+    g_clear_error(&error);
+    return -1;
+  }
   LOGI("GStreamer initialized\n");
 
+  if (config.pipeline.empty() && config.decoder == "auto") {
+    config.decoder = decoder_select();
+    if (config.decoder.empty()) {
+      return -1;
+    }
+  }
+
+  if (config.instance >= virtualcam_max_instances()) {
+    LOGE("instance must be below %u\n", virtualcam_max_instances());
+    return -1;
+  }
+
   // create app
   App app;
   main_app = &app;
 
+  // init virtualcam, it is started once the video caps are known
+  app.virtualcam = virtualcam_create_instance(config.instance);
+  virtualcam_set_slots(app.virtualcam, config.slots);
+  for (const RenditionConfig& rendition : config.renditions) {
+    enum virtualcam_video_format format;
+    if (!video_format_to_virtualcam(
+            gst_video_format_from_string(rendition.format.c_str()),
+            &format) ||
+        !virtualcam_add_rendition(app.virtualcam, format, rendition.width,
+                                  rendition.height)) {
+      LOGE("can't publish a %ux%u %s rendition, NV12, I420 and YUY2 at even "
+           "sizes, up to four of them\n",
+           rendition.width, rendition.height, rendition.format.c_str());
+      virtualcam_destroy(app.virtualcam);
+      return -1;
+    }
+  }
+
   LOGI("App init...\n");
   // init app
-  int ret = init(&app);
+  int ret = init(&app, config);
   if (ret != 0) {
     // can not init the app, exit it.
+    virtualcam_destroy(app.virtualcam);
     return ret;
   }
   LOGI("App initialized\n");
 
-  // init virtualcam
-  app.virtualcam = virtualcam_create();
-  virtualcam_start(app.virtualcam, 1920, 1080, 30);
-
   // create mainloop and run it
   run(&app);
 
   // release app
   deinit(&app);
+  // after the pipeline, its buffers point into the queue
+  virtualcam_destroy(app.virtualcam);
   LOGI("App shutdown\n");
 
   // deinit gstreamer
@@ -0,0 +1,145 @@
+#include "sample-handoff.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "local-debug.h"
+
+struct SampleHandoff {
+  std::string name;
+  SampleHandoffFunc func = nullptr;
+  gpointer user_data = nullptr;
+
+  // The sample the writer hasn't taken yet, if any. A newer one replaces it,
+  // so a writer that fell behind publishes the latest frame rather than a
+  // backlog, and holds on to at most one decoder buffer besides its own.
+  alignas(64) std::atomic<GstSample*> pending{nullptr};
+
+  // only used to put the writer to sleep, the producer takes the lock just
+  // when the writer said it is about to wait
+  std::mutex lock;
+  std::condition_variable cond;
+  std::atomic<bool> sleeping{false};
+  std::atomic<bool> stopping{false};
+
+  std::atomic<uint64_t> pushed{0};
+  std::atomic<uint64_t> dropped{0};
+
+  std::thread thread;
+};
+
+static void pin_writer_thread(SampleHandoff* handoff) {
+  unsigned cores = std::thread::hardware_concurrency();
+  if (cores <= 2) {
+    return;
+  }
+
+#ifdef _WIN32
+  // the mask only covers the first processor group
+  if (cores > sizeof(DWORD_PTR) * 8) {
+    cores = sizeof(DWORD_PTR) * 8;
+  }
+  bool ok = SetThreadAffinityMask(GetCurrentThread(),
+                                  (DWORD_PTR)1 << (cores - 1)) != 0;
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL);
+#else
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cores - 1, &set);
+  bool ok = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+
+  if (ok) {
+    LOGI("%s writer pinned to core %u\n", handoff->name.c_str(), cores - 1);
+  } else {
+    LOGW("%s writer could not be pinned\n", handoff->name.c_str());
+  }
+}
+
+static void writer_loop(SampleHandoff* handoff) {
+  pin_writer_thread(handoff);
+
+  while (!handoff->stopping.load()) {
+    GstSample* sample =
+        handoff->pending.exchange(nullptr, std::memory_order_acquire);
+    if (sample != nullptr) {
+      handoff->func(sample, handoff->user_data);
+      gst_sample_unref(sample);
+      continue;
+    }
+
+    // announce the wait before looking at the mailbox one last time, a
+    // producer that pushed in between either sees the flag or got seen here
+    handoff->sleeping.store(true);
+    if (handoff->pending.load() == nullptr && !handoff->stopping.load()) {
+      std::unique_lock<std::mutex> guard(handoff->lock);
+      handoff->cond.wait(guard, [handoff] {
+        return handoff->pending.load() != nullptr || handoff->stopping.load();
+      });
+    }
+    handoff->sleeping.store(false, std::memory_order_relaxed);
+  }
+}
+
+SampleHandoff* sample_handoff_new(const char* name, SampleHandoffFunc func,
+                                  gpointer user_data) {
+  SampleHandoff* handoff = new SampleHandoff();
+  handoff->name = name;
+  handoff->func = func;
+  handoff->user_data = user_data;
+  handoff->thread = std::thread(writer_loop, handoff);
+  return handoff;
+}
+
+bool sample_handoff_push(SampleHandoff* handoff, GstSample* sample) {
+  GstSample* stale = handoff->pending.exchange(sample);
+  handoff->pushed.fetch_add(1, std::memory_order_relaxed);
+
+  if (handoff->sleeping.load()) {
+    std::lock_guard<std::mutex> guard(handoff->lock);
+    handoff->cond.notify_one();
+  }
+
+  if (stale != nullptr) {
+    handoff->dropped.fetch_add(1, std::memory_order_relaxed);
+    gst_sample_unref(stale);
+    return false;
+  }
+  return true;
+}
+
+void sample_handoff_free(SampleHandoff* handoff) {
+  if (handoff == nullptr) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(handoff->lock);
+    handoff->stopping.store(true);
+    handoff->cond.notify_one();
+  }
+  if (handoff->thread.joinable()) {
+    handoff->thread.join();
+  }
+
+  GstSample* sample = handoff->pending.exchange(nullptr);
+  if (sample != nullptr) {
+    gst_sample_unref(sample);
+  }
+
+  LOGI("%s writer: %llu samples, %llu replaced while it was busy\n",
+       handoff->name.c_str(), (unsigned long long)handoff->pushed.load(),
+       (unsigned long long)handoff->dropped.load());
+  delete handoff;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <gst/gst.h>
+
+// Moves samples from an appsink's streaming thread to a writer thread of its
+// own, so a slow write into shared memory never holds up the decoder. The
+// streaming thread is the only producer and the writer the only consumer,
+// pushing never blocks and never takes a lock the writer holds while writing.
+struct SampleHandoff;
+
+// Called on the writer thread for the latest sample pushed, the sample is
+// unreffed after it returns.
+typedef void (*SampleHandoffFunc)(GstSample* sample, gpointer user_data);
+
+// Starts the writer thread, pinned to the last core when there are more than
+// two so it doesn't get moved around under the streaming threads.
+SampleHandoff* sample_handoff_new(const char* name, SampleHandoffFunc func,
+                                  gpointer user_data);
+
+// Takes the sample. A sample the writer hasn't taken yet is replaced by it and
+// dropped, returns false then.
+bool sample_handoff_push(SampleHandoff* handoff, GstSample* sample);
+
+// Stops the writer once it is done with the current sample, a sample still
+// waiting is dropped. Must not race with sample_handoff_push, i.e. stop the
+// pipeline first.
+void sample_handoff_free(SampleHandoff* handoff);
@@ -0,0 +1,211 @@
+#include "slot-buffer-pool.h"
+
+#include "camera/virtualcam.h"
+#include "video-format.h"
+
+struct _SlotBufferPool {
+  GstBufferPool parent;
+
+  void* virtualcam;
+  GstVideoInfo info;
+  gboolean add_video_meta;
+
+  // one bit per slot that currently backs a buffer of this pool
+  GMutex lock;
+  guint32 used_slots;
+};
+
+G_DEFINE_TYPE(SlotBufferPool, slot_buffer_pool, GST_TYPE_BUFFER_POOL)
+
+static GQuark slot_quark() {
+  static GQuark quark = g_quark_from_static_string("virtualcam-slot");
+  return quark;
+}
+
+gboolean slot_buffer_pool_accepts(void* virtualcam, const GstVideoInfo* info) {
+  uint32_t cx, cy;
+  enum virtualcam_video_format format;
+  if (!virtualcam_get_size(virtualcam, &cx, &cy) ||
+      !video_format_to_virtualcam(GST_VIDEO_INFO_FORMAT(info), &format) ||
+      format != virtualcam_get_format(virtualcam) ||
+      GST_VIDEO_INFO_WIDTH(info) != (gint)cx ||
+      GST_VIDEO_INFO_HEIGHT(info) != (gint)cy) {
+    return FALSE;
+  }
+
+  // the readers expect the planes packed the way the queue lays them out,
+  // anything else has to be copied
+  size_t offsets[MAX_AV_PLANES];
+  uint32_t linesize[MAX_AV_PLANES];
+  uint32_t planes = virtualcam_get_planes(virtualcam, offsets, linesize);
+  if (planes != GST_VIDEO_INFO_N_PLANES(info)) {
+    return FALSE;
+  }
+  for (uint32_t i = 0; i < planes; i++) {
+    if (GST_VIDEO_INFO_PLANE_OFFSET(info, i) != offsets[i] ||
+        GST_VIDEO_INFO_PLANE_STRIDE(info, i) != (gint)linesize[i]) {
+      return FALSE;
+    }
+  }
+
+  size_t size = 0;
+  return virtualcam_get_slot(virtualcam, 0, &size) != nullptr &&
+         GST_VIDEO_INFO_SIZE(info) <= size;
+}
+
+static const gchar** slot_buffer_pool_get_options(GstBufferPool* pool) {
+  static const gchar* options[] = {GST_BUFFER_POOL_OPTION_VIDEO_META,
+                                   nullptr};
+  return options;
+}
+
+static gboolean slot_buffer_pool_set_config(GstBufferPool* pool,
+                                            GstStructure* config) {
+  SlotBufferPool* self = SLOT_BUFFER_POOL(pool);
+
+  GstCaps* caps;
+  guint size, min_buffers, max_buffers;
+  if (!gst_buffer_pool_config_get_params(config, &caps, &size, &min_buffers,
+                                         &max_buffers) ||
+      caps == nullptr) {
+    return FALSE;
+  }
+
+  GstVideoInfo info;
+  if (!gst_video_info_from_caps(&info, caps) ||
+      !slot_buffer_pool_accepts(self->virtualcam, &info)) {
+    return FALSE;
+  }
+
+  // there are only as many buffers as slots
+  guint slots = (guint)virtualcam_get_slot_count(self->virtualcam);
+  if (min_buffers > slots) {
+    return FALSE;
+  }
+  gst_buffer_pool_config_set_params(config, caps, (guint)info.size,
+                                    min_buffers, slots);
+
+  self->info = info;
+  self->add_video_meta = gst_buffer_pool_config_has_option(
+      config, GST_BUFFER_POOL_OPTION_VIDEO_META);
+
+  return GST_BUFFER_POOL_CLASS(slot_buffer_pool_parent_class)
+      ->set_config(pool, config);
+}
+
+static GstFlowReturn slot_buffer_pool_alloc_buffer(
+    GstBufferPool* pool, GstBuffer** buffer,
+    GstBufferPoolAcquireParams* params) {
+  SlotBufferPool* self = SLOT_BUFFER_POOL(pool);
+  guint slots = (guint)virtualcam_get_slot_count(self->virtualcam);
+
+  g_mutex_lock(&self->lock);
+  guint idx = 0;
+  while (idx < slots && (self->used_slots & (1u << idx)) != 0) {
+    idx++;
+  }
+
+  size_t size = 0;
+  guint8* data =
+      idx < slots ? virtualcam_get_slot(self->virtualcam, idx, &size) : nullptr;
+  if (data == nullptr || size < self->info.size) {
+    g_mutex_unlock(&self->lock);
+    return GST_FLOW_ERROR;
+  }
+  self->used_slots |= 1u << idx;
+  g_mutex_unlock(&self->lock);
+
+  // the memory belongs to the shared queue, the buffer only borrows it
+  GstBuffer* buf = gst_buffer_new();
+  gst_buffer_append_memory(
+      buf, gst_memory_new_wrapped(GST_MEMORY_FLAG_NO_SHARE, data, size, 0,
+                                  self->info.size, nullptr, nullptr));
+
+  if (self->add_video_meta) {
+    GstVideoMeta* meta = gst_buffer_add_video_meta_full(
+        buf, GST_VIDEO_FRAME_FLAG_NONE, GST_VIDEO_INFO_FORMAT(&self->info),
+        GST_VIDEO_INFO_WIDTH(&self->info), GST_VIDEO_INFO_HEIGHT(&self->info),
+        GST_VIDEO_INFO_N_PLANES(&self->info), self->info.offset,
+        self->info.stride);
+    // keep it across reset_buffer, the layout never changes
+    meta->meta.flags = (GstMetaFlags)(meta->meta.flags | GST_META_FLAG_POOLED);
+  }
+
+  gst_mini_object_set_qdata(GST_MINI_OBJECT(buf), slot_quark(),
+                            GUINT_TO_POINTER(idx + 1), nullptr);
+
+  *buffer = buf;
+  return GST_FLOW_OK;
+}
+
+// Upstream is about to write into the slot, let readers know it is no longer
+// a complete frame.
+static GstFlowReturn slot_buffer_pool_acquire_buffer(
+    GstBufferPool* pool, GstBuffer** buffer,
+    GstBufferPoolAcquireParams* params) {
+  SlotBufferPool* self = SLOT_BUFFER_POOL(pool);
+
+  GstFlowReturn ret =
+      GST_BUFFER_POOL_CLASS(slot_buffer_pool_parent_class)
+          ->acquire_buffer(pool, buffer, params);
+  if (ret == GST_FLOW_OK) {
+    virtualcam_begin_slot(self->virtualcam,
+                          slot_buffer_pool_get_slot(*buffer));
+  }
+  return ret;
+}
+
+static void slot_buffer_pool_free_buffer(GstBufferPool* pool,
+                                         GstBuffer* buffer) {
+  SlotBufferPool* self = SLOT_BUFFER_POOL(pool);
+  gint idx = slot_buffer_pool_get_slot(buffer);
+
+  if (idx >= 0) {
+    g_mutex_lock(&self->lock);
+    self->used_slots &= ~(1u << idx);
+    g_mutex_unlock(&self->lock);
+  }
+
+  GST_BUFFER_POOL_CLASS(slot_buffer_pool_parent_class)
+      ->free_buffer(pool, buffer);
+}
+
+static void slot_buffer_pool_finalize(GObject* object) {
+  SlotBufferPool* self = SLOT_BUFFER_POOL(object);
+  g_mutex_clear(&self->lock);
+
+  G_OBJECT_CLASS(slot_buffer_pool_parent_class)->finalize(object);
+}
+
+static void slot_buffer_pool_class_init(SlotBufferPoolClass* klass) {
+  GObjectClass* object_class = G_OBJECT_CLASS(klass);
+  GstBufferPoolClass* pool_class = GST_BUFFER_POOL_CLASS(klass);
+
+  object_class->finalize = slot_buffer_pool_finalize;
+
+  pool_class->get_options = slot_buffer_pool_get_options;
+  pool_class->set_config = slot_buffer_pool_set_config;
+  pool_class->acquire_buffer = slot_buffer_pool_acquire_buffer;
+  pool_class->alloc_buffer = slot_buffer_pool_alloc_buffer;
+  pool_class->free_buffer = slot_buffer_pool_free_buffer;
+}
+
+static void slot_buffer_pool_init(SlotBufferPool* self) {
+  g_mutex_init(&self->lock);
+  gst_video_info_init(&self->info);
+}
+
+GstBufferPool* slot_buffer_pool_new(void* virtualcam) {
+  SlotBufferPool* self =
+      SLOT_BUFFER_POOL(g_object_new(SLOT_TYPE_BUFFER_POOL, nullptr));
+  gst_object_ref_sink(self);
+
+  self->virtualcam = virtualcam;
+  return GST_BUFFER_POOL(self);
+}
+
+gint slot_buffer_pool_get_slot(GstBuffer* buffer) {
+  guint idx = GPOINTER_TO_UINT(
+      gst_mini_object_get_qdata(GST_MINI_OBJECT(buffer), slot_quark()));
+  return (gint)idx - 1;
+}
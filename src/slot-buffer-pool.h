@@ -0,0 +1,25 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+G_BEGIN_DECLS
+
+// A buffer pool whose buffers are the frame slots of the virtual camera's
+// shared queue, so upstream decodes straight into shared memory and the
+// writer only has to publish the slot index.
+#define SLOT_TYPE_BUFFER_POOL (slot_buffer_pool_get_type())
+G_DECLARE_FINAL_TYPE(SlotBufferPool, slot_buffer_pool, SLOT, BUFFER_POOL,
+                     GstBufferPool)
+
+// Returns true when frames described by info can live in the slots as they
+// are, i.e. the camera's format and size without row or plane padding.
+gboolean slot_buffer_pool_accepts(void* virtualcam, const GstVideoInfo* info);
+
+GstBufferPool* slot_buffer_pool_new(void* virtualcam);
+
+// Slot index of a buffer handed out by a SlotBufferPool, -1 for any other
+// buffer.
+gint slot_buffer_pool_get_slot(GstBuffer* buffer);
+
+G_END_DECLS
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <gst/video/video.h>
+
+#include "camera/virtualcam.h"
+
+// The raw formats the virtual camera carries without converting them on the
+// writer side, false for anything else.
+static inline bool video_format_to_virtualcam(
+    GstVideoFormat format, enum virtualcam_video_format* out) {
+  switch (format) {
+    case GST_VIDEO_FORMAT_NV12:
+      *out = VIRTUALCAM_VIDEO_NV12;
+      return true;
+    case GST_VIDEO_FORMAT_I420:
+      *out = VIRTUALCAM_VIDEO_I420;
+      return true;
+    case GST_VIDEO_FORMAT_YUY2:
+      *out = VIRTUALCAM_VIDEO_YUY2;
+      return true;
+    case GST_VIDEO_FORMAT_P010_10LE:
+      *out = VIRTUALCAM_VIDEO_P010;
+      return true;
+    case GST_VIDEO_FORMAT_RGBA:
+      *out = VIRTUALCAM_VIDEO_RGBA;
+      return true;
+    default:
+      return false;
+  }
+}